@@ -0,0 +1,173 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FBOUNDED_QUEUE_H
+#define _FBOUNDED_QUEUE_H
+
+#include <sched.h>
+#include "FSemaphore.h"
+
+/** Bounded multi producer, multi consumer FIFO queue.
+
+    The ring itself is lock free (Vyukov's algorithm: every slot carries a
+    sequence number, producers and consumers claim slots by advancing the tail
+    or the head with a compare and swap). Push() and Pop() block on a pair of
+    semaphores when the queue is full or empty; TryPush() and TryPop() never
+    block. A producer blocked in Push() only wakes up when a consumer frees a
+    slot: to shut down, drain the queue with TryPop() until the producers are
+    done.
+
+    T must be cheap to copy, a pointer or a small struct. */
+
+template <class T>
+class FBoundedQueue
+{
+public:
+    /// capacity is rounded up to a power of two.
+    FBoundedQueue( int _capacity )
+    : items( 0 ), free_slots( 0 )
+    {
+        capacity = 1;
+        while ( capacity < _capacity )
+            capacity *= 2;
+        mask = capacity-1;
+        slots = new Slot[capacity];
+        for ( int i=0; i<capacity; i++ )
+            slots[i].sequence = i;
+        head = tail = 0;
+        for ( int i=0; i<capacity; i++ )
+            free_slots.Signal();
+    }
+    ~FBoundedQueue() { delete [] slots; }
+
+    /// add an item, waiting for a free slot if the queue is full
+    void Push( const T& item )
+    {
+        free_slots.Wait();
+        PushSlot( item );
+        items.Signal();
+    }
+
+    /// remove the oldest item, waiting for one if the queue is empty
+    T Pop()
+    {
+        items.Wait();
+        T item;
+        PopSlot( item );
+        free_slots.Signal();
+        return item;
+    }
+
+    /// add an item if there is room; return false if the queue is full
+    bool TryPush( const T& item )
+    {
+        if ( !free_slots.TryWait() )
+            return false;
+        PushSlot( item );
+        items.Signal();
+        return true;
+    }
+
+    /// remove the oldest item if there is one; return false if the queue is empty
+    bool TryPop( T& item )
+    {
+        if ( !items.TryWait() )
+            return false;
+        PopSlot( item );
+        free_slots.Signal();
+        return true;
+    }
+
+    int Capacity() const { return capacity; }
+
+private:
+
+    struct Slot
+    {
+        volatile unsigned sequence;
+        T item;
+    };
+
+    // The semaphores guarantee that a slot is (about to be) available: a thread
+    // that got past them only has to wait for another one to finish its slot.
+    void PushSlot( const T& item ) { while ( !TryPushSlot( item ) ) sched_yield(); }
+    void PopSlot( T& item ) { while ( !TryPopSlot( item ) ) sched_yield(); }
+
+    bool TryPushSlot( const T& item )
+    {
+        unsigned pos = tail;
+        while ( true )
+        {
+            Slot* slot = &slots[pos & mask];
+            int diff = (int)slot->sequence - (int)pos;
+            if ( diff == 0 )
+            {
+                if ( __sync_bool_compare_and_swap( &tail, pos, pos+1 ) )
+                {
+                    slot->item = item;
+                    __sync_synchronize();
+                    slot->sequence = pos+1;
+                    return true;
+                }
+                pos = tail;
+            }
+            else if ( diff < 0 )
+                return false; // full
+            else
+                pos = tail;
+        }
+    }
+
+    bool TryPopSlot( T& item )
+    {
+        unsigned pos = head;
+        while ( true )
+        {
+            Slot* slot = &slots[pos & mask];
+            int diff = (int)slot->sequence - (int)(pos+1);
+            if ( diff == 0 )
+            {
+                if ( __sync_bool_compare_and_swap( &head, pos, pos+1 ) )
+                {
+                    item = slot->item;
+                    __sync_synchronize();
+                    slot->sequence = pos+capacity;
+                    return true;
+                }
+                pos = head;
+            }
+            else if ( diff < 0 )
+                return false; // empty
+            else
+                pos = head;
+        }
+    }
+
+    Slot* slots;
+    int capacity;
+    unsigned mask;
+    volatile unsigned head;
+    volatile unsigned tail;
+
+    FSemaphore items;
+    FSemaphore free_slots;
+};
+
+#endif
@@ -0,0 +1,226 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FWORKER_POOL_H
+#define _FWORKER_POOL_H
+
+#include <pthread.h>
+#include <unistd.h>
+#include <assert.h>
+#include <vector>
+
+/** Persistent pool of worker threads for the data parallel stages of a frame:
+    yape, gradients, patch preprocessing and RANSAC.
+
+    Run( func, data, task_count ) calls func( data, task ) once for every task
+    in [0, task_count), spread over the workers, and returns once all of them
+    are done. The task numbers do not depend on the number of workers, so a
+    stage that keeps per task state or random streams gives the same result on
+    every machine.
+
+    Work is handed over through a generation counter. Idle workers, and the
+    caller waiting for them, poll it for spin_count rounds before sleeping on a
+    condition variable: back to back stages of a frame start within
+    microseconds, and the pool sleeps between frames.
+
+    Contract:
+    - Run() is not reentrant. A task must not call Run(), on this pool or any
+      other: the calling worker would wait for tasks that no worker is left to
+      run, or for a run_mutex its own caller holds. Debug builds assert on it.
+      A stage that runs inside a task (say comp_gradient_mt() from a
+      preprocess task) has to call its serial version there.
+    - Calls to Run() from several threads are serialized, and Shared() is one
+      pool for the whole process: two detectors, or a detector and the
+      training producers, wait for each other's stages instead of running
+      them side by side. */
+class FWorkerPool
+{
+public:
+    typedef void (*TaskFunc)( void* data, int task );
+
+    /// _spin_count is the number of polls before an idle thread sleeps; 0 on a
+    /// single processor.
+    FWorkerPool( int num_workers, int _spin_count = 4000 )
+    : spin_count( _spin_count ), generation( 0 ), should_stop( false ),
+      func( 0 ), data( 0 ), task_count( 0 ), next_task( 0 ), active_workers( 0 )
+    {
+        assert( num_workers > 0 );
+        // spinning only delays the thread we wait for on a single processor
+        if ( ProcessorCount() < 2 )
+            spin_count = 0;
+        pthread_mutex_init( &run_mutex, 0 );
+        pthread_mutex_init( &mutex, 0 );
+        pthread_cond_init( &start_cond, 0 );
+        pthread_cond_init( &done_cond, 0 );
+
+        pthread_attr_t thread_attr;
+        pthread_attr_init( &thread_attr );
+        pthread_attr_setdetachstate( &thread_attr, PTHREAD_CREATE_JOINABLE );
+        threads.resize( num_workers );
+        for ( int i=0; i<num_workers; i++ )
+            pthread_create( &threads[i], &thread_attr, WorkerFunc, this );
+        pthread_attr_destroy( &thread_attr );
+    }
+
+    ~FWorkerPool()
+    {
+        pthread_mutex_lock( &mutex );
+        should_stop = true;
+        generation++;
+        pthread_cond_broadcast( &start_cond );
+        pthread_mutex_unlock( &mutex );
+        for ( int i=0; i<(int)threads.size(); i++ )
+            pthread_join( threads[i], 0 );
+
+        pthread_cond_destroy( &done_cond );
+        pthread_cond_destroy( &start_cond );
+        pthread_mutex_destroy( &mutex );
+        pthread_mutex_destroy( &run_mutex );
+    }
+
+    int NumWorkers() const { return (int)threads.size(); }
+
+    /// run func( data, task ) for task in [0, _task_count) and wait for completion
+    void Run( TaskFunc _func, void* _data, int _task_count )
+    {
+        if ( _task_count <= 0 )
+            return;
+        // a task calling Run() would deadlock, see the contract above
+        assert( !InWorker() );
+
+        pthread_mutex_lock( &run_mutex );
+
+        pthread_mutex_lock( &mutex );
+        func = _func;
+        data = _data;
+        task_count = _task_count;
+        next_task = 0;
+        active_workers = (int)threads.size();
+        __sync_synchronize();
+        generation++;
+        pthread_cond_broadcast( &start_cond );
+        pthread_mutex_unlock( &mutex );
+
+        for ( int i=0; i<spin_count && active_workers > 0; i++ )
+            Pause();
+        if ( active_workers > 0 )
+        {
+            pthread_mutex_lock( &mutex );
+            while ( active_workers > 0 )
+                pthread_cond_wait( &done_cond, &mutex );
+            pthread_mutex_unlock( &mutex );
+        }
+        __sync_synchronize();
+
+        pthread_mutex_unlock( &run_mutex );
+    }
+
+    /// the pool the detector stages share, one worker per processor
+    static FWorkerPool* Shared()
+    {
+        // never deleted: the workers may still be asleep in it at exit
+        static FWorkerPool* pool = new FWorkerPool( ProcessorCount() );
+        return pool;
+    }
+
+    static int ProcessorCount()
+    {
+#ifdef _SC_NPROCESSORS_ONLN
+        long count = sysconf( _SC_NPROCESSORS_ONLN );
+        return count > 0 ? (int)count : 1;
+#else
+        return 4;
+#endif
+    }
+
+private:
+
+    /// true on the worker threads of every pool
+    static bool& InWorker()
+    {
+        static __thread bool in_worker = false;
+        return in_worker;
+    }
+
+    static void Pause()
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        __asm__ __volatile__( "pause" );
+#endif
+    }
+
+    static void* WorkerFunc( void* _pool )
+    {
+        FWorkerPool* pool = (FWorkerPool*)_pool;
+        unsigned seen = 0;
+        InWorker() = true;
+
+        while ( true )
+        {
+            // wait for the next Run(), spinning first
+            for ( int i=0; i<pool->spin_count && pool->generation == seen; i++ )
+                Pause();
+            if ( pool->generation == seen )
+            {
+                pthread_mutex_lock( &pool->mutex );
+                while ( pool->generation == seen )
+                    pthread_cond_wait( &pool->start_cond, &pool->mutex );
+                pthread_mutex_unlock( &pool->mutex );
+            }
+            seen = pool->generation;
+            __sync_synchronize();
+            if ( pool->should_stop )
+                break;
+
+            int task;
+            while ( (task = __sync_fetch_and_add( &pool->next_task, 1 )) < pool->task_count )
+                pool->func( pool->data, task );
+
+            // the last one out wakes the caller; Run() cannot start again before
+            if ( __sync_sub_and_fetch( &pool->active_workers, 1 ) == 0 )
+            {
+                pthread_mutex_lock( &pool->mutex );
+                pthread_cond_signal( &pool->done_cond );
+                pthread_mutex_unlock( &pool->mutex );
+            }
+        }
+
+        return 0;
+    }
+
+    std::vector<pthread_t> threads;
+    int spin_count;
+
+    pthread_mutex_t run_mutex;
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+
+    volatile unsigned generation;
+    volatile bool should_stop;
+
+    TaskFunc func;
+    void* data;
+    int task_count;
+    volatile int next_task;
+    volatile int active_workers;
+};
+
+#endif
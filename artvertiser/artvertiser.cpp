@@ -398,11 +398,14 @@ string getSettingsString()
 {
     planar_object_recognizer &detector(multi->cams[current_cam]->detector);
     static char detector_settings_string[2048];
-    sprintf( detector_settings_string, "1.ransac dist %4.2f  2.iter %i   detected points %i match count %i,\n"
+    sprintf( detector_settings_string, "1.ransac dist %4.2f  2.iter %i (avg %i, %.0f checks)   detected points %i match count %i,\n"
             "3.refine %6.4f  4.score %6.4f  5.best_support thresh %2i  6.tau %2i\n"
-            "smoothing: 7.position %5.3f  8.position_z %5.3f  \n  frames back: 9.raw %2i  0.returned %2i",
+            "smoothing: 7.position %5.3f  8.position_z %5.3f  \n  frames back: 9.raw %2i  0.returned %2i\n"
+            "c.cascade thresh %4.2f (%s, %4.1f%% rejected)  t.tracking gate %4.1f (%s)",
             detector.ransac_dist_threshold_ui,
             detector.max_ransac_iterations_ui,
+            detector.avg_ransac_iterations,
+            detector.avg_match_evaluations,
             detector.detected_point_number,
             detector.match_number,
             detector.non_linear_refine_threshold_ui,
@@ -412,7 +415,12 @@ string getSettingsString()
             matrix_tracker.getPositionSmoothing(),
             matrix_tracker.getPositionZSmoothing(),
             matrix_tracker.getFramesBackRaw(),
-            matrix_tracker.getFramesBackReturned() );
+            matrix_tracker.getFramesBackReturned(),
+            detector.cascade_threshold_ui,
+            detector.cascade ? "on" : "no cascade",
+            detector.cascade_rejection_rate*100.0f,
+            detector.tracking_gate_radius_ui,
+            detector.tracking ? "tracking" : "searching" );
 
     return detector_settings_string;
 }
@@ -1173,6 +1181,18 @@ static void keyboard(unsigned char c, int x, int y)
         case ')':
             matrix_tracker.decreaseFramesBackReturned();
             break;
+        case 'c':
+            detector.cascade_threshold_ui = MIN(1.0f, detector.cascade_threshold_ui*1.02f);
+            break;
+        case 'C':
+            detector.cascade_threshold_ui/=1.02f;
+            break;
+        case 't':
+            detector.tracking_gate_radius_ui*=1.05f;
+            break;
+        case 'T':
+            detector.tracking_gate_radius_ui/=1.05f;
+            break;
 
 
         default:
@@ -0,0 +1,328 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * batchtrain: trains, without a camera or a display, the classifier of every
+ * advert in a models.xml whose cache (<model>.classifier) is missing or stale.
+ * A cache is stale when it is older than the model image or its .roi file, or
+ * when it was trained with another yape radius or pyramid level count. The
+ * model images and their .roi files are the ones written by the interactive
+ * setup of the artvertiser; adverts without a .roi file are skipped.
+ * Training is checkpointed in <model>.classifier/checkpoint: a run that was
+ * interrupted resumes where it stopped.
+ *
+ * Several models are trained in parallel. The cpu budget is shared between
+ * the jobs: each one generates its training views and examples, and tests
+ * its classifiers, with cpus / jobs threads. The detection stages (keypoint
+ * detection, RANSAC) run on the process-wide FWorkerPool, which is not
+ * limited by the budget.
+ *
+ * Usage:
+ *
+ *   ./batchtrain [-ml <models.xml>] [-j <jobs>] [-c <cpus>] [-f] [-n] [-s <seed>]
+ *                [-cache <dir>] [-rt <tolerance>] [-st <tolerance>]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <opencv/cv.h>
+#include <highgui.h>
+
+#include <garfeild.h>
+
+#include "ofxXmlSettings/ofxXmlSettings.h"
+
+using namespace std;
+
+// Same as CalibModel::buildCached():
+static const int MAX_MODEL_KEYPOINTS = 500;     // maximum number of keypoints on the model
+static const int PATCH_SIZE = 32;               // patch size in pixels
+static const int YAPE_RADIUS = 5;               // yape radius
+static const int NUM_TREES = 12;                // num classifier trees
+static const int NUM_GAUSSIAN_LEVELS = 3;       // num gaussian levels
+
+//! Print a command line help and exit.
+static void usage(const char *s)
+{
+    cerr << "usage:\n" << s
+         << " [-ml <models.xml>] [-j <jobs>] [-c <cpus>] [-f] [-n] [-s <seed>]\n"
+         "       [-cache <dir>] [-rt <tolerance>] [-st <tolerance>]\n\n"
+         "   -ml <file>       list of adverts (default models.xml)\n"
+         "   -j <jobs>        number of models trained in parallel (default 2)\n"
+         "   -c <cpus>        number of training threads shared by the jobs (default: online cpus);\n"
+         "                    the detection worker pool always has one thread per online cpu\n"
+         "   -f               retrain every model, even when its cache is up to date\n"
+         "   -n               only list the models that need training\n"
+         "   -s <seed>        random seed of the training (default 1)\n"
+         "   -cache <dir>     directory of the training example caches\n"
+         "   -rt <tolerance>  adaptive forest refinement tolerance (default 0: disabled)\n"
+         "   -st <tolerance>  adaptive stable point search tolerance (default 0: disabled)\n\n";
+    exit(1);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+struct training_job
+{
+    string model_file;
+    string reason;
+    int roi[8];
+    bool succeeded;
+    double seconds;
+};
+
+struct training_settings
+{
+    int threads_per_job;
+    unsigned int seed;
+    string cache_directory;
+    float refinement_tolerance;
+    double stable_point_tolerance;
+};
+
+static vector<training_job> jobs;
+static training_settings settings;
+static int next_job = 0;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//! Modification time of \a file_name, or 0 if it does not exist.
+static time_t modification_time(const string & file_name)
+{
+    struct stat st;
+    if (stat(file_name.c_str(), &st) != 0)
+        return 0;
+    return st.st_mtime;
+}
+
+//! Reads the 4 corners of the .roi file of \a model_file in \a roi.
+static bool read_roi(const string & model_file, int roi[8])
+{
+    ifstream roif((model_file + ".roi").c_str());
+    for (int i=0; i<8; i++)
+        roif >> roi[i];
+    return !roif.fail();
+}
+
+//! Sets \a reason and returns true if the classifier of \a model_file has to be (re)trained.
+static bool needs_training(const string & model_file, bool force, string & reason)
+{
+    string dirname = model_file + ".classifier";
+    time_t trained = modification_time(dirname + "/keypoints.txt");
+    if (force)
+    {
+        reason = "forced";
+        return true;
+    }
+    if (trained == 0)
+    {
+        reason = "no classifier";
+        return true;
+    }
+    if (trained < modification_time(model_file) || trained < modification_time(model_file + ".roi"))
+    {
+        reason = "classifier older than the model image or its .roi";
+        return true;
+    }
+
+    ifstream param_f((dirname + "/parameters.txt").c_str());
+    int yape_radius = 0, level_number = 0;
+    param_f >> yape_radius >> level_number;
+    if (yape_radius != YAPE_RADIUS || level_number != NUM_GAUSSIAN_LEVELS)
+    {
+        reason = "classifier trained with other parameters";
+        return true;
+    }
+    return false;
+}
+
+static void train(training_job & job)
+{
+    double start = now();
+    job.succeeded = false;
+
+    IplImage * image = cvLoadImage(job.model_file.c_str(), 0);
+    if (image == 0)
+    {
+        fprintf(stderr, "couldn't load %s\n", job.model_file.c_str());
+        return;
+    }
+
+    planar_object_recognizer * detector = new planar_object_recognizer();
+    // Same as CalibModel::buildCached():
+    detector->min_view_rate = .1;
+    detector->views_number = 1000;
+    detector->training_thread_number = settings.threads_per_job;
+    detector->random_seed = settings.seed;
+    detector->example_cache_directory = settings.cache_directory;
+    detector->refinement_tolerance = settings.refinement_tolerance;
+    detector->stable_point_tolerance = settings.stable_point_tolerance;
+    // An interrupted run resumes where it stopped:
+    detector->checkpoint_directory = job.model_file + ".classifier/checkpoint";
+
+    if (detector->build(image, MAX_MODEL_KEYPOINTS, PATCH_SIZE, YAPE_RADIUS, NUM_TREES, NUM_GAUSSIAN_LEVELS,
+                        0, job.roi))
+    {
+        detector->save(job.model_file + ".classifier");
+        job.succeeded = true;
+    }
+
+    delete detector;
+    cvReleaseImage(&image);
+    job.seconds = now() - start;
+}
+
+static void * job_thread_func(void * data)
+{
+    while (true)
+    {
+        pthread_mutex_lock(&job_mutex);
+        int index = next_job++;
+        pthread_mutex_unlock(&job_mutex);
+        if (index >= int(jobs.size()))
+            break;
+
+        training_job & job = jobs[index];
+        printf("training %s (%s)...\n", job.model_file.c_str(), job.reason.c_str());
+        train(job);
+        printf("%s %s in %.1fs\n", job.model_file.c_str(), job.succeeded ? "trained" : "FAILED", job.seconds);
+    }
+    return 0;
+}
+
+int main( int argc, char** argv )
+{
+    const char * model_file_list_file = "models.xml";
+    int job_number = 2;
+    int cpu_number = int(sysconf(_SC_NPROCESSORS_ONLN));
+    bool force = false, dry_run = false;
+    settings.seed = 1;
+    settings.refinement_tolerance = 0;
+    settings.stable_point_tolerance = 0;
+
+    for ( int i=1; i<argc; i++ )
+    {
+        if ( strcmp(argv[i], "-ml")==0 && i+1<argc )
+            model_file_list_file = argv[++i];
+        else if ( strcmp(argv[i], "-j")==0 && i+1<argc )
+            job_number = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-c")==0 && i+1<argc )
+            cpu_number = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-f")==0 )
+            force = true;
+        else if ( strcmp(argv[i], "-n")==0 )
+            dry_run = true;
+        else if ( strcmp(argv[i], "-s")==0 && i+1<argc )
+            settings.seed = (unsigned int)strtoul(argv[++i], 0, 10);
+        else if ( strcmp(argv[i], "-cache")==0 && i+1<argc )
+            settings.cache_directory = argv[++i];
+        else if ( strcmp(argv[i], "-rt")==0 && i+1<argc )
+            settings.refinement_tolerance = atof(argv[++i]);
+        else if ( strcmp(argv[i], "-st")==0 && i+1<argc )
+            settings.stable_point_tolerance = atof(argv[++i]);
+        else
+            usage(argv[0]);
+    }
+    if ( job_number < 1 || cpu_number < 1 )
+        usage(argv[0]);
+
+    ofxXmlSettings data;
+    if ( !data.loadFile( model_file_list_file ) || data.getNumTags( "artverts" ) != 1 )
+    {
+        fprintf(stderr, "error reading '%s': couldn't find 'artverts' tag\n", model_file_list_file );
+        return 1;
+    }
+
+    // Several adverts may share a model: train each one once.
+    data.pushTag( "artverts" );
+    vector<string> model_files;
+    int num_adverts = data.getNumTags( "advert" );
+    for ( int i=0; i<num_adverts; i++ )
+    {
+        data.pushTag( "advert", i );
+        string model_file = data.getValue( "model_filename", "model.bmp" );
+        data.popTag();
+        if ( find(model_files.begin(), model_files.end(), model_file) == model_files.end() )
+            model_files.push_back( model_file );
+    }
+    data.popTag();
+
+    int skipped = 0;
+    for ( int i=0; i<int(model_files.size()); i++ )
+    {
+        training_job job;
+        job.model_file = model_files[i];
+        job.succeeded = false;
+        job.seconds = 0;
+        if ( modification_time(job.model_file) == 0 || !read_roi(job.model_file, job.roi) )
+        {
+            printf("skipping %s: no model image or .roi file, run the interactive setup first\n", job.model_file.c_str());
+            skipped++;
+        }
+        else if ( needs_training(job.model_file, force, job.reason) )
+            jobs.push_back(job);
+        else
+            printf("%s: classifier up to date\n", job.model_file.c_str());
+    }
+
+    printf("%i models, %i to train, %i skipped\n", int(model_files.size()), int(jobs.size()), skipped);
+    if ( dry_run )
+    {
+        for ( int i=0; i<int(jobs.size()); i++ )
+            printf("  %s (%s)\n", jobs[i].model_file.c_str(), jobs[i].reason.c_str());
+        return 0;
+    }
+    if ( jobs.empty() )
+        return 0;
+
+    job_number = MIN(job_number, int(jobs.size()));
+    settings.threads_per_job = MAX(1, cpu_number / job_number);
+    printf("%i jobs, %i training threads each\n", job_number, settings.threads_per_job);
+
+    double start = now();
+    vector<pthread_t> threads(job_number);
+    for ( int i=0; i<job_number; i++ )
+        pthread_create(&threads[i], 0, job_thread_func, 0);
+    for ( int i=0; i<job_number; i++ )
+        pthread_join(threads[i], 0);
+
+    int failed = 0;
+    for ( int i=0; i<int(jobs.size()); i++ )
+        if ( !jobs[i].succeeded )
+            failed++;
+    printf("%i models trained, %i failed, in %.1fs\n", int(jobs.size()) - failed, failed, now() - start);
+
+    return failed == 0 ? 0 : 1;
+}
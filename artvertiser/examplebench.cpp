@@ -0,0 +1,364 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * examplebench: generates training examples from an image with
+ * affine_image_generator, warping the whole view and warping windows around
+ * the keypoints only (set_use_local_warping()), and compares the throughput
+ * and the statistics of the patches of both.
+ *
+ * With -c, it checks cached_example_generator instead: it refines a forest
+ * while writing the examples to a cache file, refines the same trees again
+ * from the file, and compares the two. With -r, it checks that a training
+ * interrupted after a refinement checkpoint and resumed with an example cache
+ * refines the forest an uninterrupted run does.
+ *
+ * Usage:
+ *
+ *   ./examplebench <image> [-p <patch size>] [-n <keypoint count>] [-b <batches>] [-e] [-c <cache file>] [-r <directory>]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <vector>
+#include <opencv/cv.h>
+#include <highgui.h>
+
+#include <garfeild.h>
+
+using namespace std;
+
+//! Print a command line help and exit.
+static void usage(const char *s)
+{
+    cerr << "usage:\n" << s
+         << " <image> [-p <patch size>] [-n <keypoint count>] [-b <batches>] [-e] [-c <cache file>] [-r <directory>]\n\n"
+         "   -p <size>   patch size (default 32)\n"
+         "   -n <count>  number of keypoints, spread over the pyramid levels (default 400, at most 1000)\n"
+         "   -b <count>  number of batches (views) per mode (default 100)\n"
+         "   -e          add the random blur, intensity changes and background noise\n"
+         "   -c <file>   check that a forest refined from the example cache <file> is the one\n"
+         "               refined while writing it, instead of benchmarking (<file> is overwritten)\n"
+         "   -r <dir>    check that a training resumed from a checkpoint, with an example cache in\n"
+         "               <dir>, refines the forest of an uninterrupted one, instead of benchmarking\n\n";
+    exit(1);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+struct patch_statistics
+{
+    int examples;
+    double seconds, pixels;
+    double mean, deviation, gradient;
+};
+
+static patch_statistics run(affine_image_generator & generator, int batches)
+{
+    patch_statistics st;
+    memset(&st, 0, sizeof(st));
+
+    // Same views for both modes:
+    gf_set_rng_seed(1);
+    generator.processed_pixel_number = 0;
+
+    double sum = 0, sum2 = 0, gradient = 0, pixel_count = 0;
+    for ( int b=0; b<batches; b++ )
+    {
+        double start = now();
+        vector<image_class_example *> * examples = generator.generate_random_examples();
+        st.seconds += now()-start;
+        st.examples += examples->size();
+
+        for ( int i=0; i<int(examples->size()); i++ )
+        {
+            IplImage * patch = (*examples)[i]->preprocessed;
+            for ( int y=0; y<patch->height; y++ )
+            {
+                const unsigned char * row = (const unsigned char *)(patch->imageData + y*patch->widthStep);
+                for ( int x=0; x<patch->width; x++ )
+                {
+                    sum += row[x];
+                    sum2 += row[x]*row[x];
+                    if ( x > 0 )
+                        gradient += abs(row[x]-row[x-1]);
+                }
+            }
+            pixel_count += patch->width*patch->height;
+        }
+
+        delete examples;
+        generator.release_examples();
+    }
+
+    st.pixels = generator.processed_pixel_number;
+    if ( pixel_count > 0 )
+    {
+        st.mean = sum/pixel_count;
+        st.deviation = sqrt(MAX(0., sum2/pixel_count - st.mean*st.mean));
+        st.gradient = gradient/pixel_count;
+    }
+    return st;
+}
+
+static void print(const char * name, const patch_statistics & st, int batches)
+{
+    printf("%s %8.0f examples/s, %6.3f Mpixels/view warped, patches: mean %6.2f, deviation %6.2f, mean |dI/dx| %5.2f\n",
+           name, st.examples/st.seconds, 1e-6*st.pixels/batches, st.mean, st.deviation, st.gradient );
+}
+
+//! Sets up \a generator for \a image, with \a keypoint_count keypoints spread over the levels.
+static void setup_generator(affine_image_generator & generator, IplImage * image, int patch_size,
+                            int keypoint_count, bool effects)
+{
+    const int level_number = 3;
+    generator.set_patch_size(patch_size);
+    generator.set_level_number(level_number);
+    generator.set_original_image(image);
+    generator.set_use_random_background(effects);
+    generator.set_add_gaussian_smoothing(effects);
+    generator.set_change_intensities(effects);
+
+    // Keypoints in the coordinates of their level, like model points:
+    generator.reset_keypoints();
+    gf_set_rng_seed(2);
+    for ( int i=0; i<keypoint_count; i++ )
+    {
+        int level = i%level_number;
+        int w = image->width >> level, h = image->height >> level;
+        if ( w <= 2*patch_size || h <= 2*patch_size )
+            continue;
+        generator.add_keypoint(float(patch_size + gf_rand(w-2*patch_size)),
+                               float(patch_size + gf_rand(h-2*patch_size)), level, i);
+    }
+}
+
+//! Compares the posteriors of \a a and \a b on a view neither was refined on.
+static bool same_posteriors(image_classification_forest & a, image_classification_forest & b,
+                            affine_image_generator & generator)
+{
+    gf_set_rng_seed(4);
+    vector<float> p_a(generator.point_number), p_b(generator.point_number);
+    bool same = true;
+    vector<image_class_example *> * examples = generator.generate_random_examples();
+    for ( int i=0; i<int(examples->size()) && same; i++ )
+    {
+        a.posterior_probabilities((*examples)[i], &p_a[0]);
+        b.posterior_probabilities((*examples)[i], &p_b[0]);
+        same = memcmp(&p_a[0], &p_b[0], p_a.size()*sizeof(float)) == 0;
+    }
+    delete examples;
+    generator.release_examples();
+    return same;
+}
+
+//! Refines the same random trees twice on \a batches batches of \a generator
+//! through a cache in \a file_name: writing the file, then reading it back.
+//! \return true if both forests give the same posteriors.
+static bool check_cache(affine_image_generator & generator, const char * file_name, int batches)
+{
+    remove(file_name);
+    int patch_size = generator.patch_size;
+    string key = generator.cache_key();
+
+    image_classification_forest written(patch_size, patch_size, generator.point_number, 8, 4);
+    image_classification_forest read(patch_size, patch_size, generator.point_number, 8, 4);
+    gf_set_rng_seed(3);
+    written.create_trees_at_random();
+    gf_set_rng_seed(3);
+    read.create_trees_at_random();
+
+    gf_set_rng_seed(1);
+    {
+        cached_example_generator cache(file_name, key, patch_size);
+        if ( !cache.is_ok() )
+            return false;
+        cache.set_source(&generator);
+        written.refine(&cache, batches);
+    }
+    {
+        // No source: every batch has to come from the file.
+        cached_example_generator cache(file_name, key, patch_size);
+        if ( cache.get_cached_batch_number() != batches )
+        {
+            printf("the cache holds %i batches instead of %i\n", cache.get_cached_batch_number(), batches );
+            return false;
+        }
+        read.refine(&cache, batches);
+    }
+
+    return same_posteriors(written, read, generator);
+}
+
+//! Refines a forest of \a recognizer's keypoints with \a batches batches, the
+//! same random trees every time.
+static image_classification_forest * refine_forest(planar_object_recognizer & recognizer, int batches)
+{
+    int patch_size = recognizer.new_images_generator.patch_size;
+    image_classification_forest * forest = new image_classification_forest(patch_size, patch_size,
+        recognizer.new_images_generator.point_number, 8, 4);
+    gf_set_rng_seed(3);
+    forest->create_trees_at_random();
+    gf_set_rng_seed(1);
+    recognizer.refine_with_training_examples(forest, batches, "forest.ckpt");
+    return forest;
+}
+
+//! Refines a forest with \a batches batches uninterrupted, then again in two
+//! runs: one stopped after a refinement checkpoint, with more batches in the
+//! example cache than the checkpoint has, and one resuming it.
+//! \return true if the uninterrupted and resumed forests give the same posteriors.
+static bool check_resume(IplImage * image, int patch_size, int keypoint_count, bool effects,
+                         const string & directory, int batches)
+{
+    // checkpoint at 2*interval, and the cache holds half an interval more:
+    int interval = batches/4;
+    int interrupted_batches = 2*interval + interval/2;
+    if ( interval < 2 )
+    {
+        printf("-r needs at least 8 batches\n");
+        return false;
+    }
+
+    string checkpoint_directory = directory + "/checkpoint";
+    mkdir(directory.c_str(), 0755);
+    mkdir(checkpoint_directory.c_str(), 0755);
+
+    planar_object_recognizer uninterrupted, interrupted, resumed;
+    planar_object_recognizer * recognizers[3] = { &uninterrupted, &interrupted, &resumed };
+    for ( int i=0; i<3; i++ )
+    {
+        setup_generator(recognizers[i]->new_images_generator, image, patch_size, keypoint_count, effects);
+        // the producer threads are the ones a resume has to start at the right batch
+        recognizers[i]->training_thread_number = 2;
+        recognizers[i]->refinement_tolerance = 0;
+        recognizers[i]->example_cache_directory = directory;
+        recognizers[i]->checkpoint_directory = checkpoint_directory;
+        recognizers[i]->checkpoint_interval = interval;
+    }
+    uninterrupted.checkpoint_directory = "";
+
+    string key = uninterrupted.new_images_generator.cache_key();
+    string cache_file = directory + "/examples-" + key + ".bin";
+    string checkpoint_file = checkpoint_directory + "/forest.ckpt";
+
+    remove(cache_file.c_str());
+    image_classification_forest * reference = refine_forest(uninterrupted, batches);
+
+    remove(cache_file.c_str());
+    remove(checkpoint_file.c_str());
+    delete refine_forest(interrupted, interrupted_batches);
+    image_classification_forest * forest = refine_forest(resumed, batches);
+
+    bool same = same_posteriors(*reference, *forest, uninterrupted.new_images_generator);
+    delete reference;
+    delete forest;
+    remove(cache_file.c_str());
+    remove(checkpoint_file.c_str());
+    rmdir(checkpoint_directory.c_str());
+    return same;
+}
+
+int main( int argc, char** argv )
+{
+    if ( argc < 2 )
+        usage(argv[0]);
+
+    int patch_size = 32;
+    int keypoint_count = 400;
+    int batches = 100;
+    bool effects = false;
+    const char * cache_file = 0;
+    const char * resume_directory = 0;
+
+    for ( int i=2; i<argc; i++ )
+    {
+        if ( strcmp(argv[i], "-p")==0 && i+1<argc )
+            patch_size = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-n")==0 && i+1<argc )
+            keypoint_count = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-b")==0 && i+1<argc )
+            batches = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-e")==0 )
+            effects = true;
+        else if ( strcmp(argv[i], "-c")==0 && i+1<argc )
+            cache_file = argv[++i];
+        else if ( strcmp(argv[i], "-r")==0 && i+1<argc )
+            resume_directory = argv[++i];
+        else
+            usage(argv[0]);
+    }
+
+    // affine_image_generator::add_keypoint() takes at most 1000 keypoints:
+    keypoint_count = MIN(keypoint_count, 1000);
+
+    IplImage * image = cvLoadImage(argv[1], 0);
+    if ( image == 0 )
+    {
+        fprintf(stderr, "couldn't load %s\n", argv[1] );
+        return 1;
+    }
+
+    if ( resume_directory )
+    {
+        bool ok = check_resume(image, patch_size, keypoint_count, effects, resume_directory, batches);
+        printf("resumed training in %s: %s\n", resume_directory, ok ? "ok" : "FAILED" );
+        cvReleaseImage(&image);
+        return ok ? 0 : 1;
+    }
+
+    affine_image_generator generator;
+    setup_generator(generator, image, patch_size, keypoint_count, effects);
+
+    if ( cache_file )
+    {
+        bool ok = check_cache(generator, cache_file, batches);
+        printf("example cache %s: %s\n", cache_file, ok ? "ok" : "FAILED" );
+        cvReleaseImage(&image);
+        return ok ? 0 : 1;
+    }
+
+    printf("%i keypoints, %ix%i patches, %i views per mode%s\n", generator.point_number,
+           patch_size, patch_size, batches, effects ? ", with blur, intensity changes and noise" : "" );
+
+    generator.set_use_local_warping(false);
+    patch_statistics full = run(generator, batches);
+    generator.set_use_local_warping(true);
+    patch_statistics local = run(generator, batches);
+
+    print("whole view:   ", full, batches);
+    print("local windows:", local, batches);
+    printf("local windows are x%.2f faster\n", (local.examples/local.seconds)/(full.examples/full.seconds) );
+
+    cvReleaseImage(&image);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * forestcompact: offline compaction of a trained classifier.
+ *
+ * Sibling leaves whose posteriors are almost identical are merged and their
+ * parent becomes a leaf. Nodes are then renumbered so that the saved trees
+ * stay loadable by image_classification_forest::load.
+ *
+ * Usage:
+ *
+ *   ./forestcompact <model>.classifier [-d <max divergence>] [-o <output dir>] [-n <patch count>]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include <iostream>
+#include <vector>
+#include <opencv/cv.h>
+#include <highgui.h>
+
+#include <garfeild.h>
+
+using namespace std;
+
+//! Print a command line help and exit.
+static void usage(const char *s)
+{
+    cerr << "usage:\n" << s
+         << " <model>.classifier [-d <max divergence>] [-o <output dir>] [-n <patch count>]\n\n"
+         "   -d <value>  merge sibling leaves whose weighted Jensen-Shannon divergence\n"
+         "               is below <value> nats (default 0.01)\n"
+         "   -o <path>   save the compacted forest in <path> (default: overwrite the input)\n"
+         "   -n <count>  number of patches used to measure inference speed (default 20000)\n\n";
+    exit(1);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+//! Runs the forest on all the patches, returns the time per patch in microseconds
+//! and the recognized classes in \a classes.
+static double time_forest(image_classification_forest * forest, vector<image_class_example *> & patches,
+                          vector<int> & classes)
+{
+    float * p = new float[forest->class_number];
+    classes.resize(patches.size());
+
+    double start = now();
+    for ( int i=0; i<int(patches.size()); i++ )
+    {
+        forest->posterior_probabilities(patches[i], p);
+        int best = 0;
+        for ( int j=1; j<forest->class_number; j++ )
+            if ( p[j] > p[best] )
+                best = j;
+        classes[i] = best;
+    }
+    double elapsed = now()-start;
+
+    delete [] p;
+    return 1e6*elapsed/patches.size();
+}
+
+static void print_stats(const char* title, image_classification_forest * forest, double us_per_patch)
+{
+    printf("%s: %i trees, %i nodes, %i leaves, %.1f kb, %.2f us/patch\n", title,
+           (int)forest->trees.size(), forest->node_number(), forest->leaves_number(),
+           forest->memory_footprint()/1024.0, us_per_patch );
+}
+
+int main( int argc, char** argv )
+{
+    if ( argc < 2 )
+        usage(argv[0]);
+
+    string input_dir = argv[1];
+    string output_dir = input_dir;
+    float max_divergence = 0.01f;
+    int patch_count = 20000;
+
+    for ( int i=2; i<argc; i++ )
+    {
+        if ( strcmp(argv[i], "-d")==0 && i+1<argc )
+            max_divergence = atof(argv[++i]);
+        else if ( strcmp(argv[i], "-o")==0 && i+1<argc )
+            output_dir = argv[++i];
+        else if ( strcmp(argv[i], "-n")==0 && i+1<argc )
+            patch_count = atoi(argv[++i]);
+        else
+            usage(argv[0]);
+    }
+
+    image_classification_forest * forest = new image_classification_forest();
+    if ( !forest->load(input_dir) )
+    {
+        fprintf(stderr, "couldn't load a forest from %s\n", input_dir.c_str() );
+        return 1;
+    }
+    int patch_size = forest->image_width;
+
+    // Patches for timing: taken at random positions in the model image, so they
+    // go down the trees like real keypoints do.
+    string image_name = input_dir + "/original_image.bmp";
+    IplImage * model_image = cvLoadImage(image_name.c_str(), 0);
+    if ( model_image == 0 || model_image->width <= 2*patch_size || model_image->height <= 2*patch_size )
+    {
+        fprintf(stderr, "couldn't load %s\n", image_name.c_str() );
+        return 1;
+    }
+    vector<image_class_example *> patches;
+    for ( int i=0; i<patch_count; i++ )
+    {
+        image_class_example * pv = new image_class_example();
+        pv->alloc(patch_size);
+        int u = patch_size + rand()%(model_image->width-2*patch_size);
+        int v = patch_size + rand()%(model_image->height-2*patch_size);
+        mcvGetPatch(model_image, pv->preprocessed, u, v);
+        patches.push_back(pv);
+    }
+    cvReleaseImage(&model_image);
+
+    vector<int> classes_before, classes_after;
+    double before = time_forest(forest, patches, classes_before);
+    print_stats("before", forest, before);
+
+    int merge_number = forest->compact(max_divergence);
+    printf("merged %i leaf pairs (max divergence %g)\n", merge_number, max_divergence );
+
+    double after = time_forest(forest, patches, classes_after);
+    print_stats("after ", forest, after);
+
+    int same = 0;
+    for ( int i=0; i<int(patches.size()); i++ )
+        if ( classes_before[i] == classes_after[i] )
+            same++;
+    printf("recognized class unchanged for %.2f%% of %i patches\n", 100.0*same/patches.size(), (int)patches.size() );
+
+    for ( int i=0; i<int(patches.size()); i++ )
+        delete patches[i];
+
+    if ( output_dir != input_dir )
+        mkdir(output_dir.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+    if ( !forest->save(output_dir) )
+    {
+        fprintf(stderr, "couldn't save the forest to %s\n", output_dir.c_str() );
+        return 1;
+    }
+    printf("saved compacted forest to %s\n", output_dir.c_str() );
+
+    delete forest;
+    return 0;
+}
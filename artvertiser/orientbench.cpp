@@ -0,0 +1,254 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * orientbench: compares the per keypoint and the batched dominant orientation
+ * estimation of keypoint_orientation_corrector on an image, the full
+ * gradient pyramid with the lazy, keypoint local gradients of object_view,
+ * and the fixed point patch rotation of rotate_patch_subpixel() with
+ * cvGetQuadrangleSubPix(), at random subpixel positions and angles.
+ *
+ * Usage:
+ *
+ *   ./orientbench <image> [-p <patch size>] [-n <keypoint count>] [-r <repetitions>] [-k <keypoints per frame>]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include <iostream>
+#include <vector>
+#include <opencv/cv.h>
+#include <highgui.h>
+
+#include <garfeild.h>
+
+using namespace std;
+
+//! Print a command line help and exit.
+static void usage(const char *s)
+{
+    cerr << "usage:\n" << s
+         << " <image> [-p <patch size>] [-n <keypoint count>] [-r <repetitions>] [-k <keypoints per frame>]\n\n"
+         "   -p <size>   patch size (default 32)\n"
+         "   -n <count>  number of keypoints per pyramid level (default 2000)\n"
+         "   -r <count>  number of repetitions for timing (default 20)\n"
+         "   -k <count>  keypoints per frame for the gradient timing (default 1000,\n"
+         "               the default max_detected_pts of planar_object_recognizer)\n\n";
+    exit(1);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+int main( int argc, char** argv )
+{
+    if ( argc < 2 )
+        usage(argv[0]);
+
+    int patch_size = 32;
+    int keypoint_count = 2000;
+    int repetitions = 20;
+    int frame_keypoints = 1000;
+    const int level_number = 3;
+
+    for ( int i=2; i<argc; i++ )
+    {
+        if ( strcmp(argv[i], "-p")==0 && i+1<argc )
+            patch_size = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-n")==0 && i+1<argc )
+            keypoint_count = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-r")==0 && i+1<argc )
+            repetitions = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-k")==0 && i+1<argc )
+            frame_keypoints = atoi(argv[++i]);
+        else
+            usage(argv[0]);
+    }
+
+    IplImage * image = cvLoadImage(argv[1], 0);
+    if ( image == 0 )
+    {
+        fprintf(stderr, "couldn't load %s\n", argv[1] );
+        return 1;
+    }
+
+    object_view view(image->width, image->height, level_number);
+    view.build(image);
+    keypoint_orientation_corrector corrector(image->width, image->height, patch_size, level_number);
+
+    double single_time = 0, batched_time = 0;
+    int total = 0, same = 0, one_bucket = 0;
+    for ( int level=0; level<level_number; level++ )
+    {
+        IplImage * Ix = view.gradX[level];
+        IplImage * Iy = view.gradY[level];
+        if ( Ix->width <= 2*patch_size || Ix->height <= 2*patch_size )
+            break;
+
+        vector<int> u(keypoint_count), v(keypoint_count);
+        for ( int i=0; i<keypoint_count; i++ )
+        {
+            u[i] = patch_size + rand()%(Ix->width-2*patch_size);
+            v[i] = patch_size + rand()%(Ix->height-2*patch_size);
+        }
+
+        vector<int> single(keypoint_count), batched(keypoint_count);
+        double start = now();
+        for ( int r=0; r<repetitions; r++ )
+            for ( int i=0; i<keypoint_count; i++ )
+                single[i] = corrector.orientation_bucket_index(Ix, Iy, u[i], v[i]);
+        single_time += now()-start;
+
+        start = now();
+        for ( int r=0; r<repetitions; r++ )
+            corrector.orientation_bucket_indices(Ix, Iy, &u[0], &v[0], keypoint_count, &batched[0]);
+        batched_time += now()-start;
+
+        for ( int i=0; i<keypoint_count; i++ )
+        {
+            int d = abs(single[i]-batched[i]);
+            d = MIN(d, keypoint_orientation_corrector::ANGLE_BUCKET_NUMBER-d);
+            if ( d == 0 )
+                same++;
+            if ( d <= 1 )
+                one_bucket++;
+            total++;
+        }
+    }
+
+    if ( total == 0 )
+    {
+        fprintf(stderr, "%s is too small for %ix%i patches\n", argv[1], patch_size, patch_size );
+        return 1;
+    }
+
+    int calls = total*repetitions;
+    printf("%i keypoints, %ix%i patches, %i repetitions\n", total, patch_size, patch_size, repetitions );
+    printf("per keypoint: %.3f us/keypoint\n", 1e6*single_time/calls );
+    printf("batched:      %.3f us/keypoint (x%.2f)\n", 1e6*batched_time/calls, single_time/batched_time );
+    printf("same bucket for %.2f%% of the keypoints, within one bucket for %.2f%%\n",
+           100.0*same/total, 100.0*one_bucket/total );
+
+    // Gradients: whole pyramid against the tiles around frame_keypoints keypoints,
+    // spread over the levels like detected points.
+    vector<int> ku(frame_keypoints), kv(frame_keypoints), kl(frame_keypoints);
+    for ( int i=0; i<frame_keypoints; i++ )
+    {
+        int level = i%level_number;
+        IplImage * im = view.image[level];
+        kl[i] = level;
+        ku[i] = patch_size/2 + 1 + rand()%MAX(1, im->width-patch_size-2);
+        kv[i] = patch_size/2 + 1 + rand()%MAX(1, im->height-patch_size-2);
+    }
+
+    double start = now();
+    for ( int r=0; r<repetitions; r++ )
+        view.comp_gradient();
+    double full_time = (now()-start)/repetitions;
+
+    object_view lazy_view(image->width, image->height, level_number);
+    lazy_view.build(image);
+    start = now();
+    for ( int r=0; r<repetitions; r++ )
+    {
+        lazy_view.invalidate_gradient();
+        for ( int i=0; i<frame_keypoints; i++ )
+            lazy_view.comp_gradient_around(kl[i], ku[i], kv[i], patch_size/2+1);
+    }
+    double lazy_time = (now()-start)/repetitions;
+
+    // Both must agree wherever the lazy gradients were computed:
+    int max_difference = 0;
+    int D = patch_size/2;
+    for ( int i=0; i<frame_keypoints; i++ )
+        for ( int y=-D; y<D; y++ )
+            for ( int x=-D; x<D; x++ )
+            {
+                int u = ku[i]+x, v = kv[i]+y;
+                IplImage * im = view.image[kl[i]];
+                if ( u < 0 || v < 0 || u >= im->width || v >= im->height )
+                    continue;
+                int dx = abs(CV_IMAGE_ELEM(view.gradX[kl[i]], short, v, u) - CV_IMAGE_ELEM(lazy_view.gradX[kl[i]], short, v, u));
+                int dy = abs(CV_IMAGE_ELEM(view.gradY[kl[i]], short, v, u) - CV_IMAGE_ELEM(lazy_view.gradY[kl[i]], short, v, u));
+                max_difference = MAX(max_difference, MAX(dx, dy));
+            }
+
+    printf("gradients, %i keypoints per frame:\n", frame_keypoints );
+    printf("full pyramid: %.3f ms/frame\n", 1e3*full_time );
+    printf("lazy tiles:   %.3f ms/frame (x%.2f), %.1f%% of the tiles computed, max difference %i\n",
+           1e3*lazy_time, full_time/lazy_time, 100*lazy_view.computed_gradient_fraction(), max_difference );
+
+    // Patch rotation: fixed point against cvGetQuadrangleSubPix() at the exact angle,
+    // on the image and on uniform noise, where interpolation errors are the largest.
+    IplImage * noise = cvCreateImage(cvGetSize(image), IPL_DEPTH_8U, 1);
+    for ( int y=0; y<noise->height; y++ )
+        for ( int x=0; x<noise->width; x++ )
+            CV_IMAGE_ELEM(noise, unsigned char, y, x) = (unsigned char)(rand()%256);
+    IplImage * fixed_patch = cvCreateImage(cvSize(patch_size, patch_size), IPL_DEPTH_8U, 1);
+    IplImage * float_patch = cvCreateImage(cvSize(patch_size, patch_size), IPL_DEPTH_8U, 1);
+    IplImage * sources[2] = { image, noise };
+    const char * source_names[2] = { "image", "noise" };
+    int max_rotation_error = 0;
+    for ( int s=0; s<2; s++ )
+    {
+        int max_error = 0;
+        double error_sum = 0;
+        for ( int i=0; i<keypoint_count; i++ )
+        {
+            float u = patch_size + (image->width-2*patch_size)*(rand()/(float)RAND_MAX);
+            float v = patch_size + (image->height-2*patch_size)*(rand()/(float)RAND_MAX);
+            float angle = 2*3.14159265f*(rand()/(float)RAND_MAX);
+
+            corrector.rotate_patch_subpixel(sources[s], u, v, angle,
+                                            (unsigned char *)fixed_patch->imageData, fixed_patch->widthStep);
+            // the matrix of rotate_patchf():
+            float m[6] = { cosf(-angle), sinf(-angle), u, -sinf(-angle), cosf(-angle), v };
+            CvMat M = cvMat(2, 3, CV_32F, m);
+            cvGetQuadrangleSubPix(sources[s], float_patch, &M);
+
+            for ( int y=0; y<patch_size; y++ )
+                for ( int x=0; x<patch_size; x++ )
+                {
+                    int e = abs(CV_IMAGE_ELEM(fixed_patch, unsigned char, y, x) - CV_IMAGE_ELEM(float_patch, unsigned char, y, x));
+                    max_error = MAX(max_error, e);
+                    error_sum += e;
+                }
+        }
+        printf("patch rotation on %s: max error %i, mean error %.3f grey levels\n", source_names[s],
+               max_error, error_sum/(double(keypoint_count)*patch_size*patch_size) );
+        max_rotation_error = MAX(max_rotation_error, max_error);
+    }
+    cvReleaseImage(&fixed_patch);
+    cvReleaseImage(&float_patch);
+    cvReleaseImage(&noise);
+
+    cvReleaseImage(&image);
+    // fixed point rounding alone accounts for up to 2 grey levels:
+    return (one_bucket == total && max_difference == 0 && max_rotation_error <= 2) ? 0 : 1;
+}
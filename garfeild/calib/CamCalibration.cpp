@@ -27,6 +27,7 @@
 #include <highgui.h>
 #include "CamCalibration.h"
 #include <optimization/ls_minimizer2.h>
+#include <general/rng.h>
 
 /**
 \brief Calculates gradient.
@@ -107,7 +108,6 @@ int imin(int a, int b) {
 
 CamCalibration::CamCalibration(){
   m_CH = NULL;
-  srand( (unsigned)time(NULL) );
   printf("Welcome to AMCC!\n");
   printf("================\n\n");
 }
@@ -271,8 +271,8 @@ std::vector<CamCalibration::s_struct_solution> CamCalibration::GetRandomSolution
   do {
     // Get random c and h:
     int c,h;
-    while ((int)v_camera.size() <= (c = rand()/(RAND_MAX/(int)v_camera.size())) );
-    while ((int)v_camera[0]->v_homography.size() <= (h = rand()/(RAND_MAX/(int)v_camera[0]->v_homography.size())) );
+    c = gf_rand((int)v_camera.size());
+    h = gf_rand((int)v_camera[0]->v_homography.size());
 
     // Check if there is a connection:
     if( v_camera[c]->v_homography[h]->m_homography ){
@@ -398,7 +398,7 @@ static void fill_random(int array[],int size)
     array[i]=i;
   }
   for (int i=0; i<size; ++i) {
-    int n = (size*rand())/RAND_MAX;
+    int n = gf_rand(size);
     if (n==i) continue;
     if (n<0) n=0;
     if (n>=size) n=size-1;
@@ -671,7 +671,7 @@ CvMat* CamCalibration::GetM( enum matrix_desc desc, int c, int h ){
 
 double CamCalibration::GetRandomValue( double min, double max ){
   double delta = max - min;
-  double value = (double)rand()/(double)RAND_MAX;
+  double value = (double)gf_rand()/(double)0x7fffffff;
   return min + delta*value; 
 }
 
@@ -62,6 +62,8 @@
 #include <viewsets/image_object_point_match.h>
 #include <viewsets/object_keypoint.h>
 #include <viewsets/object_view.h>
+#include <viewsets/parallel_example_generator.h>
+#include <viewsets/cached_example_generator.h>
 #include <viewsets/planar_object_recognizer.h>
 #include <calib/CamCalibration.h>
 #include <calib/CamAugmentation.h>
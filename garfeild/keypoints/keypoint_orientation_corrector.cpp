@@ -25,6 +25,10 @@
 
 #include <iostream>
 #include <cmath>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 using namespace std;
 
 #include <starter.h>
@@ -40,6 +44,10 @@ const short MINIMAL_NORM = 0; // of the gradient to be taken into account
 
 #define DERIVATIVES_KERNEL_SIZE 1
 
+// Fractional bits of the subpixel rotation offsets and bilinear weights:
+static const int SUBPIXEL_BITS = 8;
+static const int SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+
 bool keypoint_orientation_corrector::subpixel_rotate = false;
 
 keypoint_orientation_corrector::keypoint_orientation_corrector(int _width, int _height, int _neighborhood_size, int _nbLev)
@@ -51,8 +59,6 @@ keypoint_orientation_corrector::keypoint_orientation_corrector(int _width, int _
 
   actual_neighborhood_size = neighborhood_size;
 
-  angle_buckets = new int[ANGLE_BUCKET_NUMBER];
-
   initialize_tables();
 }
 
@@ -130,16 +136,43 @@ void keypoint_orientation_corrector::initialize_tables(void)
             }
       }
     }
+
+    short_weights = new short[actual_neighborhood_size * actual_neighborhood_size];
+    for(int y = 0; y < actual_neighborhood_size; y++)
+    {
+      int * W = (int *)(exp_weights->imageData + y * exp_weights->widthStep);
+      for(int x = 0; x < actual_neighborhood_size; x++)
+        short_weights[y * actual_neighborhood_size + x] = (short)W[x];
+    }
+
+    // Same sampling positions as the matrix given to cvGetQuadrangleSubPix() in rotate_patchf():
+    const int n2 = neighborhood_size * neighborhood_size;
+    subpixel_offsets = new short[SUBPIXEL_ROTATION_STEPS * 2 * n2];
+    for(int a = 0; a < SUBPIXEL_ROTATION_STEPS; a++)
+    {
+      double angle = a * 2 * 3.14159265358979 / SUBPIXEL_ROTATION_STEPS;
+      float cs = float(cos(-angle)), sn = float(sin(-angle));
+      float c = (neighborhood_size - 1) / 2.f;
+      short * offsets = subpixel_offsets + a * 2 * n2;
+      for(int y = 0; y < neighborhood_size; y++)
+        for(int x = 0; x < neighborhood_size; x++)
+        {
+          float dx = x - c, dy = y - c;
+          offsets[2 * (y * neighborhood_size + x)]     = (short)floor((cs * dx + sn * dy) * SUBPIXEL_ONE + .5f);
+          offsets[2 * (y * neighborhood_size + x) + 1] = (short)floor((-sn * dx + cs * dy) * SUBPIXEL_ONE + .5f);
+        }
+    }
 }
 
 keypoint_orientation_corrector::~keypoint_orientation_corrector()
 {
-  delete[] angle_buckets;
-
   for(int i = 0; i < ANGLE_BUCKET_NUMBER*nbLev; i++)
     delete[] orientation_lookup_tables[i];
   delete[] orientation_lookup_tables;
   if (atan2_table) delete[] atan2_table;
+  delete[] short_weights;
+  delete[] subpixel_offsets;
+  cvReleaseImage(&exp_weights);
 }
 
 void keypoint_orientation_corrector::compute_gradient_images(IplImage * image, IplImage ** _Ix, IplImage ** _Iy)
@@ -156,6 +189,8 @@ int keypoint_orientation_corrector::orientation_bucket_index(const IplImage * _I
 {
   const int D = actual_neighborhood_size / 2;
 
+  // Local, so that several threads can estimate orientations at the same time:
+  int angle_buckets[ANGLE_BUCKET_NUMBER];
   for(int i = 0; i < ANGLE_BUCKET_NUMBER; i++)
     angle_buckets[i] = 0;
 
@@ -181,6 +216,7 @@ int keypoint_orientation_corrector::orientation_bucket_index(const IplImage * _I
 
       int index = atan2_table[ATAN2_TABLE_INDEX(dx, dy)];
       assert(index <ANGLE_BUCKET_NUMBER);
+      if (index < 0) continue; // null gradient
       angle_buckets[index] += W[x] * norm2;
     }
   }
@@ -204,6 +240,8 @@ int keypoint_orientation_corrector::optimized_orientation_bucket_index(const Ipl
 {
   const int D = actual_neighborhood_size / 2;
 
+  // Local, so that several threads can estimate orientations at the same time:
+  int angle_buckets[ANGLE_BUCKET_NUMBER];
   for(int i = 0; i < ANGLE_BUCKET_NUMBER; i++)
     angle_buckets[i] = 0;
 
@@ -230,7 +268,7 @@ int keypoint_orientation_corrector::optimized_orientation_bucket_index(const Ipl
       else if (dy >= MAX_GRADIENT)  dy =  MAX_GRADIENT - 1;
 
       short index = atan2_table[ATAN2_TABLE_INDEX(dx, dy)];
-      angle_buckets[index] += W[x] * norm2;
+      if (index >= 0) angle_buckets[index] += W[x] * norm2;
     }
 
     for(int x = -2 + dx; x >= -D; x-=2)
@@ -247,7 +285,7 @@ int keypoint_orientation_corrector::optimized_orientation_bucket_index(const Ipl
       else if (dy >= MAX_GRADIENT) dy =  MAX_GRADIENT - 1;
 
       short index = atan2_table[ATAN2_TABLE_INDEX(dx, dy)];
-      angle_buckets[index] += W[x] * norm2;
+      if (index >= 0) angle_buckets[index] += W[x] * norm2;
     }
   }
 
@@ -265,12 +303,166 @@ int keypoint_orientation_corrector::optimized_orientation_bucket_index(const Ipl
     return orientation_bucket_index;
 }
 
+// Fixed point bilinear interpolation, same rounding as the SSE2 path.
+static inline unsigned char bilinear_8u(const unsigned char * p, int step, int fx, int fy)
+{
+  int top    = (p[0]    * (SUBPIXEL_ONE - fx) + p[1]        * fx + SUBPIXEL_ONE / 2) >> SUBPIXEL_BITS;
+  int bottom = (p[step] * (SUBPIXEL_ONE - fx) + p[step + 1] * fx + SUBPIXEL_ONE / 2) >> SUBPIXEL_BITS;
+  return (unsigned char)((top * (SUBPIXEL_ONE - fy) + bottom * fy + SUBPIXEL_ONE / 2) >> SUBPIXEL_BITS);
+}
+
+/*! Samples an \a n x \a n patch of the 8 bit image \a src around (u, v), at the
+  positions given by \a offsets: pairs (du, dv) relative to (u, v), in fixed point.
+  Pixels falling outside the image are clamped to the border, as cvGetQuadrangleSubPix() does.
+*/
+static void sample_patch_8u(const unsigned char * src, int step, int width, int height,
+                            float u, float v, const short * offsets, int n,
+                            unsigned char * dst, int dst_step)
+{
+  // Integer and fractional parts of the keypoint position:
+  int U = int(floor(u * SUBPIXEL_ONE + .5f)), V = int(floor(v * SUBPIXEL_ONE + .5f));
+  int ui = U >> SUBPIXEL_BITS, uf = U & (SUBPIXEL_ONE - 1);
+  int vi = V >> SUBPIXEL_BITS, vf = V & (SUBPIXEL_ONE - 1);
+
+  // Offsets never go further than the half diagonal of the patch:
+  int radius = int(n * 0.7072f) + 2;
+  bool inside = ui - radius >= 0 && ui + radius + 1 < width && vi - radius >= 0 && vi + radius + 1 < height;
+
+  if (!inside)
+  {
+    for(int y = 0; y < n; y++)
+      for(int x = 0; x < n; x++)
+      {
+        const short * o = offsets + 2 * (y * n + x);
+        int X = U + o[0], Y = V + o[1];
+        int fx = X & (SUBPIXEL_ONE - 1), fy = Y & (SUBPIXEL_ONE - 1);
+        int x0 = X >> SUBPIXEL_BITS, y0 = Y >> SUBPIXEL_BITS;
+        int x1 = x0 + 1, y1 = y0 + 1;
+        x0 = MAX(0, MIN(width - 1, x0));   x1 = MAX(0, MIN(width - 1, x1));
+        y0 = MAX(0, MIN(height - 1, y0));  y1 = MAX(0, MIN(height - 1, y1));
+        int top    = (src[y0 * step + x0] * (SUBPIXEL_ONE - fx) + src[y0 * step + x1] * fx + SUBPIXEL_ONE / 2) >> SUBPIXEL_BITS;
+        int bottom = (src[y1 * step + x0] * (SUBPIXEL_ONE - fx) + src[y1 * step + x1] * fx + SUBPIXEL_ONE / 2) >> SUBPIXEL_BITS;
+        dst[y * dst_step + x] = (unsigned char)((top * (SUBPIXEL_ONE - fy) + bottom * fy + SUBPIXEL_ONE / 2) >> SUBPIXEL_BITS);
+      }
+    return;
+  }
+
+  const unsigned char * base = src + vi * step + ui;
+
+#ifdef __SSE2__
+  const __m128i fraction = _mm_setr_epi16(uf, vf, uf, vf, uf, vf, uf, vf);
+  const __m128i fraction_mask = _mm_set1_epi16(SUBPIXEL_ONE - 1);
+  const __m128i address_stride = _mm_set1_epi32((step << 16) | 1);
+  // (fx, fx, ...) -> (ONE - fx, fx, ...)
+  const __m128i weight_sign = _mm_setr_epi16(-1, 1, -1, 1, -1, 1, -1, 1);
+  const __m128i weight_base = _mm_setr_epi16(SUBPIXEL_ONE, 0, SUBPIXEL_ONE, 0, SUBPIXEL_ONE, 0, SUBPIXEL_ONE, 0);
+  const __m128i half = _mm_set1_epi32(SUBPIXEL_ONE / 2);
+  int addresses[8];
+  short top[16], bottom[16];
+#endif
+
+  for(int y = 0; y < n; y++)
+  {
+    const short * o = offsets + 2 * y * n;
+    unsigned char * d = dst + y * dst_step;
+    int x = 0;
+#ifdef __SSE2__
+    for(; x + 8 <= n; x += 8, o += 16)
+    {
+      __m128i result[2];
+      for(int h = 0; h < 2; h++)
+      {
+        // 4 (du, dv) pairs, plus the fractional part of the keypoint position:
+        __m128i p = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(o + 8 * h)), fraction);
+        __m128i integer = _mm_srai_epi16(p, SUBPIXEL_BITS);
+        __m128i frac = _mm_and_si128(p, fraction_mask);
+        // du + dv * step
+        _mm_storeu_si128((__m128i *)(addresses + 4 * h), _mm_madd_epi16(integer, address_stride));
+
+        for(int k = 0; k < 4; k++)
+        {
+          const unsigned char * q = base + addresses[4 * h + k];
+          top[2 * k] = q[0];        top[2 * k + 1] = q[1];
+          bottom[2 * k] = q[step];  bottom[2 * k + 1] = q[step + 1];
+        }
+
+        __m128i fx = _mm_shufflehi_epi16(_mm_shufflelo_epi16(frac, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+        __m128i fy = _mm_shufflehi_epi16(_mm_shufflelo_epi16(frac, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+        __m128i wx = _mm_add_epi16(_mm_mullo_epi16(fx, weight_sign), weight_base);
+        __m128i wy = _mm_add_epi16(_mm_mullo_epi16(fy, weight_sign), weight_base);
+
+        __m128i t = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_loadu_si128((const __m128i *)top), wx), half), SUBPIXEL_BITS);
+        __m128i b = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_loadu_si128((const __m128i *)bottom), wx), half), SUBPIXEL_BITS);
+        __m128i tb = _mm_or_si128(t, _mm_slli_epi32(b, 16));
+        result[h] = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(tb, wy), half), SUBPIXEL_BITS);
+      }
+      __m128i packed = _mm_packs_epi32(result[0], result[1]);
+      _mm_storel_epi64((__m128i *)(d + x), _mm_packus_epi16(packed, packed));
+    }
+#endif
+    for(; x < n; x++, o += 2)
+    {
+      int X = uf + o[0], Y = vf + o[1];
+      d[x] = bilinear_8u(base + (Y >> SUBPIXEL_BITS) * step + (X >> SUBPIXEL_BITS), step,
+                         X & (SUBPIXEL_ONE - 1), Y & (SUBPIXEL_ONE - 1));
+    }
+  }
+}
+
+void keypoint_orientation_corrector::rotate_patch_subpixel(const IplImage * image, float u, float v, float angle,
+                                                           unsigned char * dst, int dst_step) const
+{
+  // The offsets of the two steps around the angle, interpolated: 1 degree
+  // steps alone move the corners of a 32x32 patch by up to .2 pixel.
+  float steps = angle * SUBPIXEL_ROTATION_STEPS / (2 * 3.14159265f);
+  int a = int(floor(steps));
+  int t = int(floor((steps - a) * SUBPIXEL_ONE + .5f));
+  if (t == SUBPIXEL_ONE) { a++; t = 0; }
+  a %= SUBPIXEL_ROTATION_STEPS;
+  if (a < 0) a += SUBPIXEL_ROTATION_STEPS;
+  int b = (a + 1) % SUBPIXEL_ROTATION_STEPS;
+
+  const int length = 2 * neighborhood_size * neighborhood_size;
+  const short * oa = subpixel_offsets + a * length;
+  const short * ob = subpixel_offsets + b * length;
+  short offsets[length];
+  int i = 0;
+#ifdef __SSE2__
+  // (ob - oa) * t in 32 bits, from its low and high halves:
+  const __m128i T = _mm_set1_epi16(short(t));
+  const __m128i half = _mm_set1_epi32(SUBPIXEL_ONE / 2);
+  for(; i + 8 <= length; i += 8)
+  {
+    __m128i A = _mm_loadu_si128((const __m128i *)(oa + i));
+    __m128i d = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(ob + i)), A);
+    __m128i lo = _mm_mullo_epi16(d, T), hi = _mm_mulhi_epi16(d, T);
+    __m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), half), SUBPIXEL_BITS);
+    __m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), half), SUBPIXEL_BITS);
+    _mm_storeu_si128((__m128i *)(offsets + i), _mm_add_epi16(A, _mm_packs_epi32(p0, p1)));
+  }
+#endif
+  for(; i < length; i++)
+    offsets[i] = short(oa[i] + (((ob[i] - oa[i]) * t + SUBPIXEL_ONE / 2) >> SUBPIXEL_BITS));
+
+  sample_patch_8u((const unsigned char *)image->imageData, image->widthStep, image->width, image->height,
+                  u, v, offsets, neighborhood_size, dst, dst_step);
+}
+
 void keypoint_orientation_corrector::rotate_patchf(IplImage * original_image, float u, float v, 
                                                    IplImage * rotated_patch,
                                                    float angle)
 {
-  static float m[6];
-  static CvMat M = cvMat( 2, 3, CV_32F, m );
+  if (original_image->depth == IPL_DEPTH_8U && rotated_patch->depth == IPL_DEPTH_8U &&
+      original_image->nChannels == 1 && rotated_patch->nChannels == 1 &&
+      rotated_patch->width == neighborhood_size && rotated_patch->height == neighborhood_size)
+  {
+    rotate_patch_subpixel(original_image, u, v, angle, (unsigned char *)rotated_patch->imageData, rotated_patch->widthStep);
+    return;
+  }
+
+  // Not static: generators running in parallel threads rotate patches concurrently.
+  float m[6];
+  CvMat M = cvMat( 2, 3, CV_32F, m );
 
   m[0] = (float)(cos(-angle));
   m[1] = (float)(sin(-angle));
@@ -319,6 +511,116 @@ void keypoint_orientation_corrector::rotate_patch(IplImage * original_image, int
   }
 }
 
+// Histograms used by orientation_bucket_indices() are interleaved: every SIMD lane
+// accumulates in its own copy, which avoids store-to-load stalls when neighbour
+// pixels fall in the same bucket. Slot 0 collects null gradients.
+static const int HISTOGRAM_LANES = 8;
+static const int HISTOGRAM_SIZE = (keypoint_orientation_corrector::ANGLE_BUCKET_NUMBER + 1) * HISTOGRAM_LANES;
+
+int keypoint_orientation_corrector::histogram_bucket_index(const IplImage * _Ix, const IplImage * _Iy,
+                                                           int u, int v, int * histograms) const
+{
+  const int D = actual_neighborhood_size / 2;
+  const int S = 2 * D;
+
+  memset(histograms, 0, HISTOGRAM_SIZE * sizeof(int));
+
+#ifdef __SSE2__
+  // Sobel gradients of 8 bit images stay far below ACTUAL_MAX_GRADIENT, so clamping
+  // before computing the norm gives the same result as orientation_bucket_index().
+  const __m128i max_gradient = _mm_set1_epi16(MAX_GRADIENT - 1);
+  const __m128i min_gradient = _mm_set1_epi16(-MAX_GRADIENT + 1);
+  const __m128i gradient_offset = _mm_set1_epi16(MAX_GRADIENT);
+  const __m128i table_stride = _mm_set1_epi32(((2 * MAX_GRADIENT + 1) << 16) | 1);
+  int table_indices[HISTOGRAM_LANES], values[HISTOGRAM_LANES];
+#endif
+
+  for(int y = -D; y < D; y++)
+  {
+    int dIx = (v + y) * _Ix->widthStep + ((u - D) << 1);
+    const short * Ix_row = (const short *)(_Ix->imageData + dIx);
+    const short * Iy_row = (const short *)(_Iy->imageData + dIx);
+    const short * W = short_weights + (D + y) * S;
+
+    int x = 0;
+#ifdef __SSE2__
+    for(; x + HISTOGRAM_LANES <= S; x += HISTOGRAM_LANES)
+    {
+      __m128i dx = _mm_srai_epi16(_mm_loadu_si128((const __m128i *)(Ix_row + x)), GRADIENT_SHIFT);
+      __m128i dy = _mm_srai_epi16(_mm_loadu_si128((const __m128i *)(Iy_row + x)), GRADIENT_SHIFT);
+      __m128i w  = _mm_loadu_si128((const __m128i *)(W + x));
+      dx = _mm_max_epi16(_mm_min_epi16(dx, max_gradient), min_gradient);
+      dy = _mm_max_epi16(_mm_min_epi16(dy, max_gradient), min_gradient);
+
+      // W * (dx^2 + dy^2): W * dx fits in 16 bits, madd widens to 32 bits.
+      __m128i wdx = _mm_mullo_epi16(w, dx), wdy = _mm_mullo_epi16(w, dy);
+      _mm_storeu_si128((__m128i *)values,
+                       _mm_madd_epi16(_mm_unpacklo_epi16(wdx, wdy), _mm_unpacklo_epi16(dx, dy)));
+      _mm_storeu_si128((__m128i *)(values + 4),
+                       _mm_madd_epi16(_mm_unpackhi_epi16(wdx, wdy), _mm_unpackhi_epi16(dx, dy)));
+
+      // ATAN2_TABLE_INDEX(dx, dy)
+      __m128i ox = _mm_add_epi16(dx, gradient_offset), oy = _mm_add_epi16(dy, gradient_offset);
+      _mm_storeu_si128((__m128i *)table_indices, _mm_madd_epi16(_mm_unpacklo_epi16(ox, oy), table_stride));
+      _mm_storeu_si128((__m128i *)(table_indices + 4), _mm_madd_epi16(_mm_unpackhi_epi16(ox, oy), table_stride));
+
+      for(int l = 0; l < HISTOGRAM_LANES; l++)
+        histograms[(atan2_table[table_indices[l]] + 1) * HISTOGRAM_LANES + l] += values[l];
+    }
+#endif
+    for(; x < S; x++)
+    {
+      int dx = Ix_row[x] >> GRADIENT_SHIFT;
+      int dy = Iy_row[x] >> GRADIENT_SHIFT;
+      int norm2 = dx * dx + dy * dy;
+
+      if (dx <= -MAX_GRADIENT)      dx = -MAX_GRADIENT + 1;
+      else if (dx >= MAX_GRADIENT)  dx =  MAX_GRADIENT - 1;
+      if (dy <= -MAX_GRADIENT)      dy = -MAX_GRADIENT + 1;
+      else if (dy >= MAX_GRADIENT)  dy =  MAX_GRADIENT - 1;
+
+      histograms[(atan2_table[ATAN2_TABLE_INDEX(dx, dy)] + 1) * HISTOGRAM_LANES + (x & (HISTOGRAM_LANES - 1))] +=
+        W[x] * norm2;
+    }
+  }
+
+  int orientation_bucket_index = 0, value = -1;
+  for(int i = 0; i < ANGLE_BUCKET_NUMBER; i++)
+  {
+    const int * h = histograms + (i + 1) * HISTOGRAM_LANES;
+    int sum = 0;
+    for(int l = 0; l < HISTOGRAM_LANES; l++)
+      sum += h[l];
+    if (sum > value)
+    {
+      value = sum;
+      orientation_bucket_index = i;
+    }
+  }
+
+  return orientation_bucket_index;
+}
+
+void keypoint_orientation_corrector::orientation_bucket_indices(const IplImage * _Ix, const IplImage * _Iy,
+                                                                const int * u, const int * v, int n,
+                                                                int * bucket_indices) const
+{
+  int histograms[HISTOGRAM_SIZE];
+
+  for(int i = 0; i < n; i++)
+    bucket_indices[i] = histogram_bucket_index(_Ix, _Iy, u[i], v[i], histograms);
+}
+
+void keypoint_orientation_corrector::estimate_orientations_in_radians(const IplImage * _Ix, const IplImage * _Iy,
+                                                                      const int * u, const int * v, int n,
+                                                                      float * orientations) const
+{
+  int histograms[HISTOGRAM_SIZE];
+
+  for(int i = 0; i < n; i++)
+    orientations[i] = histogram_bucket_index(_Ix, _Iy, u[i], v[i], histograms) * 2 * 3.14159f / ANGLE_BUCKET_NUMBER;
+}
+
 float keypoint_orientation_corrector::estimate_orientation_in_radians(IplImage * image, int u, int v, 
                                                                       IplImage * _Ix, IplImage * _Iy)
 {
@@ -348,12 +650,18 @@ int keypoint_orientation_corrector::correct_orientationf(IplImage * image, float
   if (subpixel_rotate)
     rotate_patchf(image, u, v, rotated_neighborhood, orientation_in_radians);
   else {
-    int _orientation_bucket_index = int(orientation_in_radians * ANGLE_BUCKET_NUMBER / (2 * 3.14159));
-    if (_orientation_bucket_index < 0) _orientation_bucket_index = 0;
-    if (_orientation_bucket_index >= ANGLE_BUCKET_NUMBER) _orientation_bucket_index = ANGLE_BUCKET_NUMBER - 1;
+    int _orientation_bucket_index = bucket_index_from_radians(orientation_in_radians);
     rotate_patch(image, (int)(u+.5f), (int)(v+.5f),  rotated_neighborhood, _orientation_bucket_index, level);
   }
 
   return 0;
 }
 
+int keypoint_orientation_corrector::bucket_index_from_radians(float orientation_in_radians)
+{
+  int _orientation_bucket_index = int(orientation_in_radians * ANGLE_BUCKET_NUMBER / (2 * 3.14159));
+  if (_orientation_bucket_index < 0) _orientation_bucket_index = 0;
+  if (_orientation_bucket_index >= ANGLE_BUCKET_NUMBER) _orientation_bucket_index = ANGLE_BUCKET_NUMBER - 1;
+  return _orientation_bucket_index;
+}
+
@@ -48,6 +48,14 @@ public:
    //! returns the estimated orientation expressed in radians
    float estimate_orientation_in_radians(IplImage * image, int u, int v, IplImage * _Ix, IplImage * _Iy);
 
+   //! Batched version of orientation_bucket_index() for \a n keypoints lying in the same pyramid level.
+   //! Gives the same bucket indices, but uses SSE2 when available and can be called from several threads.
+   void orientation_bucket_indices(const IplImage * _Ix, const IplImage * _Iy,
+                                   const int * u, const int * v, int n, int * bucket_indices) const;
+   //! Batched version of estimate_orientation_in_radians().
+   void estimate_orientations_in_radians(const IplImage * _Ix, const IplImage * _Iy,
+                                         const int * u, const int * v, int n, float * orientations) const;
+
    //! Rotates the (u,v) neighborhood and returns the estimated orientation (actually the corresponding bucket index):
    int correct_orientation(IplImage * image, int u, int v, 
                            IplImage * rotated_neighborhood, 
@@ -57,12 +65,26 @@ public:
                             IplImage * rotated_neighborhood, 
                             float orientation_in_radians, int level);
 
+   //! Bucket index used by correct_orientationf() for a given orientation.
+   static int bucket_index_from_radians(float orientation_in_radians);
+   //! Offsets used to rotate a neighborhood_size x neighborhood_size patch of pyramid level \a level.
+   const int * rotation_table(int orientation_bucket_index, int level) const
+   { return orientation_lookup_tables[level * ANGLE_BUCKET_NUMBER + orientation_bucket_index]; }
+
+   //! Rotates the neighborhood of the subpixel position (u,v) of an 8 bit image into \a dst, using bilinear
+   //! interpolation and fixed point sampling offsets, interpolated between the precomputed
+   //! ones of the two nearest of the SUBPIXEL_ROTATION_STEPS angles. Reentrant.
+   void rotate_patch_subpixel(const IplImage * image, float u, float v, float angle,
+                              unsigned char * dst, int dst_step) const;
+
    static bool subpixel_rotate;
 
    static const int ANGLE_QUANTUM = 20; // in degrees
    static const int ANGLE_BUCKET_NUMBER = 360 / ANGLE_QUANTUM;
+   static const int SUBPIXEL_ROTATION_STEPS = 360;
 private:
    void initialize_tables(void);
+   int histogram_bucket_index(const IplImage * _Ix, const IplImage * _Iy, int u, int v, int * histograms) const;
    void rotate_patch(IplImage * original_image, int u, int v, 
                                                   IplImage * rotated_patch,
                                                   int orientation_bucket_index, int level);
@@ -73,8 +95,11 @@ private:
    int width, height, neighborhood_size, actual_neighborhood_size;
 
    short * atan2_table;
-   int * angle_buckets;
    IplImage * exp_weights;
+   //! First actual_neighborhood_size^2 values of exp_weights as 16 bit integers, packed.
+   short * short_weights;
+   //! For every one of the SUBPIXEL_ROTATION_STEPS angles, neighborhood_size^2 (du, dv) sampling offsets in fixed point.
+   short * subpixel_offsets;
   
    int ** orientation_lookup_tables;
    int nbLev;
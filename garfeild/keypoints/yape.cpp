@@ -41,6 +41,7 @@ using namespace std;
 #include "yape.h"
 
 #include "../../artvertiser/FProfiler/FProfiler.h"
+#include "../../artvertiser/FProfiler/FWorkerPool.h"
 
 const unsigned int yape_bin_size = 1000;
 const int yape_tmp_points_array_size = 10000;
@@ -75,16 +76,6 @@ yape::~yape()
   if (Dirs_nb) delete[] Dirs_nb;
   if (scores) cvReleaseImage(&scores);
   if (filtered_image) cvReleaseImage(&filtered_image);
-  if (raw_detect_thread_data.size()>0)
-  {
-      // cleanup threads
-      for ( int i=0; i<raw_detect_thread_data.size(); i++ )
-      {
-          delete raw_detect_thread_data[i];
-      }
-      raw_detect_thread_data.clear();
-      delete shared_barrier;
-  }
 }
 
 int yape::static_detect(IplImage * image, keypoint * points, int max_point_number, int _radius, int _tau)
@@ -675,108 +666,54 @@ void yape::perform_one_point(const unsigned char * I, const int x, short * Score
     }
 }
 
-yape::RawDetectThreadData::RawDetectThreadData()
-{
-    run_semaphore = new FSemaphore( 0 );
-}
-
-yape::RawDetectThreadData::~RawDetectThreadData()
-{
-    // kill the thread
-    should_stop=true;
-    run_semaphore->Signal();
-    void* ret;
-    pthread_join( thread, &ret );
-    delete run_semaphore;
-}
-
-void* yape::raw_detect_thread_func( void* _data )
+void yape::raw_detect_task( void* _y, int task )
 {
-    RawDetectThreadData* data = (RawDetectThreadData*)_data;
+    yape* y = (yape*)_y;
+    RawDetectTask* data = &y->raw_detect_tasks[task];
 
-    while ( true )
-    {
-        // continue/stop mechanism
-        data->run_semaphore->Wait();
-        if ( data->should_stop )
-            break;
-
-        unsigned int R = data->y->radius;
-        short * dirs = data->y->Dirs->t[R];
-        unsigned char dirs_nb = (unsigned char)(data->y->Dirs_nb[R]);
-        unsigned char opposite = dirs_nb / 2;
+    unsigned int R = y->radius;
+    short * dirs = y->Dirs->t[R];
+    unsigned char dirs_nb = (unsigned char)(y->Dirs_nb[R]);
+    unsigned char opposite = dirs_nb / 2;
 
-        CvRect roi = cvGetImageROI(data->im);
+    CvRect roi = cvGetImageROI(data->im);
 
-        if (roi.x < int(R+1)) roi.x = R+1;
-        if (roi.y < int(R+1)) roi.y = R+1;
-        if ((roi.x + roi.width)  > int(data->im->width-R-2))  roi.width  = data->im->width  - R - roi.x - 2;
-        if ((roi.y + roi.height) > int(data->im->height-R-2)) roi.height = data->im->height - R - roi.y - 2;
+    if (roi.x < int(R+1)) roi.x = R+1;
+    if (roi.y < int(R+1)) roi.y = R+1;
+    if ((roi.x + roi.width)  > int(data->im->width-R-2))  roi.width  = data->im->width  - R - roi.x - 2;
+    if ((roi.y + roi.height) > int(data->im->height-R-2)) roi.height = data->im->height - R - roi.y - 2;
 
-        unsigned int xend = roi.x + roi.width;
-        unsigned int yend = data->y_start + data->y_count;
-        int tau = data->y->tau;
+    unsigned int xend = roi.x + roi.width;
+    unsigned int yend = data->y_start + data->y_count;
+    int tau = y->tau;
 
-        for(unsigned int y = data->y_start; y < yend; y++)
+    for(unsigned int row = data->y_start; row < yend; row++)
+    {
+        unsigned char* I = (unsigned char*)(data->im->imageData + row*data->im->widthStep);
+        short * Scores = (short*)(y->scores->imageData + row*y->scores->widthStep);
+        for(unsigned int x = roi.x; x < xend; x++)
         {
-            unsigned char* I = (unsigned char*)(data->im->imageData + y*data->im->widthStep);
-            short * Scores = (short*)(data->y->scores->imageData + y*data->y->scores->widthStep);
-            for(unsigned int x = roi.x; x < xend; x++)
-            {
-                unsigned char* img = I+x;
-                int Ip = I[x] + tau;
-                int Im = I[x] - tau;
+            unsigned char* img = I+x;
+            int Ip = I[x] + tau;
+            int Im = I[x] - tau;
 
-                if (Im<img[R] && img[R]<Ip && Im<img[-R] && img[-R]<Ip)
-                    Scores[x] = 0;
-                else
-                {
-                    //perform_one_point(I, x, Scores, Im, Ip, dirs, opposite, dirs_nb);
-                    perform_one_point_2( img, x, Scores, tau, dirs, opposite, dirs_nb );
-                }
+            if (Im<img[R] && img[R]<Ip && Im<img[-R] && img[-R]<Ip)
+                Scores[x] = 0;
+            else
+            {
+                //perform_one_point(I, x, Scores, Im, Ip, dirs, opposite, dirs_nb);
+                perform_one_point_2( img, x, Scores, tau, dirs, opposite, dirs_nb );
             }
         }
-
-        // finished
-        data->barrier->Wait();
-
     }
-
-    pthread_exit(0);
 }
 
 void yape::raw_detect_mt(IplImage* im)
 {
     PROFILE_THIS_FUNCTION();
-    int thread_count = 8;
-    if ( raw_detect_thread_data.size() != thread_count )
-    {
-        assert( raw_detect_thread_data.size() == 0 );
-
-        // make shared barrier
-        shared_barrier = new FBarrier( thread_count+1 );
-
-        // make threads joinable
-        pthread_attr_t thread_attr;
-        pthread_attr_init(&thread_attr);
-        pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_JOINABLE);
-        printf("creating %i raw_detect threads\n", thread_count);
-        for ( int i=0; i<thread_count; i++ )
-        {
-            // setup data
-            RawDetectThreadData* thread_data = new RawDetectThreadData;
-            thread_data->run_semaphore = new FSemaphore(0);
-            thread_data->y = this;
-            thread_data->barrier = shared_barrier;
-            thread_data->should_stop = false;
-            // start the thread
-            pthread_create( &thread_data->thread, &thread_attr, raw_detect_thread_func, (void*)thread_data );
-            // store
-            raw_detect_thread_data.push_back( thread_data );
-        }
-        pthread_attr_destroy(&thread_attr);
-
-    }
+    // bands of rows, whatever the number of workers
+    int task_count = 8;
+    raw_detect_tasks.resize( task_count );
 
     // go
     unsigned int R = radius;
@@ -785,33 +722,27 @@ void yape::raw_detect_mt(IplImage* im)
     if (roi.y < int(R+1)) roi.y = R+1;
     if ((roi.y + roi.height) > int(im->height-R-2)) roi.height = im->height - R - roi.y - 2;
 
-    // distribute y over threads
+    // distribute y over tasks
     int curr_y = roi.y;
     int y_remaining_count = roi.height;
-    int y_count = y_remaining_count / raw_detect_thread_data.size();
-    assert( y_remaining_count >= raw_detect_thread_data.size() && "too many threads / not enough roi.y height" );
-    // start each thread
-    for ( int i=0; i<raw_detect_thread_data.size(); i++ )
+    int y_count = y_remaining_count / task_count;
+    assert( y_remaining_count >= task_count && "too many tasks / not enough roi.y height" );
+    for ( int i=0; i<task_count; i++ )
     {
-        // get thread data
-        RawDetectThreadData* thread_data = raw_detect_thread_data[i];
-        thread_data->im = im;
-        thread_data->y_start = curr_y;
-        // distribute y ranges to trheads, ensuring last thread gets remainder
-        if ( i== raw_detect_thread_data.size()-1 )
-            thread_data->y_count = y_remaining_count;
+        RawDetectTask* data = &raw_detect_tasks[i];
+        data->im = im;
+        data->y_start = curr_y;
+        // distribute y ranges to tasks, ensuring last task gets remainder
+        if ( i == task_count-1 )
+            data->y_count = y_remaining_count;
         else
-            thread_data->y_count = y_count;
+            data->y_count = y_count;
         curr_y += y_count;
         y_remaining_count -= y_count;
-
-        // go!
-        thread_data->run_semaphore->Signal();
-
     }
-    // wait for all threads to complete
-    shared_barrier->Wait();
 
+    // go, and wait for all tasks to complete
+    FWorkerPool::Shared()->Run( raw_detect_task, this, task_count );
 }
 
 /*! Detect interest points, without filtering and without selecting best ones.
@@ -90,9 +90,6 @@ static void saveImageOfDetectedPoints(char * name, IplImage * image, CvPoint * p
 \endcode
 */
 
-class FBarrier;
-class FSemaphore;
-
 class yape
 {
 public:
@@ -125,7 +122,8 @@ public:
   //! detect interest points and add them to tmp_points.
   void raw_detect(IplImage *im);
   void raw_detect_mt(IplImage* im);
-  static void* raw_detect_thread_func( void* data );
+  //! raw_detect_mt() task: one band of rows.
+  static void raw_detect_task( void* y, int task );
 
   //! sort and select the max_point_number best features.
   int pick_best_points(keypoint * points, unsigned int max_point_number);
@@ -203,27 +201,15 @@ protected:
   CvMat * shift;
 
 
-  // for detect threads
-  class RawDetectThreadData
+  // for raw_detect_mt tasks
+  class RawDetectTask
     {
     public:
-        RawDetectThreadData();
-        ~RawDetectThreadData();
-
-        pthread_t thread;
-
-        yape* y;
         IplImage* im;
         int y_start;
         int y_count;
-
-        bool should_stop;
-
-        FSemaphore* run_semaphore;
-        FBarrier* barrier;
     };
-  vector<RawDetectThreadData*> raw_detect_thread_data;
-  FBarrier* shared_barrier;
+  vector<RawDetectTask> raw_detect_tasks;
 
 };
 
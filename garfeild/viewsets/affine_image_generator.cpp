@@ -19,6 +19,8 @@ BazAR; if not, write to the Free Software Foundation, Inc., 51 Franklin
 Street, Fifth Floor, Boston, MA 02110-1301, USA 
 */
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <iostream>
 
@@ -37,6 +39,9 @@ affine_image_generator::affine_image_generator(void)
   affine_image = 0;
   smoothed_generated_object_view = 0;
   orientation_corrector = 0;
+  background_keypoint_array = 0;
+  background_point_number = 0;
+  model_pyramid = 0;
 
   white_noise = new char[prime];
   limited_white_noise = new char[prime];
@@ -46,6 +51,76 @@ affine_image_generator::affine_image_generator(void)
   local_keypoint_array = new object_keypoint[affine_image_generator::max_point_number];
 }
 
+affine_image_generator::affine_image_generator(const affine_image_generator & other)
+  : example_generator()
+{
+  white_noise = new char[prime];
+  limited_white_noise = new char[prime];
+  memcpy(white_noise, other.white_noise, prime);
+  memcpy(limited_white_noise, other.limited_white_noise, prime);
+  // Start somewhere else in the noise so that clones do not add the same noise:
+  index_white_noise = 1 + gf_rand(prime - 1);
+
+  original_image = other.original_image ? cvCloneImage(other.original_image) : 0;
+  processed_original_image = other.processed_original_image ? cvCloneImage(other.processed_original_image) : 0;
+  affine_image = other.affine_image ? cvCloneImage(other.affine_image) : 0;
+  memcpy(a, other.a, sizeof(a));
+  // Built again by the clone, if it warps locally:
+  model_pyramid = 0;
+  processed_pixel_number = 0;
+
+  level_number = other.level_number;
+  patch_size = other.patch_size;
+  kernels = other.kernels;
+
+  smoothed_generated_object_view = 0;
+  orientation_corrector = 0;
+  if (original_image != 0)
+  {
+    smoothed_generated_object_view = new object_view(original_image->width, original_image->height, level_number);
+    orientation_corrector = new keypoint_orientation_corrector(original_image->width, original_image->height,
+                                                               patch_size, level_number);
+  }
+
+  local_keypoint_array = new object_keypoint[affine_image_generator::max_point_number];
+  memcpy(local_keypoint_array, other.local_keypoint_array, sizeof(object_keypoint) * affine_image_generator::max_point_number);
+  // Keypoint arrays given by set_object_keypoints() are only read: they can be shared.
+  if (other.used_keypoint_array == other.local_keypoint_array)
+    used_keypoint_array = local_keypoint_array;
+  else
+    used_keypoint_array = other.used_keypoint_array;
+  point_number = other.point_number;
+  background_keypoint_array = other.background_keypoint_array;
+  background_point_number = other.background_point_number;
+
+  use_orientation_correction = other.use_orientation_correction;
+  use_random_background = other.use_random_background;
+  add_gaussian_smoothing = other.add_gaussian_smoothing;
+  change_intensities = other.change_intensities;
+  use_local_warping = other.use_local_warping;
+
+  noise_level = other.noise_level;
+  gaussian_smoothing_kernel_size = other.gaussian_smoothing_kernel_size;
+  localization_noise = other.localization_noise;
+
+  min_theta = other.min_theta;   max_theta = other.max_theta;
+  min_phi = other.min_phi;       max_phi = other.max_phi;
+  scaling_method = other.scaling_method;
+  min_lambda1 = other.min_lambda1;  max_lambda1 = other.max_lambda1;
+  min_lambda2 = other.min_lambda2;  max_lambda2 = other.max_lambda2;
+  min_l1_l2 = other.min_l1_l2;      max_l1_l2 = other.max_l1_l2;
+
+  u_corner1 = other.u_corner1;  v_corner1 = other.v_corner1;
+  u_corner2 = other.u_corner2;  v_corner2 = other.v_corner2;
+  u_corner3 = other.u_corner3;  v_corner3 = other.v_corner3;
+  u_corner4 = other.u_corner4;  v_corner4 = other.v_corner4;
+}
+
+affine_image_generator * affine_image_generator::clone(void)
+{
+  return new affine_image_generator(*this);
+}
+
 affine_image_generator::~affine_image_generator(void)
 {
   if (original_image != 0)
@@ -58,6 +133,8 @@ affine_image_generator::~affine_image_generator(void)
     delete smoothed_generated_object_view;
   if (orientation_corrector != 0)
     delete orientation_corrector;
+  if (model_pyramid != 0)
+    delete model_pyramid;
   delete[] local_keypoint_array;
 
   if (white_noise) delete[] white_noise;
@@ -85,6 +162,9 @@ void affine_image_generator::set_default_values(void)
 
   set_add_gaussian_smoothing(false);
   set_change_intensities(false);
+  set_use_local_warping(false);
+
+  processed_pixel_number = 0;
 }
 
 void affine_image_generator::set_noise_level(int noise_level)
@@ -94,8 +174,8 @@ void affine_image_generator::set_noise_level(int noise_level)
   index_white_noise = 0;
   for(int i = 0; i < prime; i++)
   {
-    limited_white_noise[i] = char(rand() % (2 * noise_level) - noise_level);
-    white_noise[i] = char(rand() % 256);
+    limited_white_noise[i] = char(gf_rand(2 * noise_level) - noise_level);
+    white_noise[i] = char(gf_rand(256));
   }
 }
 
@@ -113,6 +193,10 @@ void affine_image_generator::set_original_image(IplImage * p_original_image,
     cvReleaseImage(&processed_original_image);
   processed_original_image = cvCloneImage(p_original_image);
 
+  if (model_pyramid != 0)
+    delete model_pyramid;
+  model_pyramid = 0;
+
   if (affine_image != 0)
     cvReleaseImage(&affine_image);
   if (affine_image_width < 0)
@@ -146,6 +230,10 @@ void affine_image_generator::set_preprocessed_image(IplImage *preprocessed)
     cvReleaseImage(&processed_original_image);
   processed_original_image = cvCloneImage(preprocessed);
 
+  if (model_pyramid != 0)
+    delete model_pyramid;
+  model_pyramid = 0;
+
   if (affine_image != 0)
     cvReleaseImage(&affine_image);
   affine_image = cvCloneImage(preprocessed);
@@ -171,6 +259,12 @@ void affine_image_generator::set_object_keypoints(object_keypoint * keypoint_arr
   point_number = p_point_number;
 }
 
+void affine_image_generator::set_background_keypoints(object_keypoint * keypoint_array, int p_point_number)
+{
+  background_keypoint_array = keypoint_array;
+  background_point_number = p_point_number;
+}
+
 void affine_image_generator::reset_keypoints(void)
 {
   used_keypoint_array = local_keypoint_array;
@@ -208,6 +302,7 @@ void affine_image_generator::set_level_number(int p_level_number)
 void affine_image_generator::set_patch_size(int p_patch_size)
 {
   patch_size = p_patch_size; 
+  kernels = select_patch_kernels(patch_size);
 
   if (original_image != 0)
   {
@@ -366,12 +461,12 @@ void affine_image_generator::generate_random_affine_transformation(void)
   affine_transformation(a, image_width, image_height, float(u_corner4), float(v_corner4), nu3, nv3);
 
   // Moves two of the four corners on the borders of the image to maximize the visible part of the generated view:
-  if (rand() % 2 == 0)
+  if (gf_rand(2) == 0)
     Tx = - int(min4(nu0, nu1, nu2, nu3)) + patch_size;
   else
     Tx = image_width - int(max4(nu0, nu1, nu2, nu3)) - patch_size;
 
-  if (rand() % 2 == 0)
+  if (gf_rand(2) == 0)
     Ty = -int(min4(nv0, nv1, nv2, nv3)) + patch_size;
   else
     Ty = image_height - int(max4(nv0, nv1, nv2, nv3)) - patch_size;
@@ -423,30 +518,72 @@ void affine_image_generator::inverse_affine_transformation(float u, float v, flo
   inverse_affine_transformation(a, affine_image->width, affine_image->height, u, v, nu, nv);
 }
 
-void affine_image_generator::preprocess_point_view(image_class_example * pv, object_view * ov)
+void affine_image_generator::estimate_orientations(image_class_example ** pvs, int n, object_view * ov)
+{
+  vector<int> us, vs, indices;
+  vector<float> orientations;
+
+  for(int s = 0; s < level_number; s++)
+  {
+    us.clear(); vs.clear(); indices.clear();
+    for(int i = 0; i < n; i++)
+      if (int(pvs[i]->point2d->scale) == s)
+      {
+        us.push_back(int(pvs[i]->point2d->u));
+        vs.push_back(int(pvs[i]->point2d->v));
+        indices.push_back(i);
+      }
+    if (indices.empty()) continue;
+
+    orientations.resize(indices.size());
+    orientation_corrector->estimate_orientations_in_radians(ov->gradX[s], ov->gradY[s],
+                                                            &us[0], &vs[0], int(indices.size()), &orientations[0]);
+    for(int j = 0; j < int(indices.size()); j++)
+      pvs[indices[j]]->point2d->orientation_in_radians = orientations[j];
+  }
+}
+
+void affine_image_generator::preprocess_point_view(image_class_example * pv, object_view * ov, bool orientation_estimated)
 {
   if (use_orientation_correction)
   {
     // Lowe orientation:
     int s = (int)pv->point2d->scale;
 
-    pv->point2d->orientation_in_radians = 
-      orientation_corrector->estimate_orientation_in_radians(ov->image[s],
-      int(pv->point2d->u), int(pv->point2d->v), 
-      ov->gradX[s], ov->gradY[s]);
+    if (!orientation_estimated)
+      pv->point2d->orientation_in_radians = 
+        orientation_corrector->estimate_orientation_in_radians(ov->image[s],
+        int(pv->point2d->u), int(pv->point2d->v), 
+        ov->gradX[s], ov->gradY[s]);
 
     assert(pv->preprocessed);
 
-    orientation_corrector->correct_orientationf(ov->image[s],
-      pv->point2d->u, pv->point2d->v, 
-      pv->preprocessed, 
-      pv->point2d->orientation_in_radians, s);
+    if (kernels != 0 && !keypoint_orientation_corrector::subpixel_rotate)
+    {
+      assert(pv->preprocessed->widthStep == patch_size);
+      int bucket = keypoint_orientation_corrector::bucket_index_from_radians(pv->point2d->orientation_in_radians);
+      kernels->rotate(ov->image[s], int(pv->point2d->u + .5f), int(pv->point2d->v + .5f),
+                      orientation_corrector->rotation_table(bucket, s),
+                      (unsigned char *)pv->preprocessed->imageData);
+    }
+    else
+      orientation_corrector->correct_orientationf(ov->image[s],
+        pv->point2d->u, pv->point2d->v, 
+        pv->preprocessed, 
+        pv->point2d->orientation_in_radians, s);
   }
   else
   {
     int s = (int)pv->point2d->scale;
     assert(pv->preprocessed);
-    mcvGetPatch(ov->image[s], pv->preprocessed, int(pv->point2d->u), int(pv->point2d->v));
+    if (kernels != 0)
+    {
+      assert(pv->preprocessed->widthStep == patch_size);
+      kernels->extract(ov->image[s], int(pv->point2d->u), int(pv->point2d->v),
+                       (unsigned char *)pv->preprocessed->imageData);
+    }
+    else
+      mcvGetPatch(ov->image[s], pv->preprocessed, int(pv->point2d->u), int(pv->point2d->v));
   }
 }
 
@@ -470,7 +607,7 @@ void affine_image_generator::add_white_noise(IplImage * image)
       line[x] = (unsigned char)p;
 
       index_white_noise++;
-      if (index_white_noise >= prime) index_white_noise = 1 + rand() % 6;
+      if (index_white_noise >= prime) index_white_noise = 1 + gf_rand(6);
     }
   }
 }
@@ -486,7 +623,7 @@ void affine_image_generator::replace_by_noise(IplImage * image, int value)
       {
         row[x] = white_noise[index_white_noise];
         index_white_noise++;
-        if (index_white_noise >= prime) index_white_noise = 1 + rand() % 6;
+        if (index_white_noise >= prime) index_white_noise = 1 + gf_rand(6);
       }
   }
 }
@@ -495,6 +632,10 @@ void affine_image_generator::generate_affine_image(void)
 {
   CvMat A = cvMat(2, 3, CV_32F, a);
 
+  // Restart the precomputed noise at a random place for every image, so that
+  // an image only depends on the random numbers drawn for it:
+  index_white_noise = 1 + gf_rand(prime - 1);
+
   cvSet(affine_image, cvScalar(128));
 
 #if 0
@@ -509,6 +650,7 @@ void affine_image_generator::generate_affine_image(void)
   cvWarpAffine(processed_original_image, affine_image, &A,CV_INTER_LINEAR+CV_WARP_INVERSE_MAP);
   memcpy(a,sa,9*sizeof(float));
 #endif
+  processed_pixel_number += double(affine_image->width) * affine_image->height;
 
   if (use_random_background)
     replace_by_noise(affine_image, 128);
@@ -517,9 +659,9 @@ void affine_image_generator::generate_affine_image(void)
 
   if (add_gaussian_smoothing)
   {
-    if (rand() % 3 == 0)
+    if (gf_rand(3) == 0)
     {
-      int aperture = 3 + 2 * (rand() % 3);
+      int aperture = 3 + 2 * gf_rand(3);
       cvSmooth(affine_image, affine_image, CV_GAUSSIAN, aperture, aperture);
     }
 
@@ -548,42 +690,200 @@ void affine_image_generator::generate_object_view(void)
 vector<image_class_example *> * affine_image_generator::generate_random_examples(void)
 {
   generate_random_affine_transformation();
-  generate_object_view();
+  if (use_local_warping)
+  {
+    build_model_pyramid();
+    draw_view_effects();
+  }
+  else
+    generate_object_view();
 
   vector<image_class_example *> * result = new vector<image_class_example *>;
 
-  for(int i = 0; i < point_number; i++)
+  if (background_point_number > 0)
+  {
+    // Two-class examples for the cascade: object vs background.
+    for(int i = 0; i < point_number; i++)
+      add_example(result, &(used_keypoint_array[i]), 0);
+    for(int i = 0; i < background_point_number; i++)
+      add_example(result, &(background_keypoint_array[i]), 1);
+  }
+  else
+    for(int i = 0; i < point_number; i++)
+      add_example(result, &(used_keypoint_array[i]), used_keypoint_array[i].class_index);
+
+  return result;
+}
+
+void affine_image_generator::add_example(vector<image_class_example *> * result, object_keypoint * kp, int class_index)
+{
+  int scale = int(kp->scale);
+  IplImage * im = smoothed_generated_object_view->image[scale];
+  float nu, nv;
+
+  affine_transformation(PyrImage::convCoordf(float(kp->M[0]), scale, 0), 
+                        PyrImage::convCoordf(float(kp->M[1]), scale, 0),
+                        nu, nv);
+
+  nu = PyrImage::convCoordf(nu, 0, scale) + localization_noise * rand_m1p1();
+  nv = PyrImage::convCoordf(nv, 0, scale) + localization_noise * rand_m1p1();
+
+  if ((int)nu > patch_size && (int)nu < im->width  - patch_size &&
+      (int)nv > patch_size && (int)nv < im->height - patch_size)
   {
-    object_keypoint * kp = &(used_keypoint_array[i]);
-    int scale = int(kp->scale);
-    IplImage * im = smoothed_generated_object_view->image[scale];
-    float nu, nv;
+    if (use_local_warping)
+      generate_local_window(scale, int(nu), int(nv));
 
-    affine_transformation(PyrImage::convCoordf(float(kp->M[0]), scale, 0), 
-                          PyrImage::convCoordf(float(kp->M[1]), scale, 0),
-                          nu, nv);
+    image_class_example * pv = new image_class_example(class_index, 
+                                                       nu, nv, (float)scale, 
+                                                       smoothed_generated_object_view, 
+                                                       patch_size);
+    pv->orig_u = float(kp->M[0]);
+    pv->orig_v = float(kp->M[1]);
 
-    nu = PyrImage::convCoordf(nu, 0, scale) + localization_noise * rand_m1p1();
-    nv = PyrImage::convCoordf(nv, 0, scale) + localization_noise * rand_m1p1();
+    preprocess_point_view(pv, smoothed_generated_object_view);
+
+    result->push_back(pv);
+    point_views.push_back(pv);
+  }
+}
+
+void affine_image_generator::build_model_pyramid(void)
+{
+  if (model_pyramid != 0 && model_pyramid->nbLev == level_number)
+    return;
 
-    if ((int)nu > patch_size && (int)nu < im->width  - patch_size &&
-        (int)nv > patch_size && (int)nv < im->height - patch_size)
+  if (model_pyramid != 0)
+    delete model_pyramid;
+  model_pyramid = new PyrImage(cvCloneImage(processed_original_image), level_number);
+  model_pyramid->build();
+}
+
+void affine_image_generator::draw_view_effects(void)
+{
+  // Drawn like in generate_affine_image(), once per view:
+  view_blur_aperture = 0;
+  view_intensity_scale = 1;
+  view_intensity_shift = 0;
+  if (add_gaussian_smoothing)
+  {
+    if (gf_rand(3) == 0)
+      view_blur_aperture = 3 + 2 * gf_rand(3);
+
+    if (change_intensities)
     {
-      image_class_example * pv = new image_class_example(kp->class_index, 
-                                                         nu, nv, (float)scale, 
-                                                         smoothed_generated_object_view, 
-                                                         patch_size);
-      pv->orig_u = float(kp->M[0]);
-      pv->orig_v = float(kp->M[1]);
+      view_intensity_scale = rand(0.8f, 1.2f);
+      view_intensity_shift = rand(-10.f, 10.f);
+    }
+  }
+  index_white_noise = 1 + gf_rand(prime - 1);
+}
+
+void affine_image_generator::generate_local_window(int level, int u, int v)
+{
+  IplImage * im = smoothed_generated_object_view->image[level];
+  IplImage * model = model_pyramid->images[level];
+
+  // The rotated patch and the orientation window, plus the smoothing kernels' support:
+  const int margin = 4;
+  int radius = (3 * patch_size) / 4 + 2 + margin;
+  int x0 = MAX(0, u - radius), x1 = MIN(im->width - 1, u + radius);
+  int y0 = MAX(0, v - radius), y1 = MIN(im->height - 1, v + radius);
+  if (x0 > x1 || y0 > y1)
+    return;
+
+  // The mapping of the cvWarpAffine() call of generate_affine_image(), from
+  // this level of the view to the same level of the model. The linear part
+  // does not depend on the level.
+  float level_scale = float(1 << level);
+  int cw = (affine_image->width - 1) / 2, ch = (affine_image->height - 1) / 2;
+  float b2 = (a[2] - a[0] * cw - a[1] * ch) / level_scale;
+  float b5 = (a[5] - a[3] * cw - a[4] * ch) / level_scale;
+
+  // cvPyrDown() divides the standard deviation of white noise by 256 / 70 at
+  // every level: attenuate the noise added here the same way.
+  int noise_gain = 256;
+  for(int l = 0; l < level; l++)
+    noise_gain = (noise_gain * 70) >> 8;
+
+  const int mw = model->width, mh = model->height;
+  for(int y = y0; y <= y1; y++)
+  {
+    unsigned char * row = mcvRow(im, y, unsigned char);
+    float su = a[0] * x0 + a[1] * y + b2;
+    float sv = a[3] * x0 + a[4] * y + b5;
 
-      preprocess_point_view(pv, smoothed_generated_object_view);
+    for(int x = x0; x <= x1; x++, su += a[0], sv += a[3])
+    {
+      int p = 128;
+      int iu = int(floorf(su)), iv = int(floorf(sv));
+      if (iu >= 0 && iu < mw - 1 && iv >= 0 && iv < mh - 1)
+      {
+        float fu = su - iu, fv = sv - iv;
+        const unsigned char * m0 = mcvRow(model, iv, unsigned char) + iu;
+        const unsigned char * m1 = mcvRow(model, iv + 1, unsigned char) + iu;
+        float top = m0[0] + fu * (m0[1] - m0[0]);
+        float bottom = m1[0] + fu * (m1[1] - m1[0]);
+        p = int(top + fv * (bottom - top) + .5f);
+      }
+
+      // Background, as replace_by_noise() does it on the whole view:
+      if (use_random_background && p == 128)
+      {
+        p = 128 + (((int((unsigned char)white_noise[index_white_noise]) - 128) * noise_gain) / 256);
+        index_white_noise++;
+        if (index_white_noise >= prime) index_white_noise = 1 + gf_rand(6);
+      }
 
-      result->push_back(pv);
-      point_views.push_back(pv);
+      row[x] = (unsigned char)p;
     }
   }
 
-  return result;
+  cvSetImageROI(im, cvRect(x0, y0, x1 - x0 + 1, y1 - y0 + 1));
+
+  if (add_gaussian_smoothing)
+  {
+    // The blur is drawn for level 0; at the upper levels its aperture shrinks with the image:
+    int aperture = view_blur_aperture >> level;
+    if (aperture >= 3)
+      cvSmooth(im, im, CV_GAUSSIAN, aperture | 1, aperture | 1);
+
+    if (change_intensities)
+      cvCvtScale(im, im, view_intensity_scale, view_intensity_shift);
+
+    if (noise_level > 0)
+      for(int y = y0; y <= y1; y++)
+      {
+        unsigned char * row = mcvRow(im, y, unsigned char);
+        for(int x = x0; x <= x1; x++)
+        {
+          int p = row[x] + ((limited_white_noise[index_white_noise] * noise_gain) / 256);
+          row[x] = (unsigned char)(p > 255 ? 255 : (p < 0 ? 0 : p));
+
+          index_white_noise++;
+          if (index_white_noise >= prime) index_white_noise = 1 + gf_rand(6);
+        }
+      }
+  }
+
+  // object_view::build() smooths level 0 only; the model pyramid already is
+  // smoothed by cvPyrDown() above it.
+  if (level == 0 && gaussian_smoothing_kernel_size != 0)
+  {
+    int k = gaussian_smoothing_kernel_size < 0 ? 3 : gaussian_smoothing_kernel_size;
+    cvSmooth(im, im, CV_GAUSSIAN, k, k);
+  }
+
+  cvResetImageROI(im);
+  processed_pixel_number += double(x1 - x0 + 1) * (y1 - y0 + 1);
+
+  // Windows of neighbouring keypoints overlap: the gradient tiles computed
+  // for an earlier window may be stale.
+  if (use_orientation_correction)
+  {
+    smoothed_generated_object_view->invalidate_gradient();
+    smoothed_generated_object_view->comp_gradient_around(level, u, v, patch_size / 2 + 1);
+  }
 }
 
 void affine_image_generator::release_examples(void)
@@ -606,3 +906,78 @@ void affine_image_generator::release_examples(void)
 
   point_views.clear();
 }
+
+// 64 bit FNV-1a, for cache_key().
+static void hash_bytes(unsigned long long & h, const void * data, size_t size)
+{
+  const unsigned char * p = (const unsigned char *)data;
+  for(size_t i = 0; i < size; i++)
+  {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+}
+
+template <class T> static void hash_value(unsigned long long & h, T value)
+{
+  hash_bytes(h, &value, sizeof(value));
+}
+
+static void hash_keypoints(unsigned long long & h, const object_keypoint * keypoints, int n)
+{
+  hash_value(h, n);
+  for(int i = 0; i < n; i++)
+  {
+    hash_value(h, keypoints[i].M[0]);
+    hash_value(h, keypoints[i].M[1]);
+    hash_value(h, keypoints[i].scale);
+    hash_value(h, keypoints[i].class_index);
+  }
+}
+
+string affine_image_generator::cache_key(void)
+{
+  unsigned long long h = 14695981039346656037ULL;
+
+  if (processed_original_image != 0)
+  {
+    IplImage * im = processed_original_image;
+    hash_value(h, im->width);
+    hash_value(h, im->height);
+    hash_value(h, im->nChannels);
+    hash_value(h, im->depth);
+    int row_size = im->width * im->nChannels * ((im->depth & 255) / 8);
+    for(int y = 0; y < im->height; y++)
+      hash_bytes(h, im->imageData + y * im->widthStep, row_size);
+  }
+  if (affine_image != 0)
+  {
+    hash_value(h, affine_image->width);
+    hash_value(h, affine_image->height);
+  }
+
+  int corners[8] = { u_corner1, v_corner1, u_corner2, v_corner2, u_corner3, v_corner3, u_corner4, v_corner4 };
+  hash_bytes(h, corners, sizeof(corners));
+
+  hash_keypoints(h, used_keypoint_array, point_number);
+  hash_keypoints(h, background_keypoint_array, background_point_number);
+
+  hash_value(h, use_orientation_correction);
+  hash_value(h, use_random_background);
+  hash_value(h, add_gaussian_smoothing);
+  hash_value(h, change_intensities);
+  hash_value(h, use_local_warping);
+  hash_value(h, noise_level);
+  hash_value(h, gaussian_smoothing_kernel_size);
+  hash_value(h, patch_size);
+  hash_value(h, level_number);
+  hash_value(h, localization_noise);
+  float ranges[10] = { min_theta, max_theta, min_phi, max_phi, min_lambda1, max_lambda1,
+                       min_lambda2, max_lambda2, min_l1_l2, max_l1_l2 };
+  hash_bytes(h, ranges, sizeof(ranges));
+  hash_value(h, scaling_method);
+
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", h);
+  return string(key);
+}
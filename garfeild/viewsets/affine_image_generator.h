@@ -24,10 +24,12 @@
 #ifndef AFFINE_IMAGE_GENERATOR_H
 #define AFFINE_IMAGE_GENERATOR_H
 
+#include <string>
 #include <starter.h>
 #include <viewsets/object_view.h>
 #include <keypoints/keypoint_orientation_corrector.h>
 #include "example_generator.h"
+#include "patch_kernels.h"
 
 
 //! An affine image generator.
@@ -48,6 +50,13 @@ class affine_image_generator : public example_generator
 
   void set_object_keypoints(object_keypoint * keypoint_array, int point_number);
 
+  /*! Keypoints that do not belong to the object. While set (point_number > 0),
+    generate_random_examples() produces two-class examples for training a cascade:
+    class 0 for object keypoints and class 1 for these ones. Pass 0, 0 to go back
+    to the normal labelling.
+  */
+  void set_background_keypoints(object_keypoint * keypoint_array, int point_number);
+
   void reset_keypoints(void);
   void add_keypoint(float u, float v, int scale, int class_index);
 
@@ -84,6 +93,13 @@ class affine_image_generator : public example_generator
 
   void set_gaussian_smoothing_kernel_size(int p_gaussian_smoothing_kernel_size)
   { gaussian_smoothing_kernel_size = p_gaussian_smoothing_kernel_size; }
+  /*! Default false. When set, generate_random_examples() does not warp and
+    smooth the whole view: for every keypoint, it warps a window around the
+    keypoint, directly at its pyramid level, from a pyramid of the model.
+    Noise, blur and intensity changes are applied to that window only.
+  */
+  void set_use_local_warping(bool p_use_local_warping)
+  { use_local_warping = p_use_local_warping; }
 
   void generate_random_affine_transformation(void);
   void generate_Id_affine_transformation(void);
@@ -97,6 +113,16 @@ class affine_image_generator : public example_generator
 
   vector<image_class_example *> * generate_random_examples(void);
   void release_examples(void);
+  //! The caller takes over the examples generated since the last
+  //! release_examples(): release_examples() will not delete them.
+  void forget_examples(void) { point_views.clear(); }
+  affine_image_generator * clone(void);
+
+  /*! Hash of everything the generated examples depend on: the model image,
+    the ROI, the keypoints and the generator parameters. Names the files of
+    cached_example_generator.
+  */
+  string cache_key(void);
 
   void affine_transformation(float u, float v, float & nu, float & nv);
   void inverse_affine_transformation(float u, float v, float & nu, float & nv);
@@ -104,7 +130,26 @@ class affine_image_generator : public example_generator
   static void affine_transformation(float a[6], int width, int height, float u, float v, float & nu, float & nv);
   static void inverse_affine_transformation(float a[6], int width, int height, float u, float v, float & nu, float & nv);
 
-  void preprocess_point_view(image_class_example * pv, object_view * ov);
+  //! If \a orientation_estimated is true, pv->point2d->orientation_in_radians
+  //! was already set by estimate_orientations().
+  void preprocess_point_view(image_class_example * pv, object_view * ov, bool orientation_estimated = false);
+  //! Estimates the orientation of the \a n keypoints of \a pvs in one batch per pyramid level.
+  void estimate_orientations(image_class_example ** pvs, int n, object_view * ov);
+
+  void add_example(vector<image_class_example *> * result, object_keypoint * kp, int class_index);
+
+ private:
+  //! Deep copy, used by clone().
+  affine_image_generator(const affine_image_generator & other);
+
+  //! Local warping: builds model_pyramid if needed.
+  void build_model_pyramid(void);
+  //! Local warping: draws the blur and intensity change of the next view.
+  void draw_view_effects(void);
+  //! Local warping: generates the window of level \a level of the view around (\a u, \a v).
+  void generate_local_window(int level, int u, int v);
+
+ public:
 
   void add_white_noise(IplImage * image);
   void replace_by_noise(IplImage * image, int value);
@@ -123,12 +168,25 @@ class affine_image_generator : public example_generator
   object_keypoint * local_keypoint_array;
   int point_number;
 
+  object_keypoint * background_keypoint_array;
+  int background_point_number;
+
   keypoint_orientation_corrector * orientation_corrector;
+  //! Specialized kernels for patch_size, 0 if there are none.
+  const patch_kernel_set * kernels;
 
   bool use_orientation_correction;
   bool use_random_background;
   bool add_gaussian_smoothing;
   bool change_intensities;
+  bool use_local_warping;
+
+  //! Local warping: the processed model image and its pyramid.
+  PyrImage * model_pyramid;
+  int view_blur_aperture;
+  float view_intensity_scale, view_intensity_shift;
+  //! Pixels of the views warped so far, for benchmarking.
+  double processed_pixel_number;
 
   int noise_level;
   int gaussian_smoothing_kernel_size;
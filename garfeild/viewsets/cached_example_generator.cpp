@@ -0,0 +1,340 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <string.h>
+using namespace std;
+
+#include <starter.h>
+#include "cached_example_generator.h"
+
+static const char cache_magic[8] = { 'G', 'F', 'E', 'X', 'M', 'P', 'L', 'S' };
+static const int cache_version = 1;
+static const int cache_key_size = 32;
+// Header layout: magic, version, patch size, key, batch count.
+static const long batch_count_offset = sizeof(cache_magic) + 2 * sizeof(int) + cache_key_size;
+static const int cache_file_buffer_size = 1 << 20;
+// Sanity check on the example count of a batch read back:
+static const int max_batch_size = 1 << 20;
+
+cached_example_generator::cached_example_generator(const string & file_name, const string & _key, int _patch_size)
+{
+  key = _key;
+  patch_size = _patch_size;
+  patch_step = (patch_size + 3) & ~3;
+  cached_batch_number = read_batch_number = batch_count = 0;
+  reading = false;
+  write_failed = false;
+  source = 0;
+  from_source = false;
+  patches = 0;
+  patch_capacity = 0;
+  file_buffer = 0;
+  append_position = 0;
+
+  file = fopen(file_name.c_str(), "r+b");
+  if (file != 0 && read_header())
+  {
+    cached_batch_number = batch_count = count_complete_batches();
+    reading = cached_batch_number > 0;
+    cout << "Example cache " << file_name << ": " << cached_batch_number << " batches." << endl;
+  }
+  else
+  {
+    if (file != 0)
+    {
+      cout << "Example cache " << file_name << " is for other parameters: overwriting it." << endl;
+      fclose(file);
+    }
+    file = fopen(file_name.c_str(), "w+b");
+    if (file == 0)
+    {
+      cerr << "Could not create the example cache " << file_name << "." << endl;
+      return;
+    }
+    batch_count = 0;
+    if (!write_header())
+    {
+      cerr << "Could not write the example cache " << file_name << "." << endl;
+      fclose(file);
+      file = 0;
+      return;
+    }
+  }
+
+  file_buffer = new char[cache_file_buffer_size];
+  setvbuf(file, file_buffer, _IOFBF, cache_file_buffer_size);
+}
+
+cached_example_generator::~cached_example_generator()
+{
+  release_examples();
+
+  if (file != 0)
+  {
+    if (fseek(file, batch_count_offset, SEEK_SET) != 0 ||
+        fwrite(&batch_count, sizeof(batch_count), 1, file) != 1)
+      cerr << "Could not update the example cache batch count." << endl;
+    fclose(file);
+  }
+  if (file_buffer) delete [] file_buffer;
+  if (patches) cvFree(&patches);
+}
+
+bool cached_example_generator::read_header(void)
+{
+  char magic[sizeof(cache_magic)];
+  int version, size;
+  char file_key[cache_key_size];
+
+  if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, cache_magic, sizeof(magic)) != 0)
+    return false;
+  if (fread(&version, sizeof(version), 1, file) != 1 || version != cache_version)
+    return false;
+  if (fread(&size, sizeof(size), 1, file) != 1 || size != patch_size)
+    return false;
+  if (fread(file_key, sizeof(file_key), 1, file) != 1 ||
+      strncmp(file_key, key.c_str(), cache_key_size) != 0)
+    return false;
+  if (fread(&batch_count, sizeof(batch_count), 1, file) != 1 || batch_count < 0)
+    return false;
+
+  return true;
+}
+
+int cached_example_generator::count_complete_batches(void)
+{
+  // A run that was interrupted leaves a partial batch at the end of the file,
+  // or batches not counted in the header yet. Only trust the batches that
+  // are there in full, so that the number of batches to generate is known
+  // before starting.
+  long data_start = ftell(file);
+  fseek(file, 0, SEEK_END);
+  long file_size = ftell(file);
+  fseek(file, data_start, SEEK_SET);
+
+  long patch_bytes = long(patch_step) * patch_size;
+  long position = data_start;
+  int count = 0;
+  while (count < batch_count)
+  {
+    int n;
+    if (fread(&n, sizeof(n), 1, file) != 1 || n < 0 || n > max_batch_size)
+      break;
+    long next = position + long(sizeof(n)) + n * (long(sizeof(example_record)) + patch_bytes);
+    if (next > file_size || fseek(file, next, SEEK_SET) != 0)
+      break;
+    position = next;
+    count++;
+  }
+
+  // Appended batches overwrite whatever follows the last complete one.
+  fseek(file, data_start, SEEK_SET);
+  append_position = position;
+  return count;
+}
+
+bool cached_example_generator::write_header(void)
+{
+  char file_key[cache_key_size];
+  memset(file_key, 0, sizeof(file_key));
+  strncpy(file_key, key.c_str(), cache_key_size);
+
+  return fwrite(cache_magic, sizeof(cache_magic), 1, file) == 1 &&
+    fwrite(&cache_version, sizeof(cache_version), 1, file) == 1 &&
+    fwrite(&patch_size, sizeof(patch_size), 1, file) == 1 &&
+    fwrite(file_key, sizeof(file_key), 1, file) == 1 &&
+    fwrite(&batch_count, sizeof(batch_count), 1, file) == 1;
+}
+
+int cached_example_generator::skip_cached_batches(int n)
+{
+  // count_complete_batches() checked these batches already: seek over them
+  // instead of reading their patches.
+  long patch_bytes = long(patch_step) * patch_size;
+  int skipped = 0;
+  while (skipped < n && reading)
+  {
+    long batch_start = ftell(file);
+    int count;
+    if (fread(&count, sizeof(count), 1, file) != 1 ||
+        fseek(file, count * (long(sizeof(example_record)) + patch_bytes), SEEK_CUR) != 0)
+    {
+      fseek(file, batch_start, SEEK_SET);
+      break;
+    }
+    skipped++;
+    read_batch_number++;
+    if (read_batch_number == cached_batch_number)
+    {
+      reading = false;
+      fseek(file, append_position, SEEK_SET);
+    }
+  }
+  return skipped;
+}
+
+vector<image_class_example *> * cached_example_generator::generate_random_examples(void)
+{
+  if (reading)
+  {
+    long batch_start = ftell(file);
+    vector<image_class_example *> * result = read_batch();
+    if (result != 0)
+    {
+      read_batch_number++;
+      if (read_batch_number == cached_batch_number)
+      {
+        // The next batches are appended. Switching a stream from reading
+        // to writing needs a seek in between anyway.
+        reading = false;
+        fseek(file, append_position, SEEK_SET);
+      }
+      return result;
+    }
+
+    // Read error: keep what was read, and generate the rest over it.
+    cerr << "Could not read the example cache after " << read_batch_number << " batches." << endl;
+    batch_count = read_batch_number;
+    reading = false;
+    fseek(file, batch_start, SEEK_SET);
+  }
+
+  if (source == 0)
+    return 0;
+
+  vector<image_class_example *> * result = source->generate_random_examples();
+  from_source = true;
+
+  if (file != 0 && !write_failed && result != 0)
+  {
+    if (write_batch(result))
+      batch_count++;
+    else
+    {
+      cerr << "Could not write to the example cache: not caching the remaining examples." << endl;
+      write_failed = true;
+    }
+  }
+
+  return result;
+}
+
+vector<image_class_example *> * cached_example_generator::read_batch(void)
+{
+  int n;
+  if (fread(&n, sizeof(n), 1, file) != 1 || n < 0 || n > max_batch_size)
+    return 0;
+
+  int patch_bytes = patch_step * patch_size;
+  if (n > patch_capacity)
+  {
+    if (patches) cvFree(&patches);
+    patches = (unsigned char *)cvAlloc(size_t(n) * patch_bytes);
+    patch_capacity = n;
+  }
+
+  records.resize(n);
+  keypoints.resize(n);
+  if (n > 0)
+  {
+    if (fread(&records[0], sizeof(example_record), n, file) != size_t(n))
+      return 0;
+    if (fread(patches, patch_bytes, n, file) != size_t(n))
+      return 0;
+  }
+
+  examples.reserve(n);
+  for(int i = 0; i < n; i++)
+  {
+    const example_record & r = records[i];
+    keypoint & k = keypoints[i];
+    k.u = r.u;
+    k.v = r.v;
+    k.scale = float(r.level);
+    k.orientation_in_radians = 0;
+
+    image_class_example * e = new image_class_example();
+    e->class_index = r.class_index;
+    e->orig_u = r.orig_u;
+    e->orig_v = r.orig_v;
+    e->point2d = &k;
+    e->alloc_in(patches + size_t(i) * patch_bytes, patch_size);
+    examples.push_back(e);
+  }
+
+  // The caller deletes the vector, the examples stay ours until release_examples():
+  return new vector<image_class_example *>(examples);
+}
+
+bool cached_example_generator::write_batch(vector<image_class_example *> * batch)
+{
+  int n = int(batch->size());
+
+  records.resize(n);
+  for(int i = 0; i < n; i++)
+  {
+    image_class_example * e = (*batch)[i];
+    if (e->preprocessed == 0 || e->preprocessed->width != patch_size || e->preprocessed->height != patch_size)
+      return false;
+
+    example_record & r = records[i];
+    r.class_index = e->class_index;
+    r.level = e->point2d ? int(e->point2d->scale) : 0;
+    r.u = e->point2d ? e->point2d->u : 0;
+    r.v = e->point2d ? e->point2d->v : 0;
+    r.orig_u = e->orig_u;
+    r.orig_v = e->orig_v;
+  }
+
+  if (fwrite(&n, sizeof(n), 1, file) != 1)
+    return false;
+  if (n > 0 && fwrite(&records[0], sizeof(example_record), n, file) != size_t(n))
+    return false;
+
+  // Pad the rows to patch_step, as alloc_in() expects them when reading back:
+  static const unsigned char padding[4] = { 0, 0, 0, 0 };
+  for(int i = 0; i < n; i++)
+  {
+    IplImage * patch = (*batch)[i]->preprocessed;
+    for(int y = 0; y < patch_size; y++)
+    {
+      if (fwrite(patch->imageData + y * patch->widthStep, patch_size, 1, file) != 1)
+        return false;
+      if (patch_step > patch_size && fwrite(padding, patch_step - patch_size, 1, file) != 1)
+        return false;
+    }
+  }
+
+  return true;
+}
+
+void cached_example_generator::release_examples(void)
+{
+  if (from_source)
+  {
+    source->release_examples();
+    from_source = false;
+  }
+
+  for(vector<image_class_example *>::iterator it = examples.begin(); it < examples.end(); it++)
+    delete *it;
+  examples.clear();
+}
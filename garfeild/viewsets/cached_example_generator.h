@@ -0,0 +1,111 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHED_EXAMPLE_GENERATOR_H
+#define CACHED_EXAMPLE_GENERATOR_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <keypoints/keypoint.h>
+#include "example_generator.h"
+
+/*!
+  \ingroup viewsets
+  \brief Keeps the examples of another generator in a file.
+
+  The first run writes every batch the source generates to the file, one
+  after the other. Later runs with the same key stream the batches back from
+  the file instead of generating them, and only ask the source for the
+  batches the file runs out of, which are appended.
+
+  The file holds a header (magic, version, patch size, key, batch count)
+  followed by the batches. A batch is its example count, then one record
+  (class index, level, position) per example, then the patches, rows
+  (patch_size + 3) & ~3 bytes apart. Patches are read straight into one
+  block and used in place by image_class_example::alloc_in(). The file is in
+  host byte order.
+*/
+class cached_example_generator : public example_generator
+{
+public:
+  /*! Opens \a file_name, or creates it if it does not exist or does not hold
+    examples of \a patch_size for \a key. Use
+    affine_image_generator::cache_key() as the key.
+  */
+  cached_example_generator(const string & file_name, const string & key, int patch_size);
+  //! Writes the batch count and closes the file.
+  ~cached_example_generator();
+
+  //! False if the file could not be opened: everything comes from the source then.
+  bool is_ok(void) { return file != 0; }
+  //! Number of batches in the file when it was opened.
+  int get_cached_batch_number(void) { return cached_batch_number; }
+
+  //! Generator for the batches that are not in the file. Not deleted.
+  void set_source(example_generator * _source) { source = _source; }
+
+  vector<image_class_example *> * generate_random_examples(void);
+  void release_examples(void);
+
+  //! Skips up to \a n of the batches in the file, to resume an interrupted
+  //! run. \return the number of batches skipped.
+  int skip_cached_batches(int n);
+
+private:
+  struct example_record
+  {
+    int class_index;
+    int level;
+    float u, v;
+    float orig_u, orig_v;
+  };
+
+  bool read_header(void);
+  //! Number of batches of the header that are complete in the file.
+  int count_complete_batches(void);
+  bool write_header(void);
+  vector<image_class_example *> * read_batch(void);
+  bool write_batch(vector<image_class_example *> * batch);
+
+  FILE * file;
+  char * file_buffer;
+  string key;
+  int patch_size, patch_step;
+
+  int cached_batch_number, read_batch_number, batch_count;
+  //! Where the first batch not in the file goes.
+  long append_position;
+  bool reading, write_failed;
+
+  example_generator * source;
+  bool from_source;
+
+  //! Examples read from the file, with their keypoints and patches.
+  vector<image_class_example *> examples;
+  vector<keypoint> keypoints;
+  vector<example_record> records;
+  unsigned char * patches;
+  int patch_capacity;
+};
+
+#endif // CACHED_EXAMPLE_GENERATOR_H
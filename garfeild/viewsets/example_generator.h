@@ -46,6 +46,11 @@ public:
   virtual vector<image_class_example *> * generate_random_examples(void) { return 0; }
 
   virtual void release_examples(void) { }
+
+  /*! Returns an independent copy of this generator that can run in another
+    thread, or 0 if the generator can not be cloned. The caller deletes it.
+  */
+  virtual example_generator * clone(void) { return 0; }
 };
 
 #endif // EXAMPLE_GENERATOR_H
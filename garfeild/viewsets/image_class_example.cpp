@@ -37,6 +37,7 @@ image_class_example::image_class_example(int _class_index,
   point2d->v = v;
   point2d->scale = scale;
   preprocessed = cvCreateImage(cvSize(patch_size, patch_size), IPL_DEPTH_8U, 1);
+  owns_preprocessed = true;
 
   view = ov;
 
@@ -49,6 +50,8 @@ image_class_example::image_class_example(int p_class_index, IplImage * image)
 {
   class_index = p_class_index;
   point2d = 0;
+  preprocessed = 0;
+  owns_preprocessed = true;
 
   original_image = cvCloneImage(image);
 }
@@ -58,16 +61,27 @@ image_class_example::image_class_example()
   point2d = 0;
   original_image = 0;
   preprocessed = 0;
+  owns_preprocessed = true;
   view = 0;
 }
 
 image_class_example::~image_class_example(void)
 {
-  if (preprocessed) cvReleaseImage(&preprocessed);
+  if (preprocessed && owns_preprocessed) cvReleaseImage(&preprocessed);
   if (original_image) cvReleaseImage(&original_image);
 }
 
 void image_class_example::alloc(int sz) {
+  if (preprocessed && owns_preprocessed) cvReleaseImage(&preprocessed);
   preprocessed = cvCreateImage(cvSize(sz, sz), IPL_DEPTH_8U, 1);
+  owns_preprocessed = true;
+}
+
+void image_class_example::alloc_in(unsigned char * data, int sz) {
+  if (preprocessed && owns_preprocessed) cvReleaseImage(&preprocessed);
+  cvInitImageHeader(&preprocessed_header, cvSize(sz, sz), IPL_DEPTH_8U, 1, IPL_ORIGIN_TL, 4);
+  preprocessed_header.imageData = preprocessed_header.imageDataOrigin = (char *)data;
+  preprocessed = &preprocessed_header;
+  owns_preprocessed = false;
 }
 
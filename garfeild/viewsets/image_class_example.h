@@ -57,8 +57,16 @@ public:
   IplImage * preprocessed;
 
   void alloc(int sz);
+  //! Uses \a data, a sz x sz block owned by the caller, as the preprocessed patch.
+  //! The patch rows are (sz + 3) & ~3 bytes apart: packed for the usual patch sizes.
+  void alloc_in(unsigned char * data, int sz);
 
   float dot_product;
+
+private:
+  //! Header of preprocessed when it was set by alloc_in().
+  IplImage preprocessed_header;
+  bool owns_preprocessed;
 };
 
 #endif // IMAGE_CLASS_EXAMPLE_H
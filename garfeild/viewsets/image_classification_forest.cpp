@@ -24,6 +24,9 @@
 
 #include <fstream>
 #include <iomanip>
+#include <algorithm>
+#include <unistd.h>
+#include <pthread.h>
 using namespace std;
 
 #include <starter.h>
@@ -33,6 +36,12 @@ image_classification_forest::image_classification_forest(LEARNPROGRESSION _Learn
                                                          : image_classifier(_LearnProgress)
 {
   weights=0;
+  thread_number = 0;
+  refinement_tolerance = 0;
+  refinement_check_interval = 0;
+  refinement_call_number = 0;
+  refinement_checkpoint_interval = 0;
+  resumed_call_number = 0;
 }
 
 image_classification_forest::image_classification_forest(int _image_width, int _image_height, int _class_number,
@@ -44,6 +53,12 @@ image_classification_forest::image_classification_forest(int _image_width, int _
   tree_number = _tree_number;
 
   thresholds = misclassification_rates = 0;
+  thread_number = 0;
+  refinement_tolerance = 0;
+  refinement_check_interval = 0;
+  refinement_call_number = 0;
+  refinement_checkpoint_interval = 0;
+  resumed_call_number = 0;
 
   weights = new float[class_number];
   for(int i = 0; i < class_number; i++)
@@ -214,7 +229,17 @@ void image_classification_forest::create_trees_at_random(void)
 // Refine the posterior probabilities stored in the leaves for each tree
 void image_classification_forest::refine(example_generator * vg, int call_number)
 {
-  for(int i = 0; i < call_number; i++)
+  // Adaptive refinement: the reweighted distributions of a sample of the
+  // leaves are compared every check_interval calls.
+  vector<float *> sampled_leaves;
+  vector<float> previous_distributions;
+  int check_interval = refinement_check_interval > 0 ? refinement_check_interval : MAX(call_number / 50, 10);
+  int stable_checks = 0;
+  if (refinement_tolerance > 0)
+    sample_leaves(sampled_leaves, 64);
+
+  int i;
+  for(i = resumed_call_number; i < call_number; i++)
   {
     if (LearnProgression!=0)
       LearnProgression(FOREST_REFINEMENT, i, call_number);
@@ -225,29 +250,41 @@ void image_classification_forest::refine(example_generator * vg, int call_number
 
     for(vector<image_class_example *>::iterator example_it = examples->begin(); example_it < examples->end(); example_it++)
     {
-      for(vector<image_classification_tree *>::iterator tree_it = trees.begin(); tree_it < trees.end(); tree_it++)
-      {
-        image_classification_node * node = (*tree_it)->root;
-        unsigned char * I = (unsigned char *)((*example_it)->preprocessed->imageData);
-
-        while(!node->is_leaf())
-        {
-          int dot_product = (int)I[node->d1] - (int)I[node->d2];
+      const unsigned char * I = (const unsigned char *)((*example_it)->preprocessed->imageData);
 
-          if (dot_product <= 0)
-            node = node->children[0];
-          else
-            node = node->children[1];
-        }
-        node->P[(*example_it)->class_index]++;
-      }
+      for(vector<image_classification_tree *>::iterator tree_it = trees.begin(); tree_it < trees.end(); tree_it++)
+        (*tree_it)->descend(I)[(*example_it)->class_index]++;
       weights[(*example_it)->class_index]++;
     }
 
     delete examples;
 
     vg->release_examples();
+
+    if (!refinement_checkpoint.empty() && refinement_checkpoint_interval > 0 &&
+        (i + 1) % refinement_checkpoint_interval == 0 && i + 1 < call_number)
+      save_refinement_checkpoint(refinement_checkpoint, i + 1);
+
+    if (refinement_tolerance > 0 && (i + 1) % check_interval == 0)
+    {
+      float change = leaf_distribution_change(sampled_leaves, previous_distributions);
+      // Twice in a row, so that one lucky batch does not stop the refinement:
+      if (change >= 0 && change < refinement_tolerance)
+        stable_checks++;
+      else
+        stable_checks = 0;
+
+      if (stable_checks >= 2)
+      {
+        i++;
+        cout << "Leaf distributions changed by " << change << " over the last " << check_interval
+             << " calls: stopping refinement after " << i << " of " << call_number << " calls." << endl;
+        break;
+      }
+    }
   }
+  refinement_call_number = i;
+  resumed_call_number = 0;
 
   cout << "Reweighted refinement: " << endl;
 
@@ -260,7 +297,156 @@ void image_classification_forest::refine(example_generator * vg, int call_number
   for(vector<image_classification_tree *>::iterator tree_it = trees.begin(); tree_it < trees.end(); tree_it++)
     (*tree_it)->root->reestimate_probabilities_recursive(weights);
 
-  cout << "Forest refinement done (" << call_number << " calls to generate_random_examples).            " << endl;
+  cout << "Forest refinement done (" << refinement_call_number << " calls to generate_random_examples).            " << endl;
+}
+
+bool image_classification_forest::save_refinement_checkpoint(string file_name, int calls_done)
+{
+  // Written aside and renamed, so that a crash never leaves half a checkpoint:
+  string tmp_name = file_name + ".tmp";
+  ofstream ofs(tmp_name.data());
+  if (!ofs.good()) return false;
+
+  // Leaf counts are integers: keep all their digits.
+  ofs << setprecision(10);
+  gf_rng & rng = gf_thread_rng();
+  ofs << "refinement_checkpoint: 1" << endl;
+  ofs << "calls_done: " << calls_done << endl;
+  ofs << "rng: " << rng.s[0] << " " << rng.s[1] << " " << rng.s[2] << " " << rng.s[3] << endl;
+  ofs << "trees: " << trees.size() << endl;
+  ofs << "weights: " << class_number << endl;
+  for(int i = 0; i < class_number; i++)
+    ofs << weights[i] << endl;
+  for(vector<image_classification_tree *>::iterator tree_it = trees.begin(); tree_it < trees.end(); tree_it++)
+    (*tree_it)->save(ofs);
+  ofs << "end" << endl;
+  ofs.close();
+#ifdef WIN32
+  remove(file_name.data()); // rename() does not replace files there
+#endif
+
+  if (ofs.fail() || rename(tmp_name.data(), file_name.data()) != 0)
+  {
+    cerr << "Could not write the refinement checkpoint " << file_name << endl;
+    unlink(tmp_name.data());
+    return false;
+  }
+  return true;
+}
+
+int image_classification_forest::load_refinement_checkpoint(string file_name)
+{
+  ifstream ifs(file_name.data());
+  if (!ifs.good()) return -1;
+
+  string dummyString;
+  int version = 0, calls_done = -1, new_tree_number = 0, new_class_number = 0;
+  gf_rng rng;
+  ifs >> dummyString >> version;
+  ifs >> dummyString >> calls_done;
+  ifs >> dummyString >> rng.s[0] >> rng.s[1] >> rng.s[2] >> rng.s[3];
+  ifs >> dummyString >> new_tree_number;
+  ifs >> dummyString >> new_class_number;
+  if (!ifs.good() || version != 1 || calls_done < 0 || new_tree_number <= 0 || new_class_number <= 0)
+    return -1;
+
+  float * new_weights = new float[new_class_number];
+  for(int i = 0; i < new_class_number; i++)
+    ifs >> new_weights[i];
+
+  vector<image_classification_tree *> new_trees;
+  bool ok = ifs.good();
+  for(int i = 0; i < new_tree_number && ok; i++)
+  {
+    image_classification_tree * tree = new image_classification_tree();
+    ok = tree->load(ifs);
+    if (ok)
+      new_trees.push_back(tree);
+    else
+      delete tree;
+  }
+  ifs >> dummyString;
+
+  if (!ok || dummyString != "end")
+  {
+    for(int i = 0; i < int(new_trees.size()); i++)
+      delete new_trees[i];
+    delete [] new_weights;
+    return -1;
+  }
+
+  for(vector<image_classification_tree *>::iterator tree_it = trees.begin(); tree_it < trees.end(); tree_it++)
+    delete (*tree_it);
+  trees = new_trees;
+  tree_number = new_tree_number;
+
+  if (weights != 0) delete [] weights;
+  weights = new_weights;
+  class_number = new_class_number;
+  image_width = trees[0]->image_width;
+  image_height = trees[0]->image_height;
+  max_depth = trees[0]->max_depth;
+
+  gf_thread_rng() = rng;
+  resumed_call_number = calls_done;
+
+  cout << "Resuming refinement after " << calls_done << " calls." << endl;
+  return calls_done;
+}
+
+void image_classification_forest::sample_leaves(vector<float *> & leaves, int per_tree)
+{
+  for(vector<image_classification_tree *>::iterator tree_it = trees.begin(); tree_it < trees.end(); tree_it++)
+  {
+    vector<image_classification_node *> tree_leaves, L;
+    L.push_back((*tree_it)->root);
+    while (!L.empty())
+    {
+      image_classification_node * node = L.back();
+      L.pop_back();
+      if (node->is_leaf())
+        tree_leaves.push_back(node);
+      else
+        for(int c = 0; c < node->children_number; c++)
+          L.push_back(node->children[c]);
+    }
+
+    int step = MAX(int(tree_leaves.size()) / per_tree, 1);
+    for(int l = 0; l < int(tree_leaves.size()); l += step)
+      leaves.push_back(tree_leaves[l]->P);
+  }
+}
+
+float image_classification_forest::leaf_distribution_change(const vector<float *> & leaves, vector<float> & previous)
+{
+  // Reweighted like reestimate_probabilities_recursive() will do it at the end:
+  vector<float> current(leaves.size() * class_number);
+  for(int l = 0; l < int(leaves.size()); l++)
+  {
+    float * p = &current[l * class_number];
+    float sum = 0;
+    for(int c = 0; c < class_number; c++)
+    {
+      p[c] = weights[c] > 0 ? leaves[l][c] / weights[c] : 0;
+      sum += p[c];
+    }
+    if (sum > 0)
+      for(int c = 0; c < class_number; c++)
+        p[c] /= sum;
+  }
+
+  float change = -1;
+  if (previous.size() == current.size() && !leaves.empty())
+  {
+    // Mean total variation distance between the two snapshots:
+    double total = 0;
+    for(int i = 0; i < int(current.size()); i++)
+      total += fabs(current[i] - previous[i]);
+    change = float(0.5 * total / leaves.size());
+  }
+
+  previous.swap(current);
+  return change;
 }
 
 void image_classification_forest::restore_occurances()
@@ -282,58 +468,193 @@ void image_classification_forest::reset_class_occurances(int class_index)
   weights[class_index] = 0.0f;
 }
 
-void image_classification_forest::test(example_generator * vg, int call_number)
+/*! Per thread state for image_classification_forest::test(). Every thread
+  generates views with its own clone of the example generator and fills its
+  own counters; they are summed once all the threads are done.
+*/
+class forest_test_data
 {
-  int * inlier_total = new int[class_number];
-  int * total = new int[class_number];
-
-  int ** correct_samples   = new int*[class_number];
-  int ** uncorrect_samples = new int*[class_number];
-
-  const float step = 0.01f;
-  int bin_number = int(1. / step);
-  for(int i = 0; i < class_number; i++)
+public:
+  forest_test_data(example_generator * _vg, int _class_number, int _bin_number)
+  {
+    vg = _vg;
+    class_number = _class_number;
+    bin_number = _bin_number;
+    call_number = 0;
+    next_call = 0;
+    report_progress = false;
+
+    inlier_total = new int[class_number];
+    total = new int[class_number];
+    correct_samples = new int[class_number * bin_number];
+    uncorrect_samples = new int[class_number * bin_number];
+    confusion = new int[class_number * class_number];
+    fill(inlier_total, inlier_total + class_number, 0);
+    fill(total, total + class_number, 0);
+    fill(correct_samples, correct_samples + class_number * bin_number, 0);
+    fill(uncorrect_samples, uncorrect_samples + class_number * bin_number, 0);
+    fill(confusion, confusion + class_number * class_number, 0);
+  }
+  ~forest_test_data()
   {
-    inlier_total[i] = total[i] = 0;
+    delete [] inlier_total;
+    delete [] total;
+    delete [] correct_samples;
+    delete [] uncorrect_samples;
+    delete [] confusion;
+  }
 
-    correct_samples[i] = new int[bin_number];
-    uncorrect_samples[i] = new int[bin_number];
-    for(int j = 0; j < bin_number; j++)
-      correct_samples[i][j] = uncorrect_samples[i][j] = 0;
+  //! Adds the counters of \c other to ours.
+  void accumulate(const forest_test_data & other)
+  {
+    for(int i = 0; i < class_number; i++) {
+      inlier_total[i] += other.inlier_total[i];
+      total[i] += other.total[i];
+    }
+    for(int i = 0; i < class_number * bin_number; i++) {
+      correct_samples[i] += other.correct_samples[i];
+      uncorrect_samples[i] += other.uncorrect_samples[i];
+    }
+    for(int i = 0; i < class_number * class_number; i++)
+      confusion[i] += other.confusion[i];
   }
 
-  for(int i = 0; i < call_number; i++)
+  image_classification_forest * forest;
+  example_generator * vg;
+  int class_number, bin_number;
+
+  int call_number;
+  //! Shared between the threads: index of the next call to generate_random_examples().
+  volatile int * next_call;
+  //! Call i draws its random numbers from stream rng_stream_base + i.
+  unsigned long long rng_stream_base;
+  bool report_progress;
+
+  int * inlier_total, * total;
+  //! class_number x bin_number histograms of the recognition score.
+  int * correct_samples, * uncorrect_samples;
+  //! confusion[true_class * class_number + found_class]
+  int * confusion;
+};
+
+void * image_classification_forest::test_thread_func(void * _data)
+{
+  forest_test_data * data = (forest_test_data *)_data;
+  data->forest->test_examples(data);
+  return 0;
+}
+
+void image_classification_forest::test_examples(forest_test_data * data)
+{
+  const float step = 1.f / data->bin_number;
+  int call_number = data->call_number;
+
+  for(;;)
   {
-    if (LearnProgression!=0)
-      LearnProgression(GENERATING_TESTING_SET, i, call_number);
+    int i = __sync_fetch_and_add(data->next_call, 1);
+    if (i >= call_number)
+      break;
 
-    cout << "GENERATING TESTING SET: " << call_number - i << "... " << (char)13 << flush;
+    // The examples of a call do not depend on the thread that makes them:
+    gf_seed_thread_rng(data->rng_stream_base + i);
 
-    vector<image_class_example *> * examples = vg->generate_random_examples();
+    if (data->report_progress)
+    {
+      if (LearnProgression!=0)
+        LearnProgression(GENERATING_TESTING_SET, i, call_number);
+
+      cout << "GENERATING TESTING SET: " << call_number - i << "... " << (char)13 << flush;
+    }
+
+    vector<image_class_example *> * examples = data->vg->generate_random_examples();
 
     for(vector<image_class_example *>::iterator it = examples->begin(); it < examples->end(); it++)
     {
       float score;
       int found_class_index = recognize(*it, &score);
+      int true_class_index = (*it)->class_index;
 
       int bin_index = int(score / step);
       if (bin_index < 0) bin_index = 0;
-      if (bin_index >= bin_number) bin_index = bin_number - 1;
+      if (bin_index >= data->bin_number) bin_index = data->bin_number - 1;
 
-      total[(*it)->class_index]++;
-      if ((*it)->class_index == found_class_index)
+      data->total[true_class_index]++;
+      data->confusion[true_class_index * class_number + found_class_index]++;
+      if (true_class_index == found_class_index)
       {
-        inlier_total[found_class_index]++;
-        correct_samples[found_class_index][bin_index]++;
+        data->inlier_total[found_class_index]++;
+        data->correct_samples[found_class_index * data->bin_number + bin_index]++;
       }
       else
-        uncorrect_samples[found_class_index][bin_index]++;
+        data->uncorrect_samples[found_class_index * data->bin_number + bin_index]++;
     }
 
     delete examples;
 
-    vg->release_examples();
+    data->vg->release_examples();
   }
+}
+
+void image_classification_forest::test(example_generator * vg, int call_number)
+{
+  const float step = 0.01f;
+  int bin_number = int(1. / step);
+
+  int n_threads = thread_number;
+  if (n_threads <= 0)
+    n_threads = int(sysconf(_SC_NPROCESSORS_ONLN));
+  if (n_threads > call_number)
+    n_threads = call_number;
+  if (n_threads < 1)
+    n_threads = 1;
+
+  // Every thread but the first one needs its own generator:
+  vector<example_generator *> generators;
+  generators.push_back(vg);
+  for(int t = 1; t < n_threads; t++)
+  {
+    example_generator * clone = vg->clone();
+    if (clone == 0)
+      break;
+    generators.push_back(clone);
+  }
+  n_threads = generators.size();
+
+  volatile int next_call = 0;
+  unsigned long long rng_stream_base = gf_thread_rng().next64();
+  // The calling thread reseeds for every call it makes: restore its generator after.
+  gf_rng caller_rng = gf_thread_rng();
+  vector<forest_test_data *> thread_data;
+  for(int t = 0; t < n_threads; t++)
+  {
+    forest_test_data * data = new forest_test_data(generators[t], class_number, bin_number);
+    data->forest = this;
+    data->call_number = call_number;
+    data->next_call = &next_call;
+    data->rng_stream_base = rng_stream_base;
+    data->report_progress = (t == 0);
+    thread_data.push_back(data);
+  }
+
+  if (n_threads > 1)
+    cout << "Testing with " << n_threads << " threads." << endl;
+
+  vector<pthread_t> threads(n_threads);
+  for(int t = 1; t < n_threads; t++)
+    pthread_create(&threads[t], 0, test_thread_func, thread_data[t]);
+  test_examples(thread_data[0]);
+  for(int t = 1; t < n_threads; t++)
+  {
+    pthread_join(threads[t], 0);
+    thread_data[0]->accumulate(*thread_data[t]);
+    delete thread_data[t];
+    delete generators[t];
+  }
+  gf_thread_rng() = caller_rng;
+
+  forest_test_data * merged = thread_data[0];
+  int * inlier_total = merged->inlier_total;
+  int * total = merged->total;
 
   // Estimate inlier rates and estimate thresholds:
   cout << "Testing: " << endl;
@@ -371,8 +692,8 @@ void image_classification_forest::test(example_generator * vg, int call_number)
     int j;
     for(j = bin_number - 1; j >= 0; j--)
     {
-      correct_number += correct_samples[i][j];
-      uncorrect_number += uncorrect_samples[i][j];
+      correct_number += merged->correct_samples[i * bin_number + j];
+      uncorrect_number += merged->uncorrect_samples[i * bin_number + j];
       if (float(correct_number) / (correct_number + uncorrect_number) < desired_inlier_rate &&
           (correct_number + uncorrect_number) > 10)
         break;
@@ -385,8 +706,8 @@ void image_classification_forest::test(example_generator * vg, int call_number)
     correct_number = 0; uncorrect_number = 0;
     for(int j = bin_number - 1; j >= 0; j--)
     {
-      correct_number += correct_samples[i][j];
-      uncorrect_number += uncorrect_samples[i][j];
+      correct_number += merged->correct_samples[i * bin_number + j];
+      uncorrect_number += merged->uncorrect_samples[i * bin_number + j];
     }
     if (correct_number != 0)
     {
@@ -405,18 +726,27 @@ void image_classification_forest::test(example_generator * vg, int call_number)
   cout << "         E[Ambig] = " << ambiguity_rate_mean << endl;
   cout << "-------------------------------------------" << endl;
 
-  // Clear allocated arrays:
+  // Confusion summary: the pairs of classes that get mistaken the most often.
+  vector< pair<int, int> > confused_pairs;
   for(int i = 0; i < class_number; i++)
+    for(int j = 0; j < class_number; j++)
+      if (i != j && merged->confusion[i * class_number + j] > 0)
+        confused_pairs.push_back(make_pair(-merged->confusion[i * class_number + j], i * class_number + j));
+  sort(confused_pairs.begin(), confused_pairs.end());
+
+  const int max_reported_pairs = 10;
+  cout << " MOST CONFUSED CLASSES (true -> found):" << endl;
+  for(int k = 0; k < int(confused_pairs.size()) && k < max_reported_pairs; k++)
   {
-    delete [] correct_samples[i];
-    delete [] uncorrect_samples[i];
+    int i = confused_pairs[k].second / class_number;
+    int j = confused_pairs[k].second % class_number;
+    int count = -confused_pairs[k].first;
+    cout << "  " << setw(4) << i << " -> " << setw(4) << j << ": " << setw(5) << count << " samples ("
+         << setprecision(3) << 100. * count / total[i] << "% of class " << i << ")" << endl;
   }
+  cout << "-------------------------------------------" << endl;
 
-  delete [] correct_samples;
-  delete [] uncorrect_samples;
-
-  delete [] total;
-  delete [] inlier_total;
+  delete merged;
 }
 
 int image_classification_forest::recognize(image_class_example * pv, float * confidence, int tree_number)
@@ -518,6 +848,40 @@ void image_classification_forest::change_class_number_and_reset_probabilities(in
   }
 }
 
+int image_classification_forest::compact(float max_divergence)
+{
+  int merge_number = 0;
+
+  for(vector<image_classification_tree *>::iterator tree_it = trees.begin(); tree_it < trees.end(); tree_it++)
+    merge_number += (*tree_it)->compact(max_divergence);
+
+  return merge_number;
+}
+
+int image_classification_forest::node_number(void)
+{
+  int n = 0;
+  for(vector<image_classification_tree *>::iterator tree_it = trees.begin(); tree_it < trees.end(); tree_it++)
+    n += (*tree_it)->node_number();
+  return n;
+}
+
+int image_classification_forest::leaves_number(void)
+{
+  int n = 0;
+  for(vector<image_classification_tree *>::iterator tree_it = trees.begin(); tree_it < trees.end(); tree_it++)
+    n += (*tree_it)->leaves_number();
+  return n;
+}
+
+int image_classification_forest::memory_footprint(void)
+{
+  int n = 0;
+  for(vector<image_classification_tree *>::iterator tree_it = trees.begin(); tree_it < trees.end(); tree_it++)
+    n += (*tree_it)->memory_footprint();
+  return n;
+}
+
 bool image_classification_forest::save(string directory_name)
 {
     int tree_index = 0;
@@ -28,6 +28,8 @@
 #include "image_classifier.h"
 #include "image_classification_tree.h"
 
+class forest_test_data;
+
 /*!
   \ingroup viewsets
   \brief Set of classifier trees.
@@ -50,6 +52,35 @@ public:
   void restore_occurances();
   void reset_class_occurances(int class_index);
   virtual void test(example_generator * vg, int call_number);
+  //! Number of threads used by test(); 0 (the default) uses one per online cpu.
+  void set_thread_number(int n) { thread_number = n; }
+  /*! Adaptive refinement: refine() stops before call_number calls once the
+    reweighted distributions of a sample of the leaves changed by less than
+    \a tolerance (mean total variation distance) over \a check_interval calls,
+    twice in a row. 0 (the default) always makes call_number calls. A
+    check_interval of 0 checks every call_number / 50 calls, at least 10.
+  */
+  void set_refinement_tolerance(float tolerance, int check_interval = 0)
+  { refinement_tolerance = tolerance; refinement_check_interval = check_interval; }
+  //! Number of calls to generate_random_examples() made by the last refine().
+  int refinement_call_number;
+
+  /*! Refinement checkpoints: refine() writes one to \a file_name every
+    \a interval calls. An empty name (the default) disables them.
+  */
+  void set_refinement_checkpoint(string file_name, int interval)
+  { refinement_checkpoint = file_name; refinement_checkpoint_interval = interval; }
+  /*! Writes the trees with their leaf counts, the class counts, \a calls_done
+    and the state of the calling thread's random generator to \a file_name.
+    The file is replaced atomically.
+  */
+  bool save_refinement_checkpoint(string file_name, int calls_done);
+  /*! Replaces the trees by the ones of a refinement checkpoint and restores
+    the calling thread's random generator. The next refine() continues after
+    the calls the checkpoint had done.
+    \return the number of calls done, -1 if there is no valid checkpoint.
+  */
+  int load_refinement_checkpoint(string file_name);
   int recognize(image_class_example * pv, float * confidence = 0, int tree_number = -1);
 
   virtual float * posterior_probabilities(image_class_example * pv, int tree_number = -1);
@@ -57,6 +88,13 @@ public:
 
   void change_class_number_and_reset_probabilities(int new_class_number);
 
+  //! Offline compaction: merges near identical sibling leaves in every tree.
+  //! \return the number of merged leaf pairs.
+  int compact(float max_divergence);
+  int node_number(void);
+  int leaves_number(void);
+  int memory_footprint(void);
+
   float * thresholds;
   float * misclassification_rates;
 
@@ -74,6 +112,24 @@ public:
   void dump();
 
   string directory_name;
+
+private:
+  int thread_number;
+  float refinement_tolerance;
+  int refinement_check_interval;
+  string refinement_checkpoint;
+  int refinement_checkpoint_interval;
+  //! Calls already done by a checkpoint, skipped by the next refine().
+  int resumed_call_number;
+
+  //! Adaptive refinement: about \a per_tree leaves of every tree.
+  void sample_leaves(vector<float *> & leaves, int per_tree);
+  //! Adaptive refinement: change of the reweighted distributions of \a leaves
+  //! since \a previous, or -1 the first time. Stores them in \a previous.
+  float leaf_distribution_change(const vector<float *> & leaves, vector<float> & previous);
+
+  void test_examples(forest_test_data * data);
+  static void * test_thread_func(void * data);
 };
 
 #endif // IMAGE_CLASSIFICATION_FOREST_H
@@ -293,6 +293,72 @@ void image_classification_node::load_probability_sums_recursive(std::ifstream& w
       children[i]->load_probability_sums_recursive(wfs);
 }
 
+float image_classification_node::merge_divergence(const image_classification_node * a, const image_classification_node * b)
+{
+  // Jensen-Shannon divergence weighted by the mass reaching each leaf:
+  // an almost empty leaf costs almost nothing to merge.
+  float total = a->probability_sum + b->probability_sum;
+  if (total <= 0) return 0;
+
+  float wa = a->probability_sum / total, wb = b->probability_sum / total;
+  float divergence = 0;
+  for(int i = 0; i < a->class_number; i++)
+  {
+    float m = wa * a->P[i] + wb * b->P[i];
+    if (a->P[i] > 0) divergence += wa * a->P[i] * log(a->P[i] / m);
+    if (b->P[i] > 0) divergence += wb * b->P[i] * log(b->P[i] / m);
+  }
+  return divergence;
+}
+
+int image_classification_node::compact_recursive(float max_divergence)
+{
+  if (is_leaf())
+    return 0;
+
+  int merge_number = 0;
+  for(int i = 0; i < children_number; i++)
+    merge_number += children[i]->compact_recursive(max_divergence);
+
+  for(int i = 0; i < children_number; i++)
+    if (!children[i]->is_leaf())
+      return merge_number;
+
+  assert(children_number == 2);
+  image_classification_node * a = children[0], * b = children[1];
+  if (merge_divergence(a, b) > max_divergence)
+    return merge_number;
+
+  class_number = a->class_number;
+  probability_sum = a->probability_sum + b->probability_sum;
+  float wa = (probability_sum > 0) ? a->probability_sum / probability_sum : .5f;
+  float wb = 1.f - wa;
+
+  P = new float[class_number];
+  best_class = 0;
+  for(int i = 0; i < class_number; i++)
+  {
+    P[i] = wa * a->P[i] + wb * b->P[i];
+    if (P[i] > P[best_class])
+      best_class = i;
+  }
+
+  delete a;
+  delete b;
+  leaf = true;
+
+  return merge_number + 1;
+}
+
+void image_classification_node::renumber_recursive(int & next_index)
+{
+  index = next_index++;
+
+  if (!is_leaf())
+    for(int i = 0; i < children_number; i++)
+      children[i]->renumber_recursive(next_index);
+}
+
 int image_classification_node::leaves_number(void)
 {
   if (is_leaf())
@@ -387,9 +453,6 @@ ostream& operator<< (ostream& o, const image_classification_node& node)
   return o;
 }
 
-//! TODO cleanme
-int global_patch_size;
-
 istream& operator>> (istream& is, image_classification_node& node)
 {
   char dummyString[1000];
@@ -433,7 +496,11 @@ istream& operator>> (istream& is, image_classification_node& node)
     is >> dummyString; // Always 2dots_tau0 : Kept for compatibily with older versions of garfield lib
 
     is >> _scale >> _du1 >> _dv1 >> _du2 >> _dv2;
-    node.set_Dot(_du1, _dv1, _du2, _dv2, global_patch_size, global_patch_size);
+    // d1 and d2 depend on the patch size: they are resolved by the tree once the whole
+    // file has been read (see image_classification_tree::load).
+    node.du1 = _du1; node.dv1 = _dv1;
+    node.du2 = _du2; node.dv2 = _dv2;
+    node.leaf = false;
 
     node.children_index = new int[node.children_number];
 
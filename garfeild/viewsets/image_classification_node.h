@@ -75,6 +75,14 @@ public:
   void save_probability_sums_recursive(std::ofstream& wfs);
   void load_probability_sums_recursive(std::ifstream& wfs);
 
+  //! Merges sibling leaves whose posteriors differ by less than \a max_divergence
+  //! (see merge_divergence()) and turns their parent into a leaf. Returns the number of merges.
+  int compact_recursive(float max_divergence);
+  //! Information lost (in nats) by replacing two leaves by their merged leaf.
+  static float merge_divergence(const image_classification_node * a, const image_classification_node * b);
+  //! Depth first renumbering, in the order used by operator<<.
+  void renumber_recursive(int & next_index);
+
   float projection(image_class_example * pv) const;
 
   void change_class_number_and_reset_probabilities(int new_class_number);
@@ -117,8 +125,6 @@ inline bool image_classification_node::is_leaf(void) const
   return leaf;
 }
 
-extern int global_patch_size;
-
 ostream& operator<< (ostream& o, const image_classification_node& node);
 istream& operator>> (istream& i, image_classification_node& node);
 
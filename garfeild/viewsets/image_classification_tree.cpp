@@ -57,6 +57,7 @@ image_classification_tree::image_classification_tree(LEARNPROGRESSION _LearnProg
                                                      : image_classifier(_LearnProgress)
 {
   root = 0;
+  kernels = 0;
 }
 
 
@@ -68,18 +69,23 @@ image_classification_tree::image_classification_tree(int _image_width, int _imag
   max_depth = _max_depth;
 
   root = 0;
+  kernels = select_patch_kernels(image_width);
 }
 
 bool image_classification_tree::load(string filename)
+{
+  ifstream ifs(filename.data());
+  return load(ifs);
+}
+
+bool image_classification_tree::load(istream & ifs)
 {
   string dummyString;
 
   try {
-    ifstream ifs(filename.data());
-
     ifs >> dummyString >> image_width >> image_height;
-    global_patch_size = image_width;
-    cout << "[Patch size: " << global_patch_size << "]" << flush;
+    kernels = select_patch_kernels(image_width);
+    cout << "[Patch size: " << image_width << "]" << flush;
 
     ifs >> dummyString >> class_number;
     ifs >> dummyString >> max_depth;
@@ -115,6 +121,8 @@ bool image_classification_tree::load(string filename)
       {
         assert(node->children_number <= 3);
 
+        node->set_Dot(node->du1, node->dv1, node->du2, node->dv2, image_width, image_height);
+
         for(int i = 0; i < node->children_number; i++)
         {
           node->children[i] = nodes[node->children_index[i]];
@@ -148,7 +156,16 @@ bool image_classification_tree::save(string filename)
   cout << "Saving tree (" << filename << ")..." << flush;
 
   ofstream ofs(filename.data());
+  save(ofs);
+  ofs.close();
+
+  cout << "...ok." << endl;
 
+  return true;
+}
+
+bool image_classification_tree::save(ostream & ofs)
+{
   ofs << "image_size: " << image_width << " " << image_height << endl;
   ofs << "class_number: " << class_number << endl;
   ofs << "max_depth:  " << max_depth << endl;
@@ -157,11 +174,7 @@ bool image_classification_tree::save(string filename)
 
   ofs << *root;
 
-  ofs.close();
-
-  cout << "...ok." << endl;
-
-  return true;
+  return !ofs.fail();
 }
 
 void image_classification_tree::refine(example_generator * vg, int call_number)
@@ -256,8 +269,15 @@ int image_classification_tree::recognize(image_class_example * image, float * co
 
 float * image_classification_tree::posterior_probabilities(image_class_example * pv, int /*dummy*/)
 {
+  return descend((unsigned char *)(pv->preprocessed->imageData));
+}
+
+float * image_classification_tree::descend(const unsigned char * I)
+{
+  if (kernels != 0)
+    return kernels->descend(root, I);
+
   image_classification_node * node = root;
-  unsigned char * I = (unsigned char *)(pv->preprocessed->imageData);
 
   while(!node->is_leaf())
   {
@@ -281,6 +301,23 @@ int image_classification_tree::leaves_number(void)
   return root->leaves_number();
 }
 
+int image_classification_tree::compact(float max_divergence)
+{
+  int merge_number = root->compact_recursive(max_divergence);
+
+  int next_index = 0;
+  root->renumber_recursive(next_index);
+
+  return merge_number;
+}
+
+int image_classification_tree::memory_footprint(void)
+{
+  int leaves = leaves_number();
+
+  return (node_number() + leaves) * sizeof(image_classification_node) + leaves * class_number * sizeof(float);
+}
+
 int image_classification_tree::actual_max_depth(void)
 {
   return 0;
@@ -31,6 +31,7 @@ using namespace std;
 
 #include "image_classifier.h"
 #include "image_classification_node.h"
+#include "patch_kernels.h"
 
 /*!
   \ingroup viewsets
@@ -49,16 +50,26 @@ public:
 
   bool load(string filename);
   bool save(string filename);
+  //! Same, for a tree in the middle of a stream.
+  bool load(istream & is);
+  bool save(ostream & os);
 
   virtual void refine(example_generator * vg, int call_number);
   virtual void test(example_generator * vg, int call_number);
   int recognize(image_class_example * pv, float * confidence = 0, int dummy = 0);
   virtual float * posterior_probabilities(image_class_example * pv, int dummy = 0);
+  //! Posterior probabilities of the leaf reached by the packed patch \a I.
+  float * descend(const unsigned char * I);
 
   void change_class_number_and_reset_probabilities(int new_class_number);
 
   int node_number(void);
   int leaves_number(void);
+
+  //! Merges near identical sibling leaves and renumbers the nodes (see image_classification_node::compact_recursive).
+  int compact(float max_divergence);
+  //! Bytes used by the nodes and leaf posteriors.
+  int memory_footprint(void);
   int actual_max_depth(void);
 
   double entropy(void);
@@ -66,6 +77,9 @@ public:
   image_classification_node * root;
   int max_depth;
 
+  //! Patch-size specialized kernels, 0 if image_width has none.
+  const patch_kernel_set * kernels;
+
   void dump() { if ( root ) root->dump(); }
 
  private:
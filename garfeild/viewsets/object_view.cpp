@@ -23,11 +23,14 @@
  */
 
 #include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 using namespace std;
 
 #include <starter.h>
 #include "object_view.h"
-#include "../../artvertiser/FProfiler/FSemaphore.h"
+#include "../../artvertiser/FProfiler/FWorkerPool.h"
 #include "../../artvertiser/FProfiler/FProfiler.h"
 
 // Constructor for training stage:
@@ -71,102 +74,25 @@ void object_view::build(IplImage *im, int kernelSize)
 }
 
 
-#include <pthread.h>
-
-class object_view::CompGradientThreadData
+void object_view::comp_gradient_task( void* _view, int task )
 {
-public:
-    CompGradientThreadData() : semaphore(0), should_stop(false) {};
-    ~CompGradientThreadData() { should_stop = true; semaphore.Signal(); void* ret; pthread_join( thread, &ret ); }
-
-    pthread_t thread;
-    FBarrier* shared_barrier;
-    FSemaphore semaphore;
-    bool should_stop;
-
-    PyrImage* image;
-    PyrImage* gradX;
-    PyrImage* gradY;
-    bool doX;
-
-};
-
-
+    object_view* view = (object_view*)_view;
 
-
-void* object_view::comp_gradient_thread_func( void* _data )
-{
-    CompGradientThreadData* data = (CompGradientThreadData*)_data;
-
-    while ( true )
+    for ( int l=0; l<view->image.nbLev; ++l )
     {
-        data->semaphore.Wait();
-        if ( data->should_stop )
-            break;
-
-        for ( int l=0; l<data->image->nbLev; ++l )
-        {
-            if ( data->doX )
-                cvSobel( data->image->operator[](l), data->gradX->operator[](l), 1, 0, 1 );
-            else
-                cvSobel( data->image->operator[](l), data->gradY->operator[](l), 0, 1, 1 );
-        }
-
-        data->shared_barrier->Wait();
+        if ( task == 0 )
+            cvSobel( view->image[l], view->gradX[l], 1, 0, 1 );
+        else
+            cvSobel( view->image[l], view->gradY[l], 0, 1, 1 );
     }
-
-    pthread_exit(0);
-
-    return NULL;
-
 }
 
 
 void object_view::comp_gradient_mt()
 {
     PROFILE_THIS_FUNCTION();
-    int num_threads = 2;
-    if ( comp_gradient_thread_data.size() != num_threads )
-    {
-        assert( comp_gradient_thread_data.size()==0 );
-
-        // construct shared barrier
-        shared_barrier = new FBarrier( num_threads+1 );
-
-        // construct threads
-        printf("creating %i threads for object_view::comp_gradient\n", num_threads );
-        pthread_attr_t thread_attr;
-        pthread_attr_init(&thread_attr);
-        pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_JOINABLE);
-        for ( int i=0; i<num_threads; i++ )
-        {
-            CompGradientThreadData* thread_data = new CompGradientThreadData();
-            thread_data->shared_barrier = shared_barrier;
-            thread_data->image = &image;
-            thread_data->gradX = &gradX;
-            thread_data->gradY = &gradY;
-            thread_data->doX = (i%2==0);
-            // store
-            comp_gradient_thread_data.push_back( thread_data );
-            // launch thread
-            pthread_create( &thread_data->thread, &thread_attr, &comp_gradient_thread_func, (void*)thread_data );
-        }
-    }
-
-
-    // go
-    for ( int i=0; i<comp_gradient_thread_data.size(); i++ )
-    {
-        CompGradientThreadData* thread_data = comp_gradient_thread_data[i];
-        assert( thread_data->image == &image );
-        assert( thread_data->gradX == &gradX );
-        assert( thread_data->gradY == &gradY );
-        thread_data->semaphore.Signal();
-    }
-
-    // wait for all to complete
-    shared_barrier->Wait();
-
+    // one task for gradX, one for gradY
+    FWorkerPool::Shared()->Run( comp_gradient_task, this, 2 );
 }
 
 void object_view::comp_gradient()
@@ -179,15 +105,101 @@ void object_view::comp_gradient()
   }
 }
 
-object_view::~object_view()
+void object_view::invalidate_gradient()
 {
-    if ( comp_gradient_thread_data.size() > 0 )
-    {
-        for ( int i=0; i<comp_gradient_thread_data.size(); i++ )
-            delete comp_gradient_thread_data[i];
-        comp_gradient_thread_data.clear();
+  if (int(gradient_tile_computed.size()) != image.nbLev)
+  {
+    gradient_tile_computed.resize(image.nbLev);
+    gradient_tile_columns.resize(image.nbLev);
+    for (int l = 0; l < image.nbLev; ++l) {
+      int columns = (image[l]->width + GRADIENT_TILE_SIZE - 1) / GRADIENT_TILE_SIZE;
+      int rows = (image[l]->height + GRADIENT_TILE_SIZE - 1) / GRADIENT_TILE_SIZE;
+      gradient_tile_columns[l] = columns;
+      gradient_tile_computed[l].resize(columns * rows);
+    }
+  }
+
+  for (int l = 0; l < image.nbLev; ++l)
+    fill(gradient_tile_computed[l].begin(), gradient_tile_computed[l].end(), 0);
+}
 
-        delete shared_barrier;
+void object_view::comp_gradient_around(int level, int u, int v, int radius)
+{
+  if (int(gradient_tile_computed.size()) != image.nbLev)
+    invalidate_gradient();
+
+  IplImage * im = image[level];
+  int x0 = MAX(0, u - radius) / GRADIENT_TILE_SIZE;
+  int x1 = MIN(im->width - 1, u + radius) / GRADIENT_TILE_SIZE;
+  int y0 = MAX(0, v - radius) / GRADIENT_TILE_SIZE;
+  int y1 = MIN(im->height - 1, v + radius) / GRADIENT_TILE_SIZE;
+
+  vector<unsigned char> & computed = gradient_tile_computed[level];
+  int columns = gradient_tile_columns[level];
+  for (int ty = y0; ty <= y1; ++ty)
+    for (int tx = x0; tx <= x1; ++tx)
+      if (!computed[ty * columns + tx])
+      {
+        comp_gradient_tile(level, tx, ty);
+        computed[ty * columns + tx] = 1;
+      }
+}
+
+float object_view::computed_gradient_fraction()
+{
+  int computed = 0, total = 0;
+  for (int l = 0; l < int(gradient_tile_computed.size()); ++l) {
+    total += gradient_tile_computed[l].size();
+    for (int i = 0; i < int(gradient_tile_computed[l].size()); ++i)
+      if (gradient_tile_computed[l][i]) computed++;
+  }
+  return total > 0 ? float(computed) / total : 0;
+}
+
+// Same result as cvSobel(.., 1, 0, 1) and cvSobel(.., 0, 1, 1), that is
+// [-1 0 1] derivatives with replicated borders, restricted to one tile.
+void object_view::comp_gradient_tile(int level, int tile_x, int tile_y)
+{
+  IplImage * im = image[level];
+  IplImage * gx = gradX[level];
+  IplImage * gy = gradY[level];
+  const int w = im->width, h = im->height;
+
+  int x0 = tile_x * GRADIENT_TILE_SIZE, x1 = MIN(x0 + GRADIENT_TILE_SIZE, w);
+  int y0 = tile_y * GRADIENT_TILE_SIZE, y1 = MIN(y0 + GRADIENT_TILE_SIZE, h);
+
+  for (int y = y0; y < y1; ++y) {
+    const unsigned char * row  = (const unsigned char *)(im->imageData + y * im->widthStep);
+    const unsigned char * up   = (const unsigned char *)(im->imageData + MAX(y - 1, 0) * im->widthStep);
+    const unsigned char * down = (const unsigned char *)(im->imageData + MIN(y + 1, h - 1) * im->widthStep);
+    short * gx_row = (short *)(gx->imageData + y * gx->widthStep);
+    short * gy_row = (short *)(gy->imageData + y * gy->widthStep);
+
+    int x = x0;
+    if (x == 0) {
+      gx_row[0] = short(row[MIN(1, w - 1)] - row[0]);
+      gy_row[0] = short(down[0] - up[0]);
+      x++;
+    }
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 8 <= x1 && x + 8 < w; x += 8) {
+      __m128i left  = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + x - 1)), zero);
+      __m128i right = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + x + 1)), zero);
+      __m128i top   = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(up + x)), zero);
+      __m128i bot   = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(down + x)), zero);
+      _mm_storeu_si128((__m128i *)(gx_row + x), _mm_sub_epi16(right, left));
+      _mm_storeu_si128((__m128i *)(gy_row + x), _mm_sub_epi16(bot, top));
+    }
+#endif
+    for (; x < x1; ++x) {
+      gx_row[x] = short(row[MIN(x + 1, w - 1)] - row[x - 1]);
+      gy_row[x] = short(down[x] - up[x]);
     }
+  }
+}
+
+object_view::~object_view()
+{
 }
 
@@ -37,8 +37,6 @@
   \ingroup viewsets
 */
 
-class FBarrier;
-
 class object_view
 {
 public:
@@ -55,7 +53,19 @@ public:
   void build(IplImage *im, int kernelSize = -1);
   void comp_gradient();
   void comp_gradient_mt();
-  static void* comp_gradient_thread_func(void* _data);
+  //! comp_gradient_mt() task: gradX for task 0, gradY for task 1.
+  static void comp_gradient_task(void* view, int task);
+
+  //! Lazy gradients: forget which gradient tiles are up to date. Call it once the image pyramid changed.
+  void invalidate_gradient();
+  //! Lazy gradients: makes sure gradX and gradY are computed in the
+  //! [u - radius, u + radius] x [v - radius, v + radius] window of pyramid level \a level.
+  void comp_gradient_around(int level, int u, int v, int radius);
+  //! Fraction of the gradient tiles computed since the last invalidate_gradient().
+  float computed_gradient_fraction();
+
+  //! Lazy gradients are computed by square tiles of GRADIENT_TILE_SIZE pixels.
+  static const int GRADIENT_TILE_SIZE = 32;
 
   PyrImage image;
   PyrImage gradX;
@@ -65,10 +75,12 @@ public:
   int u0, v0;
   float alpha, scale;
 
-  class CompGradientThreadData;
-  vector<CompGradientThreadData*> comp_gradient_thread_data;
-  FBarrier* shared_barrier;
+private:
+  void comp_gradient_tile(int level, int tile_x, int tile_y);
 
+  //! For every level, one byte per tile, non zero when the tile gradients are up to date.
+  vector< vector<unsigned char> > gradient_tile_computed;
+  vector<int> gradient_tile_columns;
 };
 
 #endif // OBJECT_VIEW_H
@@ -0,0 +1,232 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+using namespace std;
+
+#include <starter.h>
+#include "parallel_example_generator.h"
+#include "../../artvertiser/FProfiler/FBoundedQueue.h"
+
+parallel_example_generator::parallel_example_generator(affine_image_generator * prototype, production _what,
+                                                       int _batch_number, int thread_number,
+                                                       int first_batch_index)
+{
+  what = _what;
+  batch_number = _batch_number;
+  limited = batch_number >= 0;
+  next_batch_index = 0;
+  rng_stream_base = gf_thread_rng().next64() + first_batch_index;
+  popped_batches = 0;
+  should_stop = false;
+
+  if (thread_number <= 0)
+    thread_number = int(sysconf(_SC_NPROCESSORS_ONLN));
+  if (thread_number < 1)
+    thread_number = 1;
+  if (limited && thread_number > batch_number)
+    thread_number = MAX(batch_number, 1);
+
+  // A couple of batches per worker is enough to hide the consumer's jitter:
+  queue = new FBoundedQueue<batch *>(2 * thread_number);
+
+  pthread_attr_t thread_attr;
+  pthread_attr_init(&thread_attr);
+  pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_JOINABLE);
+  for (int i = 0; i < thread_number; i++)
+  {
+    affine_image_generator * generator = prototype->clone();
+    if (generator == 0)
+      break;
+
+    worker * w = new worker();
+    w->owner = this;
+    w->generator = generator;
+    w->done = false;
+    pthread_create(&w->thread, &thread_attr, worker_thread_func, (void *)w);
+    workers.push_back(w);
+  }
+  pthread_attr_destroy(&thread_attr);
+}
+
+parallel_example_generator::~parallel_example_generator()
+{
+  release_examples();
+
+  // Workers blocked on a full queue only notice should_stop once there is room:
+  should_stop = true;
+  bool all_done = false;
+  while (!all_done)
+  {
+    batch * b;
+    while (queue->TryPop(b))
+      delete_batch(b);
+
+    all_done = true;
+    for (int i = 0; i < int(workers.size()); i++)
+      all_done &= workers[i]->done;
+    if (!all_done)
+      sched_yield();
+  }
+
+  for (int i = 0; i < int(workers.size()); i++)
+  {
+    void * res;
+    pthread_join(workers[i]->thread, &res);
+    delete workers[i]->generator;
+    delete workers[i];
+  }
+  workers.clear();
+
+  batch * b;
+  while (queue->TryPop(b))
+    delete_batch(b);
+  delete queue;
+
+  for (map<int, batch *>::iterator it = early_batches.begin(); it != early_batches.end(); it++)
+    delete_batch(it->second);
+  early_batches.clear();
+}
+
+void * parallel_example_generator::worker_thread_func(void * data)
+{
+  worker * w = (worker *)data;
+  w->owner->produce(w);
+  w->done = true;
+  pthread_exit(0);
+  return 0;
+}
+
+void parallel_example_generator::produce(worker * w)
+{
+  affine_image_generator * generator = w->generator;
+
+  while (!should_stop)
+  {
+    int index = __sync_fetch_and_add(&next_batch_index, 1);
+    if (limited && index >= batch_number)
+      break;
+
+    // One random stream per batch: a batch does not depend on which worker
+    // made it, nor on what that worker made before.
+    gf_seed_thread_rng(rng_stream_base + index);
+
+    batch * b = new batch;
+    b->index = index;
+    b->examples = 0;
+    b->view = 0;
+    if (what == EXAMPLES)
+    {
+      b->examples = generator->generate_random_examples();
+      // From now on, the consumer owns the examples:
+      generator->forget_examples();
+    }
+    else
+    {
+      generator->generate_random_affine_transformation();
+      generator->generate_object_view();
+      b->view = generator->smoothed_generated_object_view->image.clone();
+      memcpy(b->a, generator->a, sizeof(b->a));
+    }
+
+    queue->Push(b);
+  }
+}
+
+parallel_example_generator::batch * parallel_example_generator::pop_batch(void)
+{
+  if (limited && popped_batches >= batch_number)
+  {
+    cerr << "parallel_example_generator: all the " << batch_number << " batches were already consumed." << endl;
+    return 0;
+  }
+  int index = popped_batches++;
+
+  // Hand the batches out in order, whatever the thread scheduling, so that
+  // training is reproducible:
+  map<int, batch *>::iterator it = early_batches.find(index);
+  if (it != early_batches.end())
+  {
+    batch * b = it->second;
+    early_batches.erase(it);
+    return b;
+  }
+
+  while (true)
+  {
+    batch * b = queue->Pop();
+    if (b->index == index)
+      return b;
+    early_batches[b->index] = b;
+  }
+}
+
+void parallel_example_generator::delete_batch(batch * b)
+{
+  if (b->examples)
+  {
+    for (int i = 0; i < int(b->examples->size()); i++)
+      delete (*b->examples)[i];
+    delete b->examples;
+  }
+  if (b->view)
+    delete b->view;
+  delete b;
+}
+
+vector<image_class_example *> * parallel_example_generator::generate_random_examples(void)
+{
+  assert(what == EXAMPLES);
+
+  batch * b = pop_batch();
+  if (b == 0)
+    return new vector<image_class_example *>;
+
+  vector<image_class_example *> * result = b->examples;
+  handed_out.insert(handed_out.end(), result->begin(), result->end());
+  delete b;
+
+  return result;
+}
+
+void parallel_example_generator::release_examples(void)
+{
+  for (int i = 0; i < int(handed_out.size()); i++)
+    delete handed_out[i];
+  handed_out.clear();
+}
+
+PyrImage * parallel_example_generator::next_view(float a[6])
+{
+  assert(what == VIEWS);
+
+  batch * b = pop_batch();
+  if (b == 0)
+    return 0;
+
+  PyrImage * view = b->view;
+  memcpy(a, b->a, sizeof(b->a));
+  delete b;
+
+  return view;
+}
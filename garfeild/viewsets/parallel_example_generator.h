@@ -0,0 +1,113 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARALLEL_EXAMPLE_GENERATOR_H
+#define PARALLEL_EXAMPLE_GENERATOR_H
+
+#include <pthread.h>
+#include <vector>
+#include <map>
+using namespace std;
+
+#include "example_generator.h"
+#include "affine_image_generator.h"
+
+template <class T> class FBoundedQueue;
+
+/*!
+  \ingroup viewsets
+  \brief Runs clones of an affine_image_generator on worker threads.
+
+  Every worker owns a clone of the prototype, with its own images, object_view
+  and keypoint_orientation_corrector. It pushes what it generates into a
+  bounded queue. generate_random_examples() and next_view() pop from that
+  queue, so the consumer (tree refinement, forest test, model point
+  detection) only waits when the workers are behind.
+*/
+class parallel_example_generator : public example_generator
+{
+public:
+  enum production { EXAMPLES, VIEWS };
+
+  /*! Starts \a thread_number workers (0: one per online cpu) producing
+    \a batch_number batches in total (-1: until destruction). The prototype
+    is cloned here: change its settings before. \a first_batch_index skips
+    batches: the first one produced is the one that batch would have been,
+    to resume an interrupted run.
+  */
+  parallel_example_generator(affine_image_generator * prototype, production what,
+                             int batch_number = -1, int thread_number = 0,
+                             int first_batch_index = 0);
+  ~parallel_example_generator();
+
+  //! False if the prototype could not be cloned: use it directly then.
+  bool is_ok(void) { return !workers.empty(); }
+  int get_thread_number(void) { return workers.size(); }
+
+  //! EXAMPLES production: examples generated by one of the workers.
+  vector<image_class_example *> * generate_random_examples(void);
+  void release_examples(void);
+
+  //! VIEWS production: the next randomly warped and smoothed view of the
+  //! object, and the affine transformation \a a that produced it. The caller
+  //! deletes the view.
+  PyrImage * next_view(float a[6]);
+
+private:
+  struct batch
+  {
+    vector<image_class_example *> * examples;
+    PyrImage * view;
+    float a[6];
+    int index;
+  };
+
+  class worker
+  {
+  public:
+    pthread_t thread;
+    parallel_example_generator * owner;
+    affine_image_generator * generator;
+    volatile bool done;
+  };
+
+  static void * worker_thread_func(void * data);
+  void produce(worker * w);
+  batch * pop_batch(void);
+  void delete_batch(batch * b);
+
+  production what;
+  bool limited;
+  //! Index of the next batch a worker will make.
+  volatile int next_batch_index;
+  int popped_batches, batch_number;
+  //! Batch i is generated from stream rng_stream_base + i of the global seed.
+  unsigned long long rng_stream_base;
+  //! Batches popped from the queue before the ones that precede them.
+  map<int, batch *> early_batches;
+  volatile bool should_stop;
+
+  FBoundedQueue<batch *> * queue;
+  vector<worker *> workers;
+  //! Examples returned by generate_random_examples() since the last release_examples().
+  vector<image_class_example *> handed_out;
+};
+
+#endif // PARALLEL_EXAMPLE_GENERATOR_H
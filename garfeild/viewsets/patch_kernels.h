@@ -0,0 +1,120 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATCH_KERNELS_H
+#define PATCH_KERNELS_H
+
+#include <string.h>
+#include <assert.h>
+#include <cv.h>
+
+#include "image_classification_node.h"
+
+//!\ingroup viewsets
+//@{
+
+/*!
+  \brief Patch extraction, orientation correction and tree descent kernels,
+  specialized at compile time for a given patch size.
+
+  All kernels work on packed patches: row y of a PATCH_SIZE x PATCH_SIZE patch
+  starts at byte y * PATCH_SIZE. Node offsets d1/d2 are resolved against that
+  same layout by image_classification_node::set_Dot, so descending a tree
+  never needs to know the widthStep of the IplImage holding the patch.
+*/
+template <int PATCH_SIZE>
+struct patch_kernels
+{
+  static const int PIXEL_NUMBER = PATCH_SIZE * PATCH_SIZE;
+
+  //! Copies the neighborhood of (u,v) into \a dst. Like mcvGetPatch(), leaves
+  //! \a dst untouched if the neighborhood is not entirely inside \a image.
+  static void extract(const IplImage * image, int u, int v, unsigned char * dst)
+  {
+    const int x = u - PATCH_SIZE / 2, y = v - PATCH_SIZE / 2;
+
+    if (x < 0 || y < 0) return;
+    if (x + PATCH_SIZE >= image->width || y + PATCH_SIZE >= image->height) return;
+
+    const unsigned char * src = (const unsigned char *)image->imageData + y * image->widthStep + x;
+    for(int j = 0; j < PATCH_SIZE; j++, src += image->widthStep, dst += PATCH_SIZE)
+      memcpy(dst, src, PATCH_SIZE);
+  }
+
+  //! Rotated neighborhood of (u,v), using a lookup table from
+  //! keypoint_orientation_corrector::rotation_table().
+  static void rotate(const IplImage * image, int u, int v, const int * table, unsigned char * dst)
+  {
+    const unsigned char * src = (const unsigned char *)image->imageData;
+    const int offset = v * image->widthStep + u;
+    const unsigned max = (unsigned)image->widthStep * (image->height + 1);
+
+    for(int i = 0; i < PIXEL_NUMBER; i++)
+    {
+      unsigned idx = offset + table[i];
+      if (idx < max)
+        dst[i] = src[idx];
+    }
+  }
+
+  //! Returns the posterior probabilities of the leaf \a I falls into.
+  static float * descend(const image_classification_node * node, const unsigned char * I)
+  {
+    while(!node->is_leaf())
+    {
+      assert(node->d1 >= 0 && node->d1 < PIXEL_NUMBER && node->d2 >= 0 && node->d2 < PIXEL_NUMBER);
+      node = node->children[I[node->d1] > I[node->d2]];
+    }
+    return node->P;
+  }
+};
+
+/*!
+  \brief Kernels for one patch size, selected at runtime by select_patch_kernels().
+*/
+struct patch_kernel_set
+{
+  int patch_size;
+  void (*extract)(const IplImage * image, int u, int v, unsigned char * dst);
+  void (*rotate)(const IplImage * image, int u, int v, const int * table, unsigned char * dst);
+  float * (*descend)(const image_classification_node * root, const unsigned char * I);
+};
+
+/*!
+  Returns the specialized kernels for \a patch_size, or 0 if the patch size
+  has no specialization (callers then fall back to the generic code).
+*/
+inline const patch_kernel_set * select_patch_kernels(int patch_size)
+{
+  static const patch_kernel_set kernels_16 = { 16, patch_kernels<16>::extract, patch_kernels<16>::rotate, patch_kernels<16>::descend };
+  static const patch_kernel_set kernels_24 = { 24, patch_kernels<24>::extract, patch_kernels<24>::rotate, patch_kernels<24>::descend };
+  static const patch_kernel_set kernels_32 = { 32, patch_kernels<32>::extract, patch_kernels<32>::rotate, patch_kernels<32>::descend };
+
+  switch(patch_size)
+  {
+  case 16: return &kernels_16;
+  case 24: return &kernels_24;
+  case 32: return &kernels_32;
+  default: return 0;
+  }
+}
+
+//@}
+#endif // PATCH_KERNELS_H
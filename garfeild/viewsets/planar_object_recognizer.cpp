@@ -25,10 +25,17 @@
 
 #include <sys/stat.h> // for mkdir()
 #include <fstream>
+#include <iomanip>
 #include <algorithm>
+#include <functional>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef WIN32
 #include <direct.h> // for _mkdir()
+#else
+#include <unistd.h> // for rmdir()
 #endif
 
 using namespace std;
@@ -36,14 +43,18 @@ using namespace std;
 #include <starter.h>
 #include <keypoints/yape.h>
 #include "planar_object_recognizer.h"
+#include "parallel_example_generator.h"
+#include "cached_example_generator.h"
 
 // damian
 #include "../artvertiser/FProfiler/FProfiler.h"
+#include "../artvertiser/FProfiler/FWorkerPool.h"
 
 planar_object_recognizer::planar_object_recognizer()
-: forest(0), model_points(0), object_input_view(0),
+: forest(0), cascade(0), model_points(0), object_input_view(0),
 model_and_input_images(0), point_detector(0), homography_estimator(0), affine_motion(0), H(0),
-detected_points(0), detected_point_views(0)
+detected_points(0), detected_point_views(0), patch_arena(0), match_probability_block(0),
+detection_buffer_capacity(0), detection_buffer_patch_size(0), match_coordinate_block(0)
 {
     for(int i = 0; i < hard_max_detected_pts; i++) {
         (match_probabilities[i] = 0);
@@ -63,25 +74,13 @@ void planar_object_recognizer::clear()
     lock();
 
     ready = false;
+    tracking = false;
 
     // damian: clean up multithreaded tracker stuff
-    if ( affine_thread_data.size() > 0 )
-    {
-      // kill all the threads
-      for ( int i=0; i<affine_thread_data.size(); i++ )
-      {
-          // tell the thread to stop
-          affine_thread_data[i]->should_stop = true;
-          affine_thread_data[i]->start_signal.Signal();
-          // wait for completion
-          void* res;
-          pthread_join( affine_thread_data[i]->thread, &res );
-          // delete
-          delete( affine_thread_data[i] );
-      }
-      affine_thread_data.clear();
-      delete shared_barrier;    shared_barrier = 0;
-    }
+    for ( int i=0; i<int(affine_tasks.size()); i++ )
+      delete affine_tasks[i];
+    affine_tasks.clear();
+    preprocess_tasks.clear();
 
     if (object_input_view)  delete object_input_view;   object_input_view = 0;
     if (point_detector)     delete point_detector;      point_detector = 0;
@@ -89,14 +88,12 @@ void planar_object_recognizer::clear()
     if (model_points != 0)  delete [] model_points;     model_points = 0;
 
     if (forest != 0)        delete forest;              forest =0;
+    if (cascade != 0)       delete cascade;             cascade = 0;
+    background_points.clear();
 
-    for(int i = 0; i < hard_max_detected_pts; i++) {
-    if (match_probabilities[i])
-        delete [] match_probabilities[i];   match_probabilities[i] = 0;
-    }
+    release_detection_buffers();
 
     if (detected_points) delete[] detected_points;      detected_points = 0;
-    if (detected_point_views) delete[] detected_point_views;    detected_point_views = 0;
     if (affine_motion) delete affine_motion;            affine_motion = 0;
     if (H) delete H;                                    H = 0;
     if (homography_estimator) delete homography_estimator;  homography_estimator = 0;
@@ -105,12 +102,14 @@ void planar_object_recognizer::clear()
     default_settings();
 
     detected_points = new keypoint[hard_max_detected_pts];
-    detected_point_views = new image_class_example[hard_max_detected_pts];
 
     match_score_threshold = .05f;
     ransac_dist_threshold = 10;
     ransac_stop_support = 50;
     max_ransac_iterations = 800;
+    ransac_confidence = .99f;
+    avg_ransac_iterations = 0;
+    avg_match_evaluations = 0;
     non_linear_refine_threshold = 3;
 
     put_ui_settings();
@@ -128,6 +127,8 @@ void planar_object_recognizer::default_settings(void)
 
   dont_use_bins_when_creating_model_points();
   dont_use_bins_when_detecting_input_image_points();
+  use_prosac_sampling = true;
+  use_sprt = true;
 
   index_of_model_point_to_debug = -1;
 
@@ -135,17 +136,45 @@ void planar_object_recognizer::default_settings(void)
   //views_number = 1000;
   sample_number_for_refining = 100;
   views_number = 100;
+  training_thread_number = 0;
+  random_seed = 1;
+  example_cache_directory = "";
+  stable_point_tolerance = 0;
+  checkpoint_directory = "";
+  checkpoint_interval = 25;
+  refinement_tolerance = 0;
+  used_views_number = 0;
+  used_refinement_call_number = 0;
+  used_cascade_call_number = 0;
 
   max_detected_pts = 1000;
   min_view_rate = .4;
   keypoint_distance_threshold = 1.5;
   point_detector_tau = 10;
+
+  use_cascade = true;
+  cascade_threshold = .8f;
+  cascade_tree_number = 3;
+  cascade_max_depth = 8;
+  cascade_rejection_rate = 0;
+
+  use_tracking = true;
+  tracking_gate_radius = 15;
+  tracking_min_inliers = 20;
+
+  use_lazy_gradient = true;
+  computed_gradient_fraction = 1;
 }
 
 void planar_object_recognizer::set_max_detected_pts(int max)
 {
   if (max > 0 && max < hard_max_detected_pts)
+  {
     max_detected_pts = max;
+    // The detection buffers only hold the keypoints they were allocated for:
+    if (detection_buffer_capacity > 0 && max_detected_pts > detection_buffer_capacity)
+      allocate_detection_buffers(detection_buffer_patch_size);
+  }
 }
 
 void planar_object_recognizer::use_orientation_correction(void)
@@ -298,9 +327,15 @@ bool planar_object_recognizer::build_with_cache(string filename,
 
   initialize();
 
+  // A crash while learning resumes from the checkpoints next time:
+  string previous_checkpoint_directory = checkpoint_directory;
+  if (checkpoint_directory.empty())
+    checkpoint_directory = dirname + "/checkpoint";
+
   learn(max_point_number_on_model, patch_size, yape_radius, tree_number, nbLev, LearnProgress);
 
   save(dirname);
+  checkpoint_directory = previous_checkpoint_directory;
 
   ready = true;
   printf("**~ detector now ready B\n");
@@ -310,6 +345,8 @@ bool planar_object_recognizer::build_with_cache(string filename,
 
 bool planar_object_recognizer::load(string directory_name)
 {
+  gf_set_rng_seed(random_seed);
+
   // Read parameters:
   char parameter_filename[1000];
   sprintf(parameter_filename, "%s/parameters.txt", directory_name.data());
@@ -378,13 +415,22 @@ bool planar_object_recognizer::load(string directory_name)
     return false;
   }
 
-  // Match probabilities:
-  for(int i = 0; i < hard_max_detected_pts; i++)
+  // Patch extraction must match the patch size the forest was trained with:
+  if (new_images_generator.patch_size != forest->image_width)
+    new_images_generator.set_patch_size(forest->image_width);
+
+  // The cascade is optional: models learnt without one still load.
+  cascade = new image_classification_forest();
+  if ( !cascade->load(directory_name + "/cascade") )
   {
-    detected_point_views[i].alloc(forest->image_width);
-    match_probabilities[i] = new float[model_point_number];
+    cout << "No cascade for this model." << endl;
+    delete cascade;
+    cascade = 0;
   }
 
+  // Patches and match probabilities:
+  allocate_detection_buffers(forest->image_width);
+
   point_detector = new pyr_yape(new_images_generator.original_image->width, new_images_generator.original_image->height, nbLev);
   point_detector->set_radius(yape_radius);
 
@@ -403,7 +449,8 @@ void planar_object_recognizer::initialize(void)
   affine_motion = new affinity();
   H = new homography();
 
-  homography_estimator = new ls_minimizer2(8);
+  homography_estimator = new homography_refiner();
+  homography_estimator->reserve(hard_max_detected_pts);
 
   // For visualization:
   model_and_input_images = 0;
@@ -415,41 +462,380 @@ planar_object_recognizer::~planar_object_recognizer(void)
 
     if ( detected_points)
         delete[] detected_points;
-    if ( detected_point_views )
-        delete[] detected_point_views;
-
+    release_detection_buffers();
+    if (match_coordinate_block) cvFree(&match_coordinate_block);
 }
 
 void planar_object_recognizer::learn(int max_point_number_on_model, int patch_size,
                                      int yape_radius, int tree_number, int nbLev,
                                      LEARNPROGRESSION LearnProgress)
 {
+  gf_set_rng_seed(random_seed);
+
   if (point_detector) delete point_detector;
   point_detector = new pyr_yape(new_images_generator.original_image->width, new_images_generator.original_image->height, nbLev);
   point_detector->set_radius(yape_radius);
   point_detector->set_use_bins(use_bins_for_model_points);
 
-  printf("about to detect_most_stable_points...\n");
-  detect_most_stable_model_points(max_point_number_on_model, patch_size, views_number, min_view_rate, LearnProgress);
-  printf("done detect_most_stable_points\n");
+  string fingerprint = training_fingerprint(max_point_number_on_model, patch_size, yape_radius, tree_number, nbLev);
+  int phase = load_training_checkpoint(fingerprint, LearnProgress);
+  // Refinement checkpoints of another model must not be picked up either:
+  if (phase == NO_CHECKPOINT)
+    remove_training_checkpoint();
+
+  if (phase < MODEL_POINTS_CHECKPOINT)
+  {
+    printf("about to detect_most_stable_points...\n");
+    detect_most_stable_model_points(max_point_number_on_model, patch_size, views_number, min_view_rate, LearnProgress);
+    printf("done detect_most_stable_points\n");
+    save_training_checkpoint(MODEL_POINTS_CHECKPOINT, fingerprint);
+  }
 
   save_image_of_model_points(patch_size);
 
-  forest = new image_classification_forest(patch_size, patch_size, model_point_number, max_depth, tree_number, LearnProgress);
+  if (phase < FOREST_CHECKPOINT)
+  {
+    forest = new image_classification_forest(patch_size, patch_size, model_point_number, max_depth, tree_number, LearnProgress);
+    forest->set_thread_number(training_thread_number);
+
+    // Pick m1 and m2 at random in each node of each tree
+    forest->create_trees_at_random();
 
-  // Pick m1 and m2 at random in each node of each tree
-  forest->create_trees_at_random();
+    // Refine posterior probabilities for each leaf of each tree
+    refine_with_training_examples(forest, sample_number_for_refining, "forest.ckpt");
+    used_refinement_call_number = forest->refinement_call_number;
+    forest->test(/* example_generator */ &new_images_generator, /* call number to generate_random_examples */ 300);
+    save_training_checkpoint(FOREST_CHECKPOINT, fingerprint);
+  }
 
-  // Refine posterior probabilities for each leaf of each tree
-  forest->refine(/* example_generator */ &new_images_generator, /* call number to generate_random_examples */ sample_number_for_refining);
-  forest->test(/* example_generator */ &new_images_generator, /* call number to generate_random_examples */ 300);
+  learn_cascade(patch_size, LearnProgress);
 
-  for(int i = 0; i < hard_max_detected_pts; i++)
+  allocate_detection_buffers(patch_size);
+}
+
+void planar_object_recognizer::refine_with_training_examples(image_classification_forest * classifier, int call_number,
+                                                             const string & checkpoint_name)
+{
+  // The producer must start from the random state of an uninterrupted run;
+  // the refinement then goes on with the one of the checkpoint.
+  int calls_done = 0;
+  gf_rng rng_before_checkpoint = gf_thread_rng();
+  gf_rng rng_at_checkpoint = rng_before_checkpoint;
+  if (!checkpoint_directory.empty())
   {
-    detected_point_views[i].alloc(patch_size);
-    match_probabilities[i] = new float[model_point_number];
+    string checkpoint_file = checkpoint_directory + "/" + checkpoint_name;
+    calls_done = MAX(0, classifier->load_refinement_checkpoint(checkpoint_file));
+    rng_at_checkpoint = gf_thread_rng();
+    gf_thread_rng() = rng_before_checkpoint;
+    classifier->set_refinement_checkpoint(checkpoint_file, checkpoint_interval);
   }
 
+  cached_example_generator * cache = 0;
+  int cached_batches = 0;
+  if (!example_cache_directory.empty())
+  {
+    string key = new_images_generator.cache_key();
+    cache = new cached_example_generator(example_cache_directory + "/examples-" + key + ".bin",
+                                         key, new_images_generator.patch_size);
+    if (cache->is_ok())
+    {
+      cached_batches = cache->get_cached_batch_number();
+      cache->skip_cached_batches(calls_done);
+    }
+    else
+    {
+      delete cache;
+      cache = 0;
+    }
+  }
+  // Overall index of the first batch the producer makes: batch k comes from
+  // random stream k, whatever the cache and the checkpoint already provide.
+  int first_generated_batch = MAX(cached_batches, calls_done);
+  int batches_to_generate = MAX(0, call_number - first_generated_batch);
+
+  // No producer threads if the cache holds all the batches:
+  parallel_example_generator * producer = 0;
+  if (training_thread_number != 1 && batches_to_generate > 0)
+  {
+    producer = new parallel_example_generator(&new_images_generator, parallel_example_generator::EXAMPLES,
+                                              batches_to_generate, training_thread_number,
+                                              first_generated_batch);
+    if (!producer->is_ok())
+    {
+      delete producer;
+      producer = 0;
+    }
+  }
+  example_generator * source = producer ? (example_generator *)producer : &new_images_generator;
+  if (calls_done > 0)
+    gf_thread_rng() = rng_at_checkpoint;
+
+  classifier->set_refinement_tolerance(refinement_tolerance);
+  if (cache)
+  {
+    cache->set_source(source);
+    classifier->refine(cache, call_number);
+    delete cache;
+  }
+  else
+    classifier->refine(/* example_generator */ source, /* call number to generate_random_examples */ call_number);
+
+  if (producer) delete producer;
+  classifier->set_refinement_checkpoint("", 0);
+}
+
+//! mkdir() that ignores existing directories.
+static void make_directory(const string & directory_name)
+{
+#ifndef WIN32
+  mkdir(directory_name.data(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IWOTH);
+#else
+  _mkdir(directory_name.data());
+#endif
+}
+
+string planar_object_recognizer::training_fingerprint(int max_point_number_on_model, int patch_size,
+                                                      int yape_radius, int tree_number, int nbLev)
+{
+  char fingerprint[1000];
+  sprintf(fingerprint, "%s_%d_%d_%d_%d_%d_%d_%u_%d_%g_%g_%g_%d_%d",
+          new_images_generator.cache_key().data(), max_point_number_on_model, patch_size,
+          yape_radius, tree_number, nbLev, max_depth, random_seed,
+          views_number, min_view_rate, keypoint_distance_threshold, stable_point_tolerance,
+          cascade_tree_number, cascade_max_depth);
+  return fingerprint;
+}
+
+// The model points of a training checkpoint: the count, then one "M[0] M[1] M[2] scale"
+// line per point, the same for the background points.
+static void write_checkpoint_points(ostream & os, const object_keypoint * points, int point_number)
+{
+  os << point_number << endl;
+  for(int i = 0; i < point_number; i++)
+    os << points[i].M[0] << " " << points[i].M[1] << " " << points[i].M[2] << " " << points[i].scale << endl;
+}
+
+static bool read_checkpoint_points(istream & is, vector<object_keypoint> & points, bool background)
+{
+  int point_number = 0;
+  is >> point_number;
+  if (is.fail() || point_number < 0 || (!background && point_number == 0))
+    return false;
+  points.resize(point_number);
+  for(int i = 0; i < point_number && is.good(); i++)
+  {
+    is >> points[i].M[0] >> points[i].M[1] >> points[i].M[2] >> points[i].scale;
+    points[i].class_index = background ? -1 : i;
+  }
+  return !is.fail();
+}
+
+static bool same_checkpoint_points(const object_keypoint * a, const object_keypoint * b, int point_number)
+{
+  for(int i = 0; i < point_number; i++)
+    if (memcmp(a[i].M, b[i].M, sizeof(a[i].M)) != 0 || memcmp(&a[i].scale, &b[i].scale, sizeof(a[i].scale)) != 0)
+      return false;
+  return true;
+}
+
+void planar_object_recognizer::save_training_checkpoint(int phase, const string & fingerprint)
+{
+  if (checkpoint_directory.empty())
+    return;
+
+  // The parent is the .classifier directory, that save() creates at the end:
+  string::size_type slash = checkpoint_directory.find_last_of('/');
+  if (slash != string::npos && slash > 0)
+    make_directory(checkpoint_directory.substr(0, slash));
+  make_directory(checkpoint_directory);
+
+  if (phase == MODEL_POINTS_CHECKPOINT)
+  {
+    // All the digits: affine_image_generator::cache_key() hashes the
+    // coordinates, and a resumed run must generate the same examples.
+    string points_filename = checkpoint_directory + "/model_points.txt";
+    ofstream pf(points_filename.data());
+    pf << setprecision(17);
+    write_checkpoint_points(pf, model_points, model_point_number);
+    write_checkpoint_points(pf, background_points.empty() ? 0 : &background_points[0], int(background_points.size()));
+    pf.close();
+
+    // Read them back: without the progress file, a checkpoint that would not
+    // resume the same training is not used.
+    ifstream rf(points_filename.data());
+    vector<object_keypoint> points, background;
+    if (pf.fail() ||
+        !read_checkpoint_points(rf, points, false) || !read_checkpoint_points(rf, background, true) ||
+        int(points.size()) != model_point_number || background.size() != background_points.size() ||
+        !same_checkpoint_points(&points[0], model_points, model_point_number) ||
+        (!background.empty() && !same_checkpoint_points(&background[0], &background_points[0], int(background.size()))))
+    {
+      cerr << "The model points do not read back from " << points_filename << ": no training checkpoint." << endl;
+      return;
+    }
+  }
+  else if (phase == FOREST_CHECKPOINT)
+  {
+    string forest_directory_name = checkpoint_directory + "/forest";
+    make_directory(forest_directory_name);
+    forest->save(forest_directory_name);
+  }
+
+  // progress.txt says which phase is complete: written last, and renamed into place.
+  string progress_filename = checkpoint_directory + "/progress.txt";
+  string tmp_filename = progress_filename + ".tmp";
+  ofstream cf(tmp_filename.data());
+  gf_rng & rng = gf_thread_rng();
+  cf << "fingerprint: " << fingerprint << endl;
+  cf << "phase: " << phase << endl;
+  cf << "rng: " << rng.s[0] << " " << rng.s[1] << " " << rng.s[2] << " " << rng.s[3] << endl;
+  cf << "used_views: " << used_views_number << endl;
+  cf << "used_refinement_calls: " << used_refinement_call_number << endl;
+  cf.close();
+#ifdef WIN32
+  remove(progress_filename.data()); // rename() does not replace files there
+#endif
+  if (cf.fail() || rename(tmp_filename.data(), progress_filename.data()) != 0)
+  {
+    cerr << "Could not write the training checkpoint in " << checkpoint_directory << endl;
+    return;
+  }
+
+  // The refinement checkpoint of the forest is not needed anymore:
+  if (phase == FOREST_CHECKPOINT)
+    remove((checkpoint_directory + "/forest.ckpt").data());
+}
+
+int planar_object_recognizer::load_training_checkpoint(const string & fingerprint, LEARNPROGRESSION LearnProgress)
+{
+  if (checkpoint_directory.empty())
+    return NO_CHECKPOINT;
+
+  ifstream cf((checkpoint_directory + "/progress.txt").data());
+  if (!cf.good())
+    return NO_CHECKPOINT;
+
+  string dummyString, checkpoint_fingerprint;
+  int phase = NO_CHECKPOINT;
+  gf_rng rng;
+  int used_views = 0, used_refinement_calls = 0;
+  cf >> dummyString >> checkpoint_fingerprint;
+  cf >> dummyString >> phase;
+  cf >> dummyString >> rng.s[0] >> rng.s[1] >> rng.s[2] >> rng.s[3];
+  cf >> dummyString >> used_views;
+  cf >> dummyString >> used_refinement_calls;
+  if (cf.fail() || checkpoint_fingerprint != fingerprint)
+  {
+    cout << "Training checkpoint in " << checkpoint_directory << " is for another model: ignored." << endl;
+    return NO_CHECKPOINT;
+  }
+  if (phase < MODEL_POINTS_CHECKPOINT)
+    return NO_CHECKPOINT;
+
+  ifstream pf((checkpoint_directory + "/model_points.txt").data());
+  vector<object_keypoint> read_points, background;
+  if (!read_checkpoint_points(pf, read_points, false) || !read_checkpoint_points(pf, background, true))
+    return NO_CHECKPOINT;
+  int point_number = int(read_points.size());
+  object_keypoint * points = new object_keypoint[point_number];
+  copy(read_points.begin(), read_points.end(), points);
+
+  if (phase >= FOREST_CHECKPOINT)
+  {
+    image_classification_forest * checkpoint_forest = new image_classification_forest(LearnProgress);
+    if (checkpoint_forest->load(checkpoint_directory + "/forest"))
+    {
+      if (forest != 0) delete forest;
+      forest = checkpoint_forest;
+    }
+    else
+    {
+      delete checkpoint_forest;
+      // Back to the model points: their random state is lost, start again.
+      delete [] points;
+      return NO_CHECKPOINT;
+    }
+  }
+
+  if (model_points != 0) delete [] model_points;
+  model_points = points;
+  model_point_number = point_number;
+  background_points = background;
+  new_images_generator.set_object_keypoints(model_points, model_point_number);
+  used_views_number = used_views;
+  used_refinement_call_number = used_refinement_calls;
+  gf_thread_rng() = rng;
+
+  cout << "Resuming training from the checkpoint in " << checkpoint_directory << " ("
+       << (phase >= FOREST_CHECKPOINT ? "forest" : "model points") << " done)." << endl;
+  return phase;
+}
+
+void planar_object_recognizer::remove_training_checkpoint(void)
+{
+  if (checkpoint_directory.empty())
+    return;
+
+  const char * files[] = { "progress.txt", "progress.txt.tmp", "model_points.txt",
+                           "forest.ckpt", "forest.ckpt.tmp", "cascade.ckpt", "cascade.ckpt.tmp" };
+  for(int i = 0; i < int(sizeof(files) / sizeof(files[0])); i++)
+    remove((checkpoint_directory + "/" + files[i]).data());
+
+  string forest_directory_name = checkpoint_directory + "/forest";
+  remove((forest_directory_name + "/weights.txt").data());
+  remove((forest_directory_name + "/thresholds.txt").data());
+  remove((forest_directory_name + "/misclassification_rates.txt").data());
+  for(int i = 0; ; i++)
+  {
+    char tree_filename[1000];
+    sprintf(tree_filename, "%s/tree%04d.txt", forest_directory_name.data(), i);
+    if (remove(tree_filename) != 0)
+      break;
+  }
+
+#ifndef WIN32
+  rmdir(forest_directory_name.data());
+  rmdir(checkpoint_directory.data());
+#else
+  _rmdir(forest_directory_name.data());
+  _rmdir(checkpoint_directory.data());
+#endif
+}
+
+void planar_object_recognizer::allocate_detection_buffers(int patch_size)
+{
+  release_detection_buffers();
+
+  int capacity = max_detected_pts;
+
+  // Patch rows as laid out by image_class_example::alloc_in(), patches 16 byte aligned:
+  int patch_step = (patch_size + 3) & ~3;
+  int patch_bytes = (patch_step * patch_size + 15) & ~15;
+  patch_arena = (unsigned char *)cvAlloc(capacity * patch_bytes);
+
+  detected_point_views = new image_class_example[capacity];
+  for(int i = 0; i < capacity; i++)
+    detected_point_views[i].alloc_in(patch_arena + i * patch_bytes, patch_size);
+
+  // Rows of 4 floats multiples, so that every row is 16 byte aligned:
+  int row_length = (model_point_number + 3) & ~3;
+  match_probability_block = (float *)cvAlloc(capacity * row_length * sizeof(float));
+  for(int i = 0; i < capacity; i++)
+    match_probabilities[i] = match_probability_block + i * row_length;
+
+  detection_buffer_capacity = capacity;
+  detection_buffer_patch_size = patch_size;
+}
+
+void planar_object_recognizer::release_detection_buffers(void)
+{
+  for(int i = 0; i < hard_max_detected_pts; i++)
+    match_probabilities[i] = 0;
+
+  if (detected_point_views) delete[] detected_point_views;      detected_point_views = 0;
+  if (patch_arena) cvFree(&patch_arena);                         patch_arena = 0;
+  if (match_probability_block) cvFree(&match_probability_block); match_probability_block = 0;
+  detection_buffer_capacity = 0;
 }
 
 void planar_object_recognizer::save(string directory_name)
@@ -491,6 +877,56 @@ void planar_object_recognizer::save(string directory_name)
   pf.close();
 
   forest->save(directory_name);
+
+  if (cascade != 0)
+  {
+    string cascade_directory_name = directory_name + "/cascade";
+#ifndef WIN32
+    mkdir(cascade_directory_name.data(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IWOTH);
+#else
+    _mkdir(cascade_directory_name.data());
+#endif
+    cascade->save(cascade_directory_name);
+  }
+
+  // How much of the planned training adaptive stopping actually used:
+  char log_filename[1000];
+  sprintf(log_filename, "%s/training_log.txt", directory_name.data());
+  ofstream log_f(log_filename);
+  log_f << "views " << used_views_number << " of " << views_number << endl;
+  log_f << "refinement_calls " << used_refinement_call_number << " of " << sample_number_for_refining << endl;
+  if (cascade != 0)
+    log_f << "cascade_refinement_calls " << used_cascade_call_number << " of " << sample_number_for_refining << endl;
+  log_f << "random_seed " << random_seed << endl;
+  log_f.close();
+
+  // The model is complete: an interrupted learn() cannot be resumed anymore.
+  remove_training_checkpoint();
+}
+
+void planar_object_recognizer::learn_cascade(int patch_size, LEARNPROGRESSION LearnProgress)
+{
+  if (cascade != 0) delete cascade;
+  cascade = 0;
+
+  if (background_points.empty())
+  {
+    cout << "No background keypoints: not learning a cascade." << endl;
+    return;
+  }
+
+  cout << "Learning cascade (" << model_point_number << " object keypoints, "
+       << background_points.size() << " background keypoints)." << endl;
+
+  cascade = new image_classification_forest(patch_size, patch_size, 2, cascade_max_depth, cascade_tree_number, LearnProgress);
+  cascade->set_thread_number(training_thread_number);
+  cascade->create_trees_at_random();
+
+  new_images_generator.set_background_keypoints(&background_points[0], int(background_points.size()));
+  refine_with_training_examples(cascade, sample_number_for_refining, "cascade.ckpt");
+  used_cascade_call_number = cascade->refinement_call_number;
+  cascade->test(&new_images_generator, 50);
+  new_images_generator.set_background_keypoints(0, 0);
 }
 
 void planar_object_recognizer::detect_points(IplImage * input_image)
@@ -499,6 +935,10 @@ void planar_object_recognizer::detect_points(IplImage * input_image)
   point_detector->set_use_bins(use_bins_for_input_image);
   point_detector->set_tau(point_detector_tau);
 
+  // max_detected_pts may have been raised without set_max_detected_pts():
+  if (detection_buffer_capacity > 0 && max_detected_pts > detection_buffer_capacity)
+    allocate_detection_buffers(detection_buffer_patch_size);
+
   detected_point_number = point_detector->pyramidBlurDetect(input_image,
                                                             detected_points, max_detected_pts,
                                                             &object_input_view->image);
@@ -509,10 +949,15 @@ void planar_object_recognizer::preprocess_points(void)
 {
   int patch_size = forest->image_width;
 
-  //object_input_view->comp_gradient();
-  object_input_view->comp_gradient_mt();
+  if (!use_lazy_gradient)
+  {
+    //object_input_view->comp_gradient();
+    object_input_view->comp_gradient_mt();
+    computed_gradient_fraction = 1;
+  }
 
   PROFILE_SECTION_PUSH("point stuff loop");
+  inside_points.clear();
   for(int i = 0; i < detected_point_number; i++)
   {
     image_class_example * pv = &(detected_point_views[i]);
@@ -522,20 +967,83 @@ void planar_object_recognizer::preprocess_points(void)
 
     if (u > (patch_size/2) && u < object_input_view->image[s]->width - (patch_size/2) &&
         v > (patch_size/2) && v < object_input_view->image[s]->height - (patch_size/2))
-    {
-      new_images_generator.preprocess_point_view(pv, object_input_view);
+      inside_points.push_back(pv);
+  }
 
-      //if (0) mcvSaveImage("patches/detected_%03d_corrected.bmp", i, pv->preprocessed);
-    }
+  if (use_lazy_gradient)
+  {
+    PROFILE_SECTION_PUSH("lazy gradient");
+    // The pyramid was rebuilt for detection: every tile is stale.
+    object_input_view->invalidate_gradient();
+    for(int i = 0; i < int(inside_points.size()); i++)
+      object_input_view->comp_gradient_around(int(inside_points[i]->point2d->scale),
+                                              int(inside_points[i]->point2d->u), int(inside_points[i]->point2d->v),
+                                              patch_size / 2 + 1);
+    computed_gradient_fraction = object_input_view->computed_gradient_fraction();
+    PROFILE_SECTION_POP();
   }
+
+  int point_count = inside_points.size();
+  // One chunk per worker, but no chunk below this: waking a worker for fewer
+  // points costs more than it saves. The chunks are independent, so how the
+  // points are split does not change the result.
+  const int min_points_per_thread = 32;
+  int num_threads = MIN( FWorkerPool::Shared()->NumWorkers(), point_count/min_points_per_thread );
+  if ( num_threads < 2 )
+  {
+    if ( point_count > 0 )
+      preprocess_point_range(&inside_points[0], point_count);
+    PROFILE_SECTION_POP();
+    return;
+  }
+
+  // hand out contiguous chunks
+  preprocess_tasks.resize( num_threads );
+  int chunk = (point_count + num_threads - 1) / num_threads;
+  for ( int i=0; i<num_threads; i++ )
+  {
+    int begin = MIN(i*chunk, point_count);
+    int end = MIN(begin+chunk, point_count);
+    preprocess_tasks[i].points = &inside_points[begin];
+    preprocess_tasks[i].point_count = end-begin;
+  }
+
+  FWorkerPool::Shared()->Run( preprocess_points_task, this, num_threads );
   PROFILE_SECTION_POP();
 }
 
+void planar_object_recognizer::preprocess_point_range(image_class_example ** points, int count)
+{
+  bool orientation_estimated = false;
+  if (new_images_generator.use_orientation_correction && count > 0)
+  {
+    new_images_generator.estimate_orientations(points, count, object_input_view);
+    orientation_estimated = true;
+  }
+
+  for(int i = 0; i < count; i++)
+  {
+    new_images_generator.preprocess_point_view(points[i], object_input_view, orientation_estimated);
+
+    //if (0) mcvSaveImage("patches/detected_%03d_corrected.bmp", i, points[i]->preprocessed);
+  }
+}
+
+void planar_object_recognizer::preprocess_points_task( void* detector, int task )
+{
+    planar_object_recognizer* self = (planar_object_recognizer*)detector;
+    PreprocessTask& data = self->preprocess_tasks[task];
+    self->preprocess_point_range( data.points, data.point_count );
+}
+
 void planar_object_recognizer::match_points(bool fill_match_struct)
 {
   match_number = 0;
 
   int patch_size = forest->image_width;
+  bool cascade_active = use_cascade && cascade != 0;
+  int cascade_tested = 0, cascade_rejected = 0;
+  float cascade_p[2];
 
   for(int i = 0; i < detected_point_number; i++)
   {
@@ -546,6 +1054,18 @@ void planar_object_recognizer::match_points(bool fill_match_struct)
     if (u > (patch_size/2) && u < object_input_view->image[s]->width - (patch_size/2) &&
         v > (patch_size/2) && v < object_input_view->image[s]->height - (patch_size/2))
     {
+      if (cascade_active)
+      {
+        cascade_tested++;
+        cascade->posterior_probabilities(pv, cascade_p);
+        if (cascade_p[1] > cascade_threshold)
+        {
+          cascade_rejected++;
+          memset(match_probabilities[i], 0, sizeof(float) * model_point_number);
+          continue;
+        }
+      }
+
         // calculate probabilities + put into match_probabilities[i]
         forest->posterior_probabilities(pv, match_probabilities[i]);
 
@@ -570,6 +1090,9 @@ void planar_object_recognizer::match_points(bool fill_match_struct)
     else
       memset(match_probabilities[i], 0, sizeof(float) * model_point_number);
   }
+
+  if (cascade_tested > 0)
+    cascade_rejection_rate = (cascade_rejection_rate*7 + float(cascade_rejected) / cascade_tested)/8;
 }
 
 bool planar_object_recognizer::detect(IplImage * input_image)
@@ -588,6 +1111,30 @@ bool planar_object_recognizer::detect(IplImage * input_image)
     PROFILE_SECTION_POP();
 
     object_is_detected = false;
+    bool H_is_valid = false;
+
+    if (use_tracking && tracking)
+    {
+        PROFILE_SECTION_PUSH("track");
+        H_is_valid = track_with_predicted_homography();
+        PROFILE_SECTION_POP();
+    }
+
+    if (H_is_valid)
+    {
+        object_is_detected = true;
+        H->transform_point(float(new_images_generator.u_corner1),
+                     float(new_images_generator.v_corner1), &detected_u_corner1, &detected_v_corner1);
+        H->transform_point(float(new_images_generator.u_corner2),
+                     float(new_images_generator.v_corner2), &detected_u_corner2, &detected_v_corner2);
+        H->transform_point(float(new_images_generator.u_corner3),
+                     float(new_images_generator.v_corner3), &detected_u_corner3, &detected_v_corner3);
+        H->transform_point(float(new_images_generator.u_corner4),
+                     float(new_images_generator.v_corner4), &detected_u_corner4, &detected_v_corner4);
+
+        tracking = homography_inlier_number >= tracking_min_inliers;
+        return object_is_detected;
+    }
 
     PROFILE_SECTION_PUSH("estimate affine");
 
@@ -606,6 +1153,7 @@ bool planar_object_recognizer::detect(IplImage * input_image)
     if (object_is_detected)
     {
         object_is_detected = estimate_homographic_transformation_nonlinear_method();
+        H_is_valid = object_is_detected;
 
         if (object_is_detected)
         {
@@ -633,6 +1181,8 @@ bool planar_object_recognizer::detect(IplImage * input_image)
 
     PROFILE_SECTION_POP();
 
+    tracking = use_tracking && H_is_valid && homography_inlier_number >= tracking_min_inliers;
+
     return object_is_detected;
 }
 
@@ -651,7 +1201,7 @@ bool planar_object_recognizer::three_random_correspondences(int * n1, int * n2,
   do
   {
     //*n1 = rand() % match_number;
-    *n1 = match_index_lookup[rand()%MATCH_LOOKUP_TABLE_SIZE];
+    *n1 = match_index_lookup[gf_rand(MATCH_LOOKUP_TABLE_SIZE)];
     shot++; if (shot > 100) return false;
   }
   while(matches[*n1].score < match_score_threshold);
@@ -659,7 +1209,7 @@ bool planar_object_recognizer::three_random_correspondences(int * n1, int * n2,
   shot = 0;
   do
   {
-    *n2 = match_index_lookup[rand()%MATCH_LOOKUP_TABLE_SIZE];//rand() % match_number;
+    *n2 = match_index_lookup[gf_rand(MATCH_LOOKUP_TABLE_SIZE)];//rand() % match_number;
     shot++; if (shot > 100) return false;
   }
   while(matches[*n2].score < match_score_threshold || *n2 == *n1);
@@ -667,7 +1217,7 @@ bool planar_object_recognizer::three_random_correspondences(int * n1, int * n2,
   shot = 0;
   do
   {
-    *n3 = match_index_lookup[rand()%MATCH_LOOKUP_TABLE_SIZE];//rand() % match_number;
+    *n3 = match_index_lookup[gf_rand(MATCH_LOOKUP_TABLE_SIZE)];//rand() % match_number;
     shot++; if (shot > 100) return false;
   }
   while(matches[*n3].score < match_score_threshold || *n3 == *n1 || *n3 == *n2);
@@ -677,80 +1227,237 @@ bool planar_object_recognizer::three_random_correspondences(int * n1, int * n2,
 
 #define RANSAC_DIST_THRESHOLD ransac_dist_threshold
 
-int planar_object_recognizer::compute_support_for_affine_transformation_readonly(affinity * A)
+void planar_object_recognizer::compute_match_coordinates(void)
 {
-  int result = 0;
-
-  if (!valid(A))
+  const int stride = (hard_max_detected_pts + 3) & ~3;
+  if (match_coordinate_block == 0)
   {
-    return 0;
+    match_coordinate_block = (float *)cvAlloc(8 * stride * sizeof(float) + stride * sizeof(int));
+    match_model_u = match_coordinate_block;
+    match_model_v = match_coordinate_block + stride;
+    match_image_u = match_coordinate_block + 2 * stride;
+    match_image_v = match_coordinate_block + 3 * stride;
+    verify_model_u = match_coordinate_block + 4 * stride;
+    verify_model_v = match_coordinate_block + 5 * stride;
+    verify_image_u = match_coordinate_block + 6 * stride;
+    verify_image_v = match_coordinate_block + 7 * stride;
+    verify_match_index = (int *)(match_coordinate_block + 8 * stride);
   }
 
   for(int i = 0; i < match_number; i++)
   {
     image_object_point_match * match = &(matches[i]);
 
-    float mu = PyrImage::convCoordf(float(match->object_point->M[0]), int(match->object_point->scale), 0);
-    float mv = PyrImage::convCoordf(float(match->object_point->M[1]), int(match->object_point->scale), 0);
+    match_model_u[i] = PyrImage::convCoordf(float(match->object_point->M[0]), int(match->object_point->scale), 0);
+    match_model_v[i] = PyrImage::convCoordf(float(match->object_point->M[1]), int(match->object_point->scale), 0);
+    match_image_u[i] = PyrImage::convCoordf(match->image_point->u, int(match->image_point->scale), 0);
+    match_image_v[i] = PyrImage::convCoordf(match->image_point->v, int(match->image_point->scale), 0);
+    verify_match_index[i] = i;
+  }
 
-    float du = PyrImage::convCoordf(match->image_point->u, int(match->image_point->scale), 0);
-    float dv = PyrImage::convCoordf(match->image_point->v, int(match->image_point->scale), 0);
-    float tu, tv;
+  if (use_sprt)
+    for(int i = match_number - 1; i > 0; i--)
+      swap(verify_match_index[i], verify_match_index[gf_rand(i + 1)]);
 
-    A->transform_point(mu, mv, &tu, &tv);
+  for(int i = 0; i < match_number; i++)
+  {
+    int m = verify_match_index[i];
+    verify_model_u[i] = match_model_u[m];
+    verify_model_v[i] = match_model_v[m];
+    verify_image_u[i] = match_image_u[m];
+    verify_image_v[i] = match_image_v[m];
+  }
 
-    if ((du - tu) * (du - tu) + (dv - tv) * (dv - tv) < RANSAC_DIST_THRESHOLD * RANSAC_DIST_THRESHOLD)
-    {
-      result++;
-    }
+  // Padding that is never an inlier:
+  for(int i = match_number; i < ((match_number + 3) & ~3); i++)
+  {
+    match_model_u[i] = match_model_v[i] = verify_model_u[i] = verify_model_v[i] = 0;
+    match_image_u[i] = match_image_v[i] = verify_image_u[i] = verify_image_v[i] = 1e15f;
   }
+}
 
-  return result;
+// t_M of the optimal A, in match verifications. It is not the measured cost of
+// a hypothesis: sampling it and solving it with affinity::estimate_batch()
+// costs about 20 checks (30 ns against 1.5 ns per match, SSE2). With t_M = 20,
+// A is about 10 for epsilon = .3 and delta = .01, and SPRT rejects about one
+// good hypothesis in 10. adaptive_ransac_iterations() does not allow for these
+// losses. With 1000, A is about 300, so fewer than 1% of good hypotheses are
+// lost. A bad hypothesis then takes about 17 checks to reject instead of 7,
+// which costs little next to the full match_number.
+#define SPRT_MODEL_COST 1000.
+// Prior on delta, as a number of matches checked in rejected hypotheses:
+#define SPRT_DELTA_PRIOR_CHECKS 100.
+#define SPRT_INITIAL_DELTA .01
+// delta is updated every this many rejections:
+#define SPRT_DELTA_UPDATE_INTERVAL 16
+
+void planar_object_recognizer::start_sprt(sprt_state & sprt)
+{
+  sprt.rejected_checks = SPRT_DELTA_PRIOR_CHECKS;
+  sprt.rejected_consistent = SPRT_DELTA_PRIOR_CHECKS * SPRT_INITIAL_DELTA;
+  sprt.rejections_since_update = 0;
+  sprt.hypotheses = sprt.evaluations = 0;
+  update_sprt(sprt, -1);
 }
 
+void planar_object_recognizer::update_sprt(sprt_state & sprt, int best_support)
+{
+  sprt.best_support = best_support;
+  sprt.rejections_since_update = 0;
+
+  // A good model has at least the support a detection requires:
+  double min_epsilon = double(best_support_thresh + 1) / MAX(match_number, 1);
+  double epsilon = MAX(min_epsilon, double(best_support) / MAX(match_number, 1));
+  double delta = sprt.rejected_consistent / sprt.rejected_checks;
+
+  sprt.epsilon = epsilon;
+  sprt.delta = delta;
+  // Nothing to tell apart otherwise:
+  sprt.active = use_sprt && epsilon < 1 && epsilon > 1.5 * delta;
+  if (!sprt.active)
+    return;
+
+  // Optimal A (Chum and Matas, 2008): A = t_M C + 1 + log(A), where C is the
+  // Kullback-Leibler divergence between the two hypotheses.
+  double C = (1 - delta) * log((1 - delta) / (1 - epsilon)) + delta * log(delta / epsilon);
+  double A = SPRT_MODEL_COST * C + 1;
+  for(int i = 0; i < 10; i++)
+    A = SPRT_MODEL_COST * C + 1 + log(A);
+
+  sprt.log_A = log(A);
+  sprt.log_consistent = log(delta / epsilon);
+  sprt.log_inconsistent = log((1 - delta) / (1 - epsilon));
+}
 
-int planar_object_recognizer::compute_support_for_affine_transformation(affinity * A)
+int planar_object_recognizer::count_affine_inliers(const float a[6], bool set_inlier_flags, sprt_state * sprt)
 {
+  const float threshold2 = RANSAC_DIST_THRESHOLD * RANSAC_DIST_THRESHOLD;
+  static const int bit_count[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+  bool test = sprt != 0 && sprt->active;
+  double log_lambda = 0;
   int result = 0;
+  int i;
 
-  if (!valid(A))
+#ifdef __SSE2__
+  const __m128 a0 = _mm_set1_ps(a[0]), a1 = _mm_set1_ps(a[1]), a2 = _mm_set1_ps(a[2]);
+  const __m128 a3 = _mm_set1_ps(a[3]), a4 = _mm_set1_ps(a[4]), a5 = _mm_set1_ps(a[5]);
+  const __m128 t2 = _mm_set1_ps(threshold2);
+#endif
+
+  for(i = 0; i < match_number; i += 4)
   {
-    for(int i = 0; i < match_number; i++)
-      matches[i].inlier = false;
+#ifdef __SSE2__
+    __m128 mu = _mm_load_ps(verify_model_u + i);
+    __m128 mv = _mm_load_ps(verify_model_v + i);
+    __m128 eu = _mm_sub_ps(_mm_load_ps(verify_image_u + i),
+                           _mm_add_ps(_mm_add_ps(_mm_mul_ps(a0, mu), _mm_mul_ps(a1, mv)), a2));
+    __m128 ev = _mm_sub_ps(_mm_load_ps(verify_image_v + i),
+                           _mm_add_ps(_mm_add_ps(_mm_mul_ps(a3, mu), _mm_mul_ps(a4, mv)), a5));
+    int mask = _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(_mm_mul_ps(eu, eu), _mm_mul_ps(ev, ev)), t2));
+#else
+    int mask = 0;
+    for(int k = 0; k < 4; k++)
+    {
+      float eu = verify_image_u[i + k] - (a[0] * verify_model_u[i + k] + a[1] * verify_model_v[i + k] + a[2]);
+      float ev = verify_image_v[i + k] - (a[3] * verify_model_u[i + k] + a[4] * verify_model_v[i + k] + a[5]);
+      if (eu * eu + ev * ev < threshold2)
+        mask |= 1 << k;
+    }
+#endif
+    int consistent = bit_count[mask];
+    result += consistent;
 
-    return 0;
+    if (set_inlier_flags)
+      for(int k = 0; k < 4 && i + k < match_number; k++)
+        matches[verify_match_index[i + k]].inlier = (mask >> k) & 1;
+
+    if (test)
+    {
+      int checked = MIN(4, match_number - i);
+      log_lambda += consistent * sprt->log_consistent + (checked - consistent) * sprt->log_inconsistent;
+      if (log_lambda > sprt->log_A)
+      {
+        checked += i;
+        sprt->hypotheses++;
+        sprt->evaluations += checked;
+        sprt->rejected_checks += checked;
+        sprt->rejected_consistent += result;
+        if (++sprt->rejections_since_update >= SPRT_DELTA_UPDATE_INTERVAL)
+          update_sprt(*sprt, sprt->best_support);
+        return 0;
+      }
+    }
   }
 
-  for(int i = 0; i < match_number; i++)
+  if (sprt)
   {
-    image_object_point_match * match = &(matches[i]);
+    sprt->hypotheses++;
+    sprt->evaluations += match_number;
+  }
+  return result;
+}
 
-    float mu = PyrImage::convCoordf(float(match->object_point->M[0]), int(match->object_point->scale), 0);
-    float mv = PyrImage::convCoordf(float(match->object_point->M[1]), int(match->object_point->scale), 0);
+//! The 2x3 matrix of \a A, row major.
+static void affinity_coefficients(affinity * A, float a[6])
+{
+  a[0] = float(cvmGet(A, 0, 0)); a[1] = float(cvmGet(A, 0, 1)); a[2] = float(cvmGet(A, 0, 2));
+  a[3] = float(cvmGet(A, 1, 0)); a[4] = float(cvmGet(A, 1, 1)); a[5] = float(cvmGet(A, 1, 2));
+}
 
-    float du = PyrImage::convCoordf(match->image_point->u, int(match->image_point->scale), 0);
-    float dv = PyrImage::convCoordf(match->image_point->v, int(match->image_point->scale), 0);
-    float tu, tv;
+int planar_object_recognizer::compute_support_for_affine_transformation_readonly(affinity * A, sprt_state * sprt)
+{
+  if (!valid(A))
+  {
+    return 0;
+  }
 
-    A->transform_point(mu, mv, &tu, &tv);
+  float a[6];
+  affinity_coefficients(A, a);
+  return count_affine_inliers(a, false, sprt);
+}
 
-    if ((du - tu) * (du - tu) + (dv - tv) * (dv - tv) < RANSAC_DIST_THRESHOLD * RANSAC_DIST_THRESHOLD)
-    {
-      result++;
-      match->inlier = true;
-    }
-    else
-      match->inlier = false;
+
+int planar_object_recognizer::compute_support_for_affine_transformation(affinity * A)
+{
+  if (!valid(A))
+  {
+    for(int i = 0; i < match_number; i++)
+      matches[i].inlier = false;
+
+    return 0;
   }
 
-  return result;
+  float a[6];
+  affinity_coefficients(A, a);
+  return count_affine_inliers(a, true);
+}
+
+int planar_object_recognizer::adaptive_ransac_iterations(int support)
+{
+  if (ransac_confidence <= 0 || ransac_confidence >= 1 || support <= best_support_thresh || match_number == 0)
+    return max_ransac_iterations;
+
+  // Probability that a sample of 3 matches holds inliers only:
+  double inlier_ratio = MIN(1., double(support) / match_number);
+  double p = inlier_ratio * inlier_ratio * inlier_ratio;
+  if (p >= 1)
+    return 1;
+
+  double k = log(1. - ransac_confidence) / log(1. - p);
+  if (k >= max_ransac_iterations)
+    return max_ransac_iterations;
+  return MAX(1, int(ceil(k)));
 }
 
+// Bounds of the determinant of a plausible affine motion, see valid():
+#define AFFINE_MIN_DET 0.f
+#define AFFINE_MAX_DET (4.f * 4.f)
+
 bool planar_object_recognizer::valid(affinity * A)
 {
   float det = float(cvmGet(A, 0, 0) * cvmGet(A, 1, 1) - cvmGet(A, 1, 0) * cvmGet(A, 0, 1));
 
-  if (det < 0. || det > 4 * 4)
+  if (det < AFFINE_MIN_DET || det > AFFINE_MAX_DET)
     return false;
 
   return true;
@@ -761,34 +1468,33 @@ bool planar_object_recognizer::valid(affinity * A)
 
 
 
-void* planar_object_recognizer::estimate_affine_transformation_thread_func( void* _data )
+void planar_object_recognizer::estimate_affine_task( void* _detector, int task )
 {
     //PROFILE_THIS_FUNCTION();
 
-    EstimateAffineThreadData* data = (EstimateAffineThreadData*)_data;
-
-    planar_object_recognizer* detector = data->detector;
+    planar_object_recognizer* detector = (planar_object_recognizer*)_detector;
+    EstimateAffineTask* data = detector->affine_tasks[task];
 
-    while( true )
     {
-        // wait for signal to begin
-        data->start_signal.Wait();
-        if ( data->should_stop )
-            break;
+        // same samples for the same frame, whatever the thread scheduling
+        gf_seed_thread_rng( data->rng_stream );
+        detector->start_sprt( data->sprt );
 
-        //printf("thread %i running, %i iterations\n", data->thread_id, data->num_ransac_iterations );
+        //printf("task %i running, %i iterations\n", data->task_id, data->num_ransac_iterations );
 
         // construct random correspondencies
-        int randoms[3*data->num_ransac_iterations];
+        int* randoms = data->randoms;
         int actual_ransac_iterations = data->num_ransac_iterations;
         {
             //PROFILE_THIS_BLOCK("three random");
             bool three_random = true;
             int i;
+            // the tasks interleave the hypotheses of the frame
+            int stride = int(detector->affine_tasks.size());
             for ( i=0; i < data->num_ransac_iterations && three_random; i++ )
             {
-                // create 3 random correspondencies, bail if three_random_corr returns false
-                three_random &= detector->three_random_correspondences( &randoms[3*i], &randoms[3*i+1], &randoms[3*i+2] );
+                // create 3 random correspondencies, bail if sample_correspondences returns false
+                three_random &= detector->sample_correspondences( data->task_id + i*stride, &randoms[3*i], &randoms[3*i+1], &randoms[3*i+2] );
             }
             // in case three_random_correpsondencies fails early, we store how many we actually have
             actual_ransac_iterations = i-1;
@@ -797,58 +1503,71 @@ void* planar_object_recognizer::estimate_affine_transformation_thread_func( void
 
         // transform points
         //printf("actual_ransac_iterations %i\n", actual_ransac_iterations);
-        float transformed_points[4*3*actual_ransac_iterations];
+        float* transformed_points = data->transformed_points;
         {
             //PROFILE_THIS_BLOCK( "transform" );
             for ( int i=0; i<actual_ransac_iterations; i++ )
             {
-                image_object_point_match *m1 = detector->matches + randoms[3*i+0];
-                image_object_point_match *m2 = detector->matches + randoms[3*i+1];
-                image_object_point_match *m3 = detector->matches + randoms[3*i+2];
-
-                transformed_points[4*3*i+0 ] = PyrImage::convCoordf(float(m1->object_point->M[0]), int(m1->object_point->scale), 0);
-                transformed_points[4*3*i+1 ] = PyrImage::convCoordf(float(m1->object_point->M[1]), int(m1->object_point->scale), 0);
-                transformed_points[4*3*i+2 ] = PyrImage::convCoordf(float(m1->image_point->u), int(m1->image_point->scale), 0);
-                transformed_points[4*3*i+3 ] = PyrImage::convCoordf(float(m1->image_point->v), int(m1->image_point->scale), 0);
-
-                transformed_points[4*3*i+4 ] = PyrImage::convCoordf(float(m2->object_point->M[0]), int(m2->object_point->scale), 0);
-                transformed_points[4*3*i+5 ] = PyrImage::convCoordf(float(m2->object_point->M[1]), int(m2->object_point->scale), 0);
-                transformed_points[4*3*i+6 ] = PyrImage::convCoordf(float(m2->image_point->u), int(m2->image_point->scale), 0);
-                transformed_points[4*3*i+7 ] = PyrImage::convCoordf(float(m2->image_point->v), int(m2->image_point->scale), 0);
-
-                transformed_points[4*3*i+8 ] = PyrImage::convCoordf(float(m3->object_point->M[0]), int(m3->object_point->scale), 0);
-                transformed_points[4*3*i+9 ] = PyrImage::convCoordf(float(m3->object_point->M[1]), int(m3->object_point->scale), 0);
-                transformed_points[4*3*i+10] = PyrImage::convCoordf(float(m3->image_point->u), int(m3->image_point->scale), 0);
-                transformed_points[4*3*i+11] = PyrImage::convCoordf(float(m3->image_point->v), int(m3->image_point->scale), 0);
+                for ( int j=0; j<3; j++ )
+                {
+                    int m = randoms[3*i+j];
+                    transformed_points[4*3*i+4*j+0] = detector->match_model_u[m];
+                    transformed_points[4*3*i+4*j+1] = detector->match_model_v[m];
+                    transformed_points[4*3*i+4*j+2] = detector->match_image_u[m];
+                    transformed_points[4*3*i+4*j+3] = detector->match_image_v[m];
+                }
             }
         }
 
+        // closed-form hypotheses, 4 at a time, with the valid() check
+        float* coefficients = data->coefficients;
+        char* hypothesis_valid = data->hypothesis_valid;
+        affinity::estimate_batch( transformed_points, actual_ransac_iterations, coefficients, hypothesis_valid,
+                                  AFFINE_MIN_DET, AFFINE_MAX_DET );
+
         // so now go through and compute support for each point
-        int support[actual_ransac_iterations];
-        memset( &support, 0, sizeof(int)*actual_ransac_iterations );
+        int* support = data->support;
+        memset( support, 0, sizeof(int)*actual_ransac_iterations );
         {
             // PROFILE PROFILE PROFILE PROFILE
             // profile results say that 99% of time is spent in this block
             // PROFILE PROFILE PROFILE PROFILE
 
             //PROFILE_THIS_BLOCK("estimate");
-            affinity A;// = new affinity();
-
-            for ( int i=0; i<actual_ransac_iterations; i++ )
+            int stride = int(detector->affine_tasks.size());
+            int seen_best_support = -1;
+            int required_iterations = detector->max_ransac_iterations;
+            int i;
+            for ( i=0; i<actual_ransac_iterations; i++ )
             {
-                /*float *nums = &(transformed_points[4*3*i]);
-                A.estimate( nums[0], nums[1], nums[2], nums[3],
-                           nums[4], nums[5], nums[6], nums[7],
-                           nums[8], nums[9], nums[10], nums[11] );*/
+                // all the tasks stop once the hypotheses of the frame reach the
+                // number the best support so far requires
+                if ( data->task_id + i*stride >= required_iterations )
+                    break;
 
-                //A.estimate( &(transformed_points[4*3*i]) );
-                A.estimate( transformed_points + 4*3*i );
+                if ( hypothesis_valid[i] )
+                    support[i] = detector->count_affine_inliers( coefficients + 6*i, false, &data->sprt );
 
-                support[i] = detector->compute_support_for_affine_transformation_readonly(&A);
-                /*if ( support[i] > detector->ransac_stop_support )
-                    break;*/
+                // publish a better support
+                int best = detector->shared_best_support;
+                while ( support[i] > best )
+                {
+                    int previous = __sync_val_compare_and_swap( &detector->shared_best_support, best, support[i] );
+                    if ( previous == best )
+                        break;
+                    best = previous;
+                }
+                best = detector->shared_best_support;
+                if ( best != seen_best_support )
+                {
+                    seen_best_support = best;
+                    required_iterations = detector->adaptive_ransac_iterations( best );
+                    detector->update_sprt( data->sprt, best );
+                }
             }
+            actual_ransac_iterations = i;
         }
+        data->num_evaluated_iterations = actual_ransac_iterations;
 
         // find best support
         int best_support = -1;
@@ -868,20 +1587,39 @@ void* planar_object_recognizer::estimate_affine_transformation_thread_func( void
         // re-estimate for the output
         if ( best_support > detector->best_support_thresh )
         {
-            data->A.estimate( transformed_points + 4*3*best_index );
+            data->A.set_coefficients( coefficients + 6*best_index );
             data->A_support = best_support;
         }
         else
             data->A_support = -1;
 
-        //printf("thread %i finished, best support %i\n", data->thread_id, best_support );
-
-        // tell the barrier
-        data->barrier->Wait();
+        //printf("task %i finished, best support %i\n", data->task_id, best_support );
+    }
+}
 
+void planar_object_recognizer::EstimateAffineTask::reserve( int n )
+{
+    if ( n <= capacity )
+        return;
+    if ( buffer_block )
+        free( buffer_block );
+
+    // whole cache lines per array, so the tasks never share one
+    capacity = (n + 15) & ~15;
+    size_t floats = sizeof(float)*capacity;
+    size_t ints = sizeof(int)*capacity;
+    if ( posix_memalign( (void**)&buffer_block, 64, 12*floats + 6*floats + 3*ints + ints + capacity ) != 0 )
+    {
+        fprintf( stderr, "EstimateAffineTask::reserve: can't allocate buffers for %i hypotheses\n", capacity );
+        abort();
     }
 
-    pthread_exit(0);
+    char* p = buffer_block;
+    transformed_points = (float*)p;     p += 12*floats;
+    coefficients = (float*)p;           p += 6*floats;
+    randoms = (int*)p;                  p += 3*ints;
+    support = (int*)p;                  p += ints;
+    hypothesis_valid = p;
 }
 
 void planar_object_recognizer::construct_match_lut()
@@ -930,39 +1668,120 @@ void planar_object_recognizer::construct_match_lut()
     }
 }
 
+static bool cmp_match_scores(const pair<float, int> & m1, const pair<float, int> & m2)
+{
+  return m1.first > m2.first;
+}
+
+void planar_object_recognizer::prepare_ransac_sampling(void)
+{
+  if (!use_prosac_sampling)
+  {
+    construct_match_lut();
+    return;
+  }
+
+  vector< pair<float, int> > scores;
+  scores.reserve(match_number);
+  for(int i = 0; i < match_number; i++)
+    if (matches[i].score >= match_score_threshold)
+      scores.push_back(pair<float, int>(matches[i].score, i));
+  // stable: same order whatever the sort implementation
+  stable_sort(scores.begin(), scores.end(), cmp_match_scores);
+
+  prosac_order.resize(scores.size());
+  for(int i = 0; i < int(scores.size()); i++)
+    prosac_order[i] = scores[i].second;
+
+  construct_prosac_schedule();
+}
+
+void planar_object_recognizer::construct_prosac_schedule(void)
+{
+  const int m = 3;
+  int N = int(prosac_order.size());
+  int T_N = MAX(max_ransac_iterations, 1);
+
+  prosac_top_size.resize(T_N);
+  prosac_includes_last.resize(T_N);
+  if (N < m)
+    return;
+
+  // T_n: expected number of the T_N samples drawn from the n best matches only.
+  int n = m;
+  double T_n = T_N;
+  for(int i = 0; i < m; i++)
+    T_n *= double(m - i) / (N - i);
+  int T_prime = 1;
+
+  for(int t = 1; t <= T_N; t++)
+  {
+    while (t > T_prime && n < N)
+    {
+      double T_next = T_n * (n + 1) / (n + 1 - m);
+      T_prime += int(ceil(T_next - T_n));
+      T_n = T_next;
+      n++;
+    }
+    prosac_top_size[t - 1] = n;
+    prosac_includes_last[t - 1] = t <= T_prime;
+  }
+}
+
+bool planar_object_recognizer::sample_correspondences(int t, int * n1, int * n2, int * n3)
+{
+  if (!use_prosac_sampling)
+    return three_random_correspondences(n1, n2, n3);
+
+  int N = int(prosac_order.size());
+  if (N < 3)
+    return false;
+
+  int n = N;
+  bool includes_last = false;
+  if (t < int(prosac_top_size.size()))
+  {
+    n = prosac_top_size[t];
+    includes_last = prosac_includes_last[t] != 0;
+  }
+
+  int i1, i2, i3;
+  if (includes_last)
+  {
+    // The n-th best match, and 2 of the n - 1 better ones:
+    i1 = n - 1;
+    i2 = gf_rand(n - 1);
+    do i3 = gf_rand(n - 1); while (i3 == i2);
+  }
+  else
+  {
+    i1 = gf_rand(n);
+    do i2 = gf_rand(n); while (i2 == i1);
+    do i3 = gf_rand(n); while (i3 == i1 || i3 == i2);
+  }
+
+  *n1 = prosac_order[i1];
+  *n2 = prosac_order[i2];
+  *n3 = prosac_order[i3];
+  return true;
+}
+
 bool planar_object_recognizer::estimate_affine_transformation_mt(void)
 {
     PROFILE_THIS_FUNCTION();
 
-    // make threads
+    // the hypotheses are split into a fixed number of tasks, whatever the
+    // number of workers, so that the samples of a frame don't depend on it
     int num_threads = 8;
-    if ( affine_thread_data.size() != num_threads )
+    if ( int(affine_tasks.size()) != num_threads )
     {
-        assert(affine_thread_data.size() == 0);
-
-        // construct barrier
-        shared_barrier = new FBarrier( num_threads+1 );
-
-        // make threads joinable
-        pthread_attr_t thread_attr;
-        pthread_attr_init(&thread_attr);
-        pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_JOINABLE);
-        printf("creating %i estimate affine transformation threads\n", num_threads);
+        assert(affine_tasks.size() == 0);
         for ( int i=0; i<num_threads; i++ )
         {
-            // setup data
-            EstimateAffineThreadData* thread_data = new EstimateAffineThreadData();
-            thread_data->thread_id = i;
-            thread_data->detector = this;
-            thread_data->barrier = shared_barrier;
-            thread_data->should_stop = false;
-            // start the thread
-            pthread_create( &thread_data->thread, &thread_attr, estimate_affine_transformation_thread_func, (void*)thread_data );
-
-            // store
-            affine_thread_data.push_back( thread_data );
+            EstimateAffineTask* task = new EstimateAffineTask();
+            task->task_id = i;
+            affine_tasks.push_back( task );
         }
-        pthread_attr_destroy(&thread_attr);
     }
 
     // dump out three_random_corr input data
@@ -975,20 +1794,37 @@ bool planar_object_recognizer::estimate_affine_transformation_mt(void)
     }
     printf("\n");*/
     PROFILE_SECTION_PUSH("match lut");
-    // construct match lookup table
-    construct_match_lut();
+    // sort the matches or construct the match lookup table
+    prepare_ransac_sampling();
+    compute_match_coordinates();
     PROFILE_SECTION_POP();
 
-    // tell threads to run
+    // set up the tasks
+    unsigned long long rng_stream_base = gf_thread_rng().next64();
+    shared_best_support = -1;
     for ( int i=0; i<num_threads; i++ )
     {
-        affine_thread_data[i]->A_support = -1;
-        affine_thread_data[i]->num_ransac_iterations = max_ransac_iterations/num_threads;
-        affine_thread_data[i]->start_signal.Signal();
+        affine_tasks[i]->A_support = -1;
+        affine_tasks[i]->num_evaluated_iterations = 0;
+        affine_tasks[i]->num_ransac_iterations = max_ransac_iterations/num_threads;
+        affine_tasks[i]->rng_stream = rng_stream_base + i;
+        affine_tasks[i]->reserve( affine_tasks[i]->num_ransac_iterations );
     }
 
-    // now wait for threads to finish
-    shared_barrier->Wait();
+    // run them on the shared pool and wait
+    FWorkerPool::Shared()->Run( estimate_affine_task, this, num_threads );
+
+    int evaluated_iterations = 0;
+    int verified_hypotheses = 0, match_evaluations = 0;
+    for ( int i=0; i<num_threads; i++ )
+    {
+        evaluated_iterations += affine_tasks[i]->num_evaluated_iterations;
+        verified_hypotheses += affine_tasks[i]->sprt.hypotheses;
+        match_evaluations += affine_tasks[i]->sprt.evaluations;
+    }
+    avg_ransac_iterations = (avg_ransac_iterations*7 + evaluated_iterations)/8;
+    if ( verified_hypotheses > 0 )
+        avg_match_evaluations = (avg_match_evaluations*7 + float(match_evaluations)/verified_hypotheses)/8;
 
     // and get best support
     affinity* best_A = NULL;
@@ -996,17 +1832,17 @@ bool planar_object_recognizer::estimate_affine_transformation_mt(void)
     int best_thread = -1;
     for ( int i=0; i<num_threads; i++ )
     {
-        // read data back from the thread
-        if ( affine_thread_data[i]->A_support > best_support)
+        // read data back from the task
+        if ( affine_tasks[i]->A_support > best_support)
         {
-            best_A = &affine_thread_data[i]->A;
-            best_support = affine_thread_data[i]->A_support;
+            best_A = &affine_tasks[i]->A;
+            best_support = affine_tasks[i]->A_support;
             best_thread = i;
         }
     }
 
     /*if ( best_thread > 0 )
-        printf("best thread was %i with %i support\n", affine_thread_data[best_thread]->thread_id, affine_thread_data[best_thread]->A_support );
+        printf("best thread was %i with %i support\n", affine_tasks[best_thread]->task_id, affine_tasks[best_thread]->A_support );
     else
         printf("no best thread\n");*/
 
@@ -1029,8 +1865,9 @@ bool planar_object_recognizer::estimate_affine_transformation_unrolled(void)
 {
     PROFILE_THIS_FUNCTION();
 
-    // construct match lookup table
-    construct_match_lut();
+    // sort the matches or construct the match lookup table
+    prepare_ransac_sampling();
+    compute_match_coordinates();
 
     // first, unroll everything
 
@@ -1043,8 +1880,8 @@ bool planar_object_recognizer::estimate_affine_transformation_unrolled(void)
         int i;
         for ( i=0; i < max_ransac_iterations && three_random; i++ )
         {
-            // create 3 random correspondencies, bail if three_random_corr returns false
-            three_random &= three_random_correspondences( &randoms[3*i], &randoms[3*i+1], &randoms[3*i+2] );
+            // create 3 random correspondencies, bail if sample_correspondences returns false
+            three_random &= sample_correspondences( i, &randoms[3*i], &randoms[3*i+1], &randoms[3*i+2] );
         }
         // in case three_random_correpsondencies fails early, we store how many we actually have
         actual_ransac_iterations = i;
@@ -1058,50 +1895,45 @@ bool planar_object_recognizer::estimate_affine_transformation_unrolled(void)
         //PROFILE_THIS_BLOCK( "transform" );
         for ( int i=0; i<actual_ransac_iterations; i++ )
         {
-            image_object_point_match *m1 = matches + randoms[3*i+0];
-            image_object_point_match *m2 = matches + randoms[3*i+1];
-            image_object_point_match *m3 = matches + randoms[3*i+2];
-            /*printf("%i: %x %x %x: ", i, m1, m2, m3 );
-            printf(" %x ", m1->object_point );
-            printf(" %x ", m2->object_point );
-            printf(" %x ", m3->object_point );
-            printf("\n");*/
-
-            transformed_points[4*3*i+0 ] = PyrImage::convCoordf(float(m1->object_point->M[0]), int(m1->object_point->scale), 0);
-            transformed_points[4*3*i+1 ] = PyrImage::convCoordf(float(m1->object_point->M[1]), int(m1->object_point->scale), 0);
-            transformed_points[4*3*i+2 ] = PyrImage::convCoordf(float(m1->image_point->u), int(m1->image_point->scale), 0);
-            transformed_points[4*3*i+3 ] = PyrImage::convCoordf(float(m1->image_point->v), int(m1->image_point->scale), 0);
-
-            transformed_points[4*3*i+4 ] = PyrImage::convCoordf(float(m2->object_point->M[0]), int(m2->object_point->scale), 0);
-            transformed_points[4*3*i+5 ] = PyrImage::convCoordf(float(m2->object_point->M[1]), int(m2->object_point->scale), 0);
-            transformed_points[4*3*i+6 ] = PyrImage::convCoordf(float(m2->image_point->u), int(m2->image_point->scale), 0);
-            transformed_points[4*3*i+7 ] = PyrImage::convCoordf(float(m2->image_point->v), int(m2->image_point->scale), 0);
-
-            transformed_points[4*3*i+8 ] = PyrImage::convCoordf(float(m3->object_point->M[0]), int(m3->object_point->scale), 0);
-            transformed_points[4*3*i+9 ] = PyrImage::convCoordf(float(m3->object_point->M[1]), int(m3->object_point->scale), 0);
-            transformed_points[4*3*i+10] = PyrImage::convCoordf(float(m3->image_point->u), int(m3->image_point->scale), 0);
-            transformed_points[4*3*i+11] = PyrImage::convCoordf(float(m3->image_point->v), int(m3->image_point->scale), 0);
+            for ( int j=0; j<3; j++ )
+            {
+                int m = randoms[3*i+j];
+                transformed_points[4*3*i+4*j+0] = match_model_u[m];
+                transformed_points[4*3*i+4*j+1] = match_model_v[m];
+                transformed_points[4*3*i+4*j+2] = match_image_u[m];
+                transformed_points[4*3*i+4*j+3] = match_image_v[m];
+            }
         }
     }
 
+    // closed-form hypotheses, 4 at a time, with the valid() check
+    float coefficients[6*actual_ransac_iterations];
+    char hypothesis_valid[actual_ransac_iterations];
+    affinity::estimate_batch( transformed_points, actual_ransac_iterations, coefficients, hypothesis_valid,
+                              AFFINE_MIN_DET, AFFINE_MAX_DET );
+
     // so now go through and compute support for each point
     int support[actual_ransac_iterations];
+    sprt_state sprt;
     {
         //PROFILE_THIS_BLOCK("estimate");
-        affinity A;// = new affinity();
-
-        for ( int i=0; i<actual_ransac_iterations; i++ )
+        int best = -1;
+        int required_iterations = max_ransac_iterations;
+        start_sprt( sprt );
+        int i;
+        for ( i=0; i<actual_ransac_iterations && i<required_iterations; i++ )
         {
-            /*float *nums = &(transformed_points[4*3*i]);
-            A.estimate( nums[0], nums[1], nums[2], nums[3],
-                       nums[4], nums[5], nums[6], nums[7],
-                       nums[8], nums[9], nums[10], nums[11] );*/
-
-            //A.estimate( &(transformed_points[4*3*i]) );
-            A.estimate( transformed_points + 4*3*i );
-
-            support[i] = compute_support_for_affine_transformation(&A);
+            support[i] = 0;
+            if ( hypothesis_valid[i] )
+                support[i] = count_affine_inliers( coefficients + 6*i, false, &sprt );
+            if ( support[i] > best )
+            {
+                best = support[i];
+                required_iterations = adaptive_ransac_iterations( best );
+                update_sprt( sprt, best );
+            }
         }
+        actual_ransac_iterations = i;
     }
 
     // find best support
@@ -1121,18 +1953,15 @@ bool planar_object_recognizer::estimate_affine_transformation_unrolled(void)
 
     // store average
     avg_ransac_iterations = (avg_ransac_iterations*7 + actual_ransac_iterations)/8;
+    if ( sprt.hypotheses > 0 )
+        avg_match_evaluations = (avg_match_evaluations*7 + float(sprt.evaluations)/sprt.hypotheses)/8;
 
 
     // finally
     if ( best_support > best_support_thresh )
     {
         //PROFILE_THIS_BLOCK( "return result " );
-        affine_motion->estimate( transformed_points + 4*3*best_index );
-        //affine_motion->estimate( &(transformed_points[4*3*best_index]) );
-        /*float *nums = &(transformed_points[4*3*best_index]);
-        affine_motion->estimate( nums[0], nums[1], nums[2], nums[3],
-                   nums[4], nums[5], nums[6], nums[7],
-                   nums[8], nums[9], nums[10], nums[11] );*/
+        affine_motion->set_coefficients( coefficients + 6*best_index );
 
         int support = compute_support_for_affine_transformation(affine_motion);
         assert( best_support == support );
@@ -1149,14 +1978,18 @@ bool planar_object_recognizer::estimate_affine_transformation(void)
 {
     PROFILE_THIS_FUNCTION();
 
-  affinity * A = new affinity();
   int iteration = 0;
 
   int best_support = -1;
+  int required_iterations = max_ransac_iterations;
   //printf("match number %i\n", match_number);
 
-    // construct match lookup table
-    construct_match_lut();
+    // sort the matches or construct the match lookup table
+    prepare_ransac_sampling();
+    compute_match_coordinates();
+
+  sprt_state sprt;
+  start_sprt(sprt);
 
   do
   {
@@ -1166,7 +1999,7 @@ bool planar_object_recognizer::estimate_affine_transformation(void)
     iteration++;
 
     PROFILE_SECTION_PUSH( "three random" );
-    bool three_random = three_random_correspondences(&n1, &n2, &n3);
+    bool three_random = sample_correspondences(iteration - 1, &n1, &n2, &n3);
     PROFILE_SECTION_POP();
     // Choose three correspondences randomly
     if (!three_random )
@@ -1175,51 +2008,38 @@ bool planar_object_recognizer::estimate_affine_transformation(void)
       break;
     }
 
-    image_object_point_match * m1 = matches + n1;
-    image_object_point_match * m2 = matches + n2;
-    image_object_point_match * m3 = matches + n3;
-
     // Estimation of A (affine matrix) from the 3 correspondences:
     PROFILE_SECTION_PUSH( "A->estimate" );
-    A->estimate
-      (
-        PyrImage::convCoordf(float(m1->object_point->M[0]), int(m1->object_point->scale), 0),
-        PyrImage::convCoordf(float(m1->object_point->M[1]), int(m1->object_point->scale), 0),
-
-        PyrImage::convCoordf(float(m1->image_point->u), int(m1->image_point->scale), 0),
-        PyrImage::convCoordf(float(m1->image_point->v), int(m1->image_point->scale), 0),
-
-        PyrImage::convCoordf(float(m2->object_point->M[0]), int(m2->object_point->scale), 0),
-        PyrImage::convCoordf(float(m2->object_point->M[1]), int(m2->object_point->scale), 0),
-
-        PyrImage::convCoordf(float(m2->image_point->u), int(m2->image_point->scale), 0),
-        PyrImage::convCoordf(float(m2->image_point->v), int(m2->image_point->scale), 0),
-
-        PyrImage::convCoordf(float(m3->object_point->M[0]), int(m3->object_point->scale), 0),
-        PyrImage::convCoordf(float(m3->object_point->M[1]), int(m3->object_point->scale), 0),
-
-        PyrImage::convCoordf(float(m3->image_point->u), int(m3->image_point->scale), 0),
-        PyrImage::convCoordf(float(m3->image_point->v), int(m3->image_point->scale), 0)
-      );
+    float sample[12] = {
+        match_model_u[n1], match_model_v[n1], match_image_u[n1], match_image_v[n1],
+        match_model_u[n2], match_model_v[n2], match_image_u[n2], match_image_v[n2],
+        match_model_u[n3], match_model_v[n3], match_image_u[n3], match_image_v[n3]
+      };
+    float a[6];
+    char a_valid;
+    affinity::estimate_batch(sample, 1, a, &a_valid, AFFINE_MIN_DET, AFFINE_MAX_DET);
     PROFILE_SECTION_POP();
 
     PROFILE_SECTION_PUSH( "compute support for A" );
-    int support = compute_support_for_affine_transformation(A);
+    int support = a_valid ? count_affine_inliers(a, false, &sprt) : 0;
     PROFILE_SECTION_POP();
 
     if (support > best_support)
     {
       best_support = support;
+      required_iterations = adaptive_ransac_iterations(best_support);
+      update_sprt(sprt, best_support);
 
-      cvmCopy(A, affine_motion);
+      if (a_valid)
+        affine_motion->set_coefficients(a);
       if (best_support > ransac_stop_support)
         break;
     }
-  } while(iteration < max_ransac_iterations);
+  } while(iteration < required_iterations);
 
   avg_ransac_iterations = (avg_ransac_iterations*7 + iteration)/8;
-
-  delete A;
+  if (sprt.hypotheses > 0)
+    avg_match_evaluations = (avg_match_evaluations*7 + float(sprt.evaluations)/sprt.hypotheses)/8;
 
   //cout << "Found support of " << best_support << " after " << iteration << " iterations." << endl;
 
@@ -1260,43 +2080,10 @@ bool planar_object_recognizer::estimate_homographic_transformation_linear_method
   return true;
 }
 
-static void homography_error(
-                             const ls_minimizer2::flt_t * state,
-                             const ls_minimizer2::flt_t *d, int dsize,
-                             ls_minimizer2::flt_t *b,
-                             ls_minimizer2::flt_t *J,
-                             void ** /*user_data*/)
-{
-  double den = 1. / (state[6] * d[0] + state[7] * d[1] + 1.);
-
-  b[0] = (state[0] * d[0] + state[1] * d[1] + state[2]) * den;
-  b[1] = (state[3] * d[0] + state[4] * d[1] + state[5]) * den;
-
-  if (J != 0)
-  {
-    J[0] = d[0] * den;
-    J[1] = d[1] * den;
-    J[2] =      den;
-    J[3] = 0;
-    J[4] = 0;
-    J[5] = 0;
-    J[6] = -b[0] * J[0];
-    J[7] = -b[0] * J[1];
-
-    J[8]  = 0;
-    J[9]  = 0;
-    J[10] = 0;
-    J[11] = J[0];
-    J[12] = J[1];
-    J[13] = J[2];
-    J[14] = -b[1] * J[11];
-    J[15] = -b[1] * J[12];
-  }
-}
-
-bool planar_object_recognizer::estimate_homographic_transformation_nonlinear_method(void)
+bool planar_object_recognizer::estimate_homographic_transformation_nonlinear_method(bool from_H)
 {
 	int inlier_number = 0;
+	homography_inlier_number = 0;
 
 	for(int i = 0; i < match_number; i++)
 		if (matches[i].inlier)
@@ -1308,24 +2095,22 @@ bool planar_object_recognizer::estimate_homographic_transformation_nonlinear_met
 		return false;
 	}
 
-	homography_estimator->set_verbose_level(0);
-
 	homography_estimator->reset_observations();
 	for(int i = 0; i < match_number; i++)
-		if (matches[i].inlier) {
-			ls_minimizer2::flt_t d[2] = {
+		if (matches[i].inlier)
+			homography_estimator->add_observation(
 				PyrImage::convCoordf(float(matches[i].object_point->M[0]), int(matches[i].object_point->scale), 0),
-				PyrImage::convCoordf(float(matches[i].object_point->M[1]), int(matches[i].object_point->scale), 0)};
-			ls_minimizer2::flt_t b[2] = {
+				PyrImage::convCoordf(float(matches[i].object_point->M[1]), int(matches[i].object_point->scale), 0),
 				PyrImage::convCoordf(matches[i].image_point->u, int(matches[i].image_point->scale), 0),
-				PyrImage::convCoordf(matches[i].image_point->v, int(matches[i].image_point->scale), 0)};
-			homography_estimator->add_observation_2data_2measures(homography_error, d, b);
-		}
+				PyrImage::convCoordf(matches[i].image_point->v, int(matches[i].image_point->scale), 0));
 
 	double initial_state[8] = {affine_motion->cvmGet(0, 0), affine_motion->cvmGet(0, 1), affine_motion->cvmGet(0, 2),
 		affine_motion->cvmGet(1, 0), affine_motion->cvmGet(1, 1), affine_motion->cvmGet(1, 2),
 		0, 0};
-	homography_estimator->minimize_using_levenberg_marquardt_from(initial_state);
+	if (from_H)
+		for(int i = 0; i < 8; i++)
+			initial_state[i] = H->cvmGet(i / 3, i % 3) / H->cvmGet(2, 2);
+	homography_estimator->minimize_from(initial_state);
 
 	double * state = homography_estimator->state;
 
@@ -1351,18 +2136,15 @@ bool planar_object_recognizer::estimate_homographic_transformation_nonlinear_met
 			    //printf("y");
 				matches[i].inlier=true;
 				inlier_number++;
-				if (iter==0) {
-					ls_minimizer2::flt_t d[2] = { mu, mv };
-					ls_minimizer2::flt_t b[2] = { tu, tv };
-					homography_estimator->add_observation_2data_2measures(homography_error, d, b);
-				}
+				if (iter==0)
+					homography_estimator->add_observation(mu, mv, tu, tv);
 			} else {
 				matches[i].inlier=false;
 				//printf("n");
 			}
 		}
 		if (iter==0 && inlier_number>=10){
-			homography_estimator->minimize_using_levenberg_marquardt_from(state);
+			homography_estimator->minimize_from(state);
 			state = homography_estimator->state;
 
 			H->cvmSet(0, 0, state[0]); H->cvmSet(0, 1, state[1]); H->cvmSet(0, 2, state[2]);
@@ -1377,10 +2159,49 @@ bool planar_object_recognizer::estimate_homographic_transformation_nonlinear_met
 	}
 
 	homography_estimator->reset_observations();
+	homography_inlier_number = inlier_number;
 
 	return true;
 }
 
+bool planar_object_recognizer::track_with_predicted_homography(void)
+{
+  const float gate2 = tracking_gate_radius * tracking_gate_radius;
+  int gated_number = 0;
+
+  for(int i = 0; i < match_number; i++)
+  {
+    image_object_point_match * match = &(matches[i]);
+    float mu = PyrImage::convCoordf(float(match->object_point->M[0]), int(match->object_point->scale), 0);
+    float mv = PyrImage::convCoordf(float(match->object_point->M[1]), int(match->object_point->scale), 0);
+    float pu, pv;
+    H->transform_point(mu, mv, &pu, &pv);
+
+    float du = pu - PyrImage::convCoordf(match->image_point->u, int(match->image_point->scale), 0);
+    float dv = pv - PyrImage::convCoordf(match->image_point->v, int(match->image_point->scale), 0);
+    match->inlier = du * du + dv * dv < gate2;
+    if (match->inlier)
+      gated_number++;
+  }
+
+  if (gated_number < tracking_min_inliers)
+    return false;
+
+  // The refinement overwrites H: a rejected track must leave the last good one,
+  // in case RANSAC does not find the object either.
+  double previous_H[9];
+  for(int i = 0; i < 9; i++)
+    previous_H[i] = H->cvmGet(i / 3, i % 3);
+
+  if (estimate_homographic_transformation_nonlinear_method(true) &&
+      homography_inlier_number >= tracking_min_inliers)
+    return true;
+
+  for(int i = 0; i < 9; i++)
+    H->cvmSet(i / 3, i % 3, previous_H[i]);
+  return false;
+}
+
 void planar_object_recognizer::save_patch_before_and_after_correction(IplImage * image_before_smoothing,
                                                                       int u, int v, int patch_size,
                                                                       image_class_example * pv,
@@ -1401,23 +2222,98 @@ void planar_object_recognizer::save_patch_before_and_after_correction(IplImage *
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-pair<object_keypoint, int> * planar_object_recognizer::search_for_existing_model_point(vector< pair<object_keypoint, int> > * tmp_model_points,
-                                                                                       float cu, float cv, int scale)
+model_point_candidates::model_point_candidates(int _width, int _height, double _distance_threshold)
 {
-  for(vector< pair<object_keypoint, int> >::iterator it = tmp_model_points->begin();
-    it < tmp_model_points->end();
-    it++)
-    if (int(it->first.scale) == scale)
+  width = _width;
+  height = _height;
+  distance_threshold = _distance_threshold;
+  // Two candidates closer than the threshold are in the same or in neighbouring cells:
+  cell_size = MAX(float(distance_threshold), 1.f);
+}
+
+void model_point_candidates::add_levels(int level_number)
+{
+  for(int level = int(cells.size()); level < level_number; level++)
+  {
+    columns.push_back(int((width >> level) / cell_size) + 1);
+    rows.push_back(int((height >> level) / cell_size) + 1);
+    cells.push_back(vector< vector<int> >(columns[level] * rows[level]));
+  }
+}
+
+int model_point_candidates::cell_index(int level, float u, float v)
+{
+  // Clamping keeps neighbouring cells neighbours:
+  int x = MIN(MAX(int(floorf(u / cell_size)), 0), columns[level] - 1);
+  int y = MIN(MAX(int(floorf(v / cell_size)), 0), rows[level] - 1);
+  return y * columns[level] + x;
+}
+
+pair<object_keypoint, int> * model_point_candidates::search(float cu, float cv, int scale)
+{
+  // No candidate on a level without a grid yet:
+  if (scale < 0 || scale >= int(cells.size()))
+    return 0;
+
+  int center = cell_index(scale, cu, cv);
+  int cx = center % columns[scale], cy = center / columns[scale];
+
+  int best = -1;
+  for(int y = MAX(cy - 1, 0); y <= MIN(cy + 1, rows[scale] - 1); y++)
+    for(int x = MAX(cx - 1, 0); x <= MIN(cx + 1, columns[scale] - 1); x++)
     {
-      float dist2 =
-        (float(it->first.M[0]) - cu) * (float(it->first.M[0]) - cu) +
-        (float(it->first.M[1]) - cv) * (float(it->first.M[1]) - cv);
+      vector<int> & cell = cells[scale][y * columns[scale] + x];
+      for(vector<int>::iterator it = cell.begin(); it < cell.end(); it++)
+      {
+        if (best >= 0 && *it > best)
+          continue;
 
-      if (dist2 < keypoint_distance_threshold * keypoint_distance_threshold)
-        return &(*it);
+        const object_keypoint & p = points[*it].first;
+        float dist2 =
+          (float(p.M[0]) - cu) * (float(p.M[0]) - cu) +
+          (float(p.M[1]) - cv) * (float(p.M[1]) - cv);
+
+        if (dist2 < distance_threshold * distance_threshold)
+          best = *it;
+      }
     }
 
-    return 0;
+  return best >= 0 ? &points[best] : 0;
+}
+
+void model_point_candidates::add(float u, float v, float scale)
+{
+  object_keypoint op;
+  op.M[0] = u;
+  op.M[1] = v;
+  op.M[2] = 0;
+  op.scale = scale;
+  points.push_back(pair<object_keypoint, int>(op, 1));
+
+  int level = MAX(int(scale), 0);
+  add_levels(level + 1);
+  cells[level][cell_index(level, u, v)].push_back(int(points.size()) - 1);
+}
+
+void model_point_candidates::merge(pair<object_keypoint, int> * mp, float u, float v)
+{
+  int level = MAX(int(mp->first.scale), 0);
+  int old_cell = cell_index(level, float(mp->first.M[0]), float(mp->first.M[1]));
+
+  // move the keypoint coordinates in the center of gravity of
+  // all agglomerated keypoints.
+  double n = double(++mp->second);
+  mp->first.M[0] = (mp->first.M[0]*(n-1) + u)/n;
+  mp->first.M[1] = (mp->first.M[1]*(n-1) + v)/n;
+
+  int new_cell = cell_index(level, float(mp->first.M[0]), float(mp->first.M[1]));
+  if (new_cell != old_cell)
+  {
+    int index = int(mp - &points[0]);
+    vector<int> & cell = cells[level][old_cell];
+    cell.erase(find(cell.begin(), cell.end(), index));
+    cells[level][new_cell].push_back(index);
+  }
 }
 
 bool cmp_tmp_model_points(pair<object_keypoint, int> p1, pair<object_keypoint, int> p2)
@@ -1425,6 +2321,35 @@ bool cmp_tmp_model_points(pair<object_keypoint, int> p1, pair<object_keypoint, i
   return p1.second > p2.second;
 }
 
+// Adaptive view count: number of candidates that could still end up on either
+// side of the selection threshold after \a view_nb views. The threshold is
+// min_view_rate, or halfway between the point_number-th and the next rate when
+// more candidates than point_number pass min_view_rate.
+static int undecided_candidate_number(const vector< pair<object_keypoint, int> > & points,
+                                      int view_nb, int point_number, double min_view_rate)
+{
+  vector<double> rates;
+  rates.reserve(points.size());
+  for(int i = 0; i < int(points.size()); i++)
+    rates.push_back(double(points[i].second) / view_nb);
+  sort(rates.begin(), rates.end(), greater<double>());
+
+  double threshold = min_view_rate;
+  if (int(rates.size()) > point_number && point_number > 0 && rates[point_number] >= min_view_rate)
+    threshold = (rates[point_number - 1] + rates[point_number]) / 2;
+
+  // 95% Wald interval, widened so that rates of 0 or 1 are not certain after a few views:
+  int undecided = 0;
+  for(int i = 0; i < int(rates.size()); i++)
+  {
+    double p = rates[i];
+    double h = 1.96 * sqrt((p * (1 - p) + 1. / view_nb) / view_nb);
+    if (fabs(p - threshold) < h)
+      undecided++;
+  }
+  return undecided;
+}
+
 // Selection of the interest points from the image model
 void planar_object_recognizer::detect_most_stable_model_points(int max_point_number_on_model,
                                                                int patch_size,
@@ -1434,9 +2359,13 @@ void planar_object_recognizer::detect_most_stable_model_points(int max_point_num
     put_ui_settings();
   cout << "Determining most stable points:" << endl;
 
-  vector< pair<object_keypoint, int> > tmp_model_points;
+  model_point_candidates candidates(new_images_generator.original_image->width,
+                                    new_images_generator.original_image->height,
+                                    keypoint_distance_threshold);
   int K = 8;
 
+  background_points.clear();
+
   keypoint * model_points_2d = new keypoint[K * max_point_number_on_model];
 
   // First detection of interest points in the image model (frontal view):
@@ -1470,6 +2399,17 @@ void planar_object_recognizer::detect_most_stable_model_points(int max_point_num
       if (model_point_number >= K*max_point_number_on_model)
         break;
     }
+    else if (int(background_points.size()) < max_point_number_on_model / 2)
+    {
+      // Keypoints around the target are typical clutter: keep some as cascade background.
+      object_keypoint op;
+      op.M[0] = k->u;
+      op.M[1] = k->v;
+      op.M[2] = 0;
+      op.scale = k->scale;
+      op.class_index = -1;
+      background_points.push_back(op);
+    }
   }
   printf("found %i points in target ROI\n", model_point_number);
 
@@ -1477,8 +2417,8 @@ void planar_object_recognizer::detect_most_stable_model_points(int max_point_num
   delete [] model_points;
   model_point_number = 0;
 
-  // Create tmp_model_points (vector) from model_points_2d (array of keypoints)
-  // tmp_model_points will be used afterward
+  // Create the candidates from model_points_2d (array of keypoints)
+  // they will be used afterward
   for(int i = 0; i < model_point2d_number; i++)
   {
     keypoint * k = model_points_2d + i;
@@ -1487,23 +2427,12 @@ void planar_object_recognizer::detect_most_stable_model_points(int max_point_num
                                         int(PyrImage::convCoordf(k->u, int(k->scale), 0)),
                                         int(PyrImage::convCoordf(k->v, int(k->scale), 0))))
     {
-      pair<object_keypoint, int> * mp = search_for_existing_model_point(&tmp_model_points, k->u, k->v, int(k->scale));
+      pair<object_keypoint, int> * mp = candidates.search(k->u, k->v, int(k->scale));
 
       if (mp != 0) // Agglomerate clustered keypoints into one single keypoint
-      {
-        double n = double(++mp->second);
-        mp->first.M[0] = (mp->first.M[0]*(n-1) + k->u)/n;
-        mp->first.M[1] = (mp->first.M[1]*(n-1) + k->v)/n;
-      }
+        candidates.merge(mp, k->u, k->v);
       else
-      {
-        object_keypoint op;
-        op.M[0] = k->u;
-        op.M[1] = k->v;
-        op.M[2] = 0;
-        op.scale = k->scale;
-        tmp_model_points.push_back(pair<object_keypoint, int>(op, 1));
-      }
+        candidates.add(k->u, k->v, k->scale);
     }
   }
 
@@ -1512,6 +2441,20 @@ void planar_object_recognizer::detect_most_stable_model_points(int max_point_num
   bool use_random_background = new_images_generator.use_random_background;
   new_images_generator.set_use_random_background(false);
 
+  // The views are warped on worker threads; detection stays on this one.
+  parallel_example_generator * producer = 0;
+  if (training_thread_number != 1)
+  {
+    producer = new parallel_example_generator(&new_images_generator, parallel_example_generator::VIEWS,
+                                              view_nb, training_thread_number);
+    if (!producer->is_ok())
+    {
+      delete producer;
+      producer = 0;
+    }
+  }
+
+  int views_done = 0, stable_checks = 0;
   for(int j = 0; j < view_nb; j++)
   {
     if (LearnProgress!=0)
@@ -1519,17 +2462,28 @@ void planar_object_recognizer::detect_most_stable_model_points(int max_point_num
     else
       cout << "Generating views: " << view_nb - j << "         \r" << flush;
 
-    new_images_generator.generate_random_affine_transformation();
-    new_images_generator.generate_object_view();
+    PyrImage * view = 0;
+    float a[6];
+    if (producer != 0)
+      view = producer->next_view(a);
+    else
+    {
+      new_images_generator.generate_random_affine_transformation();
+      new_images_generator.generate_object_view();
+      memcpy(a, new_images_generator.a, sizeof(a));
+    }
 
-    int current_detected_point_number = point_detector->detect(&(new_images_generator.smoothed_generated_object_view->image),
+    int current_detected_point_number = point_detector->detect(view ? view : &(new_images_generator.smoothed_generated_object_view->image),
                                                                  model_points_2d, K * max_point_number_on_model);
 
     for(int i = 0; i < current_detected_point_number; i++)
     {
       keypoint * k = model_points_2d + i;
       float nu, nv;
-      new_images_generator.inverse_affine_transformation(PyrImage::convCoordf(k->u, int(k->scale), 0),
+      affine_image_generator::inverse_affine_transformation(a,
+                                                         new_images_generator.affine_image->width,
+                                                         new_images_generator.affine_image->height,
+                                                         PyrImage::convCoordf(k->u, int(k->scale), 0),
                                                          PyrImage::convCoordf(k->v, int(k->scale), 0),
                                                          nu, nv);
 
@@ -1544,34 +2498,45 @@ void planar_object_recognizer::detect_most_stable_model_points(int max_point_num
                                           int(PyrImage::convCoordf(k->u, int(k->scale), 0)),
                                           int(PyrImage::convCoordf(k->v, int(k->scale), 0))))
       {
-        pair<object_keypoint, int> * mp = search_for_existing_model_point(&tmp_model_points, nu, nv, int(k->scale));
+        pair<object_keypoint, int> * mp = candidates.search(nu, nv, int(k->scale));
 
         if (mp != 0)  // Agglomerate clustered keypoints into one single keypoint
-        {
-          // move the keypoint coordinates in the center of gravity of
-          // all agglomerated keypoints.
-          double n = double(++mp->second);
-          mp->first.M[0] = (mp->first.M[0]*(n-1) + nu)/n;
-          mp->first.M[1] = (mp->first.M[1]*(n-1) + nv)/n;
-        }
+          candidates.merge(mp, nu, nv);
         else
-        {
-          object_keypoint op;
-          op.M[0] = nu;
-          op.M[1] = nv;
-          op.M[2] = 0;
-          op.scale = k->scale;
-          tmp_model_points.push_back(pair<object_keypoint, int>(op, 1));
-        }
+          candidates.add(nu, nv, k->scale);
+      }
+    }
+
+    if (view != 0)
+      delete view;
+
+    views_done = j + 1;
+    if (stable_point_tolerance > 0 && views_done >= 30 && views_done % 10 == 0 && views_done < view_nb)
+    {
+      int undecided = undecided_candidate_number(candidates.points, views_done, max_point_number_on_model, min_view_rate);
+      if (undecided <= stable_point_tolerance * max_point_number_on_model)
+        stable_checks++;
+      else
+        stable_checks = 0;
+
+      if (stable_checks >= 2)
+      {
+        cout << undecided << " undecided candidates: stopping after " << views_done << " of " << view_nb << " views." << endl;
+        break;
       }
     }
   }
+  used_views_number = views_done;
 
+  // Stops the workers still warping views if the search stopped early:
+  if (producer != 0)
+    delete producer;
   new_images_generator.set_use_random_background(use_random_background);
 
+  vector< pair<object_keypoint, int> > & tmp_model_points = candidates.points;
   sort(tmp_model_points.begin(), tmp_model_points.end(), cmp_tmp_model_points);
 
-  int min_views = int(min_view_rate * (double)view_nb);
+  int min_views = int(min_view_rate * (double)views_done);
   int i;
   model_points = new object_keypoint[max_point_number_on_model];
   vector< pair<object_keypoint, int> >::iterator it;
@@ -1595,6 +2560,26 @@ void planar_object_recognizer::detect_most_stable_model_points(int max_point_num
   cout << i << " points in total." << endl;
   model_point_number = i;
 
+  // Unstable keypoints on the target that are not close to a model point are
+  // also used as cascade background.
+  float min_background_dist2 = gf_sqr(patch_size / 4.f);
+  for( ; it < tmp_model_points.end() && int(background_points.size()) < max_point_number_on_model; it++)
+  {
+    bool close_to_model_point = false;
+    for(int j = 0; j < model_point_number && !close_to_model_point; j++)
+      if (model_points[j].scale == it->first.scale &&
+          gf_sqr(float(model_points[j].M[0] - it->first.M[0])) +
+          gf_sqr(float(model_points[j].M[1] - it->first.M[1])) < min_background_dist2)
+        close_to_model_point = true;
+
+    if (!close_to_model_point)
+    {
+      background_points.push_back(it->first);
+      background_points.back().class_index = -1;
+    }
+  }
+  cout << background_points.size() << " background keypoints." << endl;
+
   new_images_generator.set_object_keypoints(model_points, model_point_number);
 
   delete [] model_points_2d;
@@ -1969,6 +2954,8 @@ void planar_object_recognizer::get_ui_settings()
     match_score_threshold       = match_score_threshold_ui;
     best_support_thresh         = best_support_thresh_ui;
     point_detector_tau          = point_detector_tau_ui;
+    cascade_threshold           = cascade_threshold_ui;
+    tracking_gate_radius        = tracking_gate_radius_ui;
 
 }
 void planar_object_recognizer::put_ui_settings()
@@ -1980,6 +2967,8 @@ void planar_object_recognizer::put_ui_settings()
     match_score_threshold_ui    = match_score_threshold;
     best_support_thresh_ui      = best_support_thresh;
     point_detector_tau_ui       = point_detector_tau;
+    cascade_threshold_ui        = cascade_threshold;
+    tracking_gate_radius_ui     = tracking_gate_radius;
 }
 
 void planar_object_recognizer::dump()
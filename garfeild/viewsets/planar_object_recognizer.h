@@ -47,6 +47,47 @@
 static const int hard_max_detected_pts = 5000;
 static const int MATCH_LOOKUP_TABLE_SIZE = hard_max_detected_pts;
 
+/*!
+\ingroup viewsets
+\brief Candidate model points of planar_object_recognizer::detect_most_stable_model_points().
+
+Every candidate counts the views it was detected in. Candidates are indexed
+by pyramid level in uniform grids of cells as large as the merge distance,
+so that a search only looks at 3x3 cells.
+*/
+class model_point_candidates
+{
+public:
+  //! Grids covering a \a width x \a height level 0 image; candidates outside land in the border cells.
+  model_point_candidates(int width, int height, double distance_threshold);
+
+  /*! The first candidate, in insertion order, of level \a scale closer than
+    the distance threshold to (\a u, \a v), or 0. The same as a linear scan
+    of \a points.
+  */
+  pair<object_keypoint, int> * search(float u, float v, int scale);
+  //! Adds a candidate detected once.
+  void add(float u, float v, float scale);
+  //! Counts one more detection of \a mp at (\a u, \a v), and moves it to
+  //! the centre of gravity of its detections.
+  void merge(pair<object_keypoint, int> * mp, float u, float v);
+
+  //! The candidates and their detection counts, in insertion order.
+  vector< pair<object_keypoint, int> > points;
+
+private:
+  int cell_index(int level, float u, float v);
+  //! Makes sure there are grids for levels 0 to \a level_number - 1.
+  void add_levels(int level_number);
+
+  int width, height;
+  double distance_threshold;
+  float cell_size;
+  //! Per level: columns, rows and the candidate indices in every cell.
+  vector<int> columns, rows;
+  vector< vector< vector<int> > > cells;
+};
+
 /*!
 \ingroup viewsets
 \brief Planar object detector
@@ -153,6 +194,9 @@ public:
   - \c match_points
   - \c estimate_affine_transformation
   - \c estimate_homographic_transformation_nonlinear_method
+
+  While tracking, the last two are replaced by
+  \c track_with_predicted_homography.
   */
   bool detect(IplImage * input_image);
 
@@ -171,7 +215,26 @@ public:
   /// damian: multithreaded
   bool estimate_affine_transformation_mt(void);
   bool estimate_homographic_transformation_linear_method(void);
-  bool estimate_homographic_transformation_nonlinear_method(void);
+  //! Starts from H instead of affine_motion if \a from_H.
+  bool estimate_homographic_transformation_nonlinear_method(bool from_H = false);
+  //! Inliers of H after the last estimate_homographic_transformation_nonlinear_method()
+  int homography_inlier_number;
+
+  /*! Tracking mode: once the object was found, the H of the previous frame
+    predicts where each model point appears. The matches whose model point
+    it projects within tracking_gate_radius pixels of their image point are
+    refined straight away by estimate_homographic_transformation_nonlinear_method(),
+    from that H, without affine RANSAC. detect() falls back to RANSAC when
+    fewer than tracking_min_inliers matches agree with the prediction or
+    survive the refinement. Default = true.
+  */
+  bool use_tracking;
+  float tracking_gate_radius;
+  float tracking_gate_radius_ui;
+  int tracking_min_inliers;
+  //! Whether the next detect() starts from the H of the last frame (set by detect())
+  bool tracking;
+  bool track_with_predicted_homography(void);
   //@}
 
   //! keypoints on the object. (X, Y) = coordinates in the original image, Z = 0.
@@ -185,21 +248,59 @@ public:
   int detected_point_number;
   image_class_example *detected_point_views;
 
-  //! Match probabilities for each detected keypoint
+  //! Match probabilities for each detected keypoint. The rows point into match_probability_block.
   float * match_probabilities[hard_max_detected_pts];
+
+  //@{
+  /** \name Detection buffers
+    The patches of detected_point_views live in one aligned block,
+    patch_arena, and the match_probabilities rows in another one.
+    Both are sized for max_detected_pts keypoints.
+  */
+  void allocate_detection_buffers(int patch_size);
+  void release_detection_buffers(void);
+  unsigned char * patch_arena;
+  float * match_probability_block;
+  //! Number of keypoints the detection buffers were allocated for.
+  int detection_buffer_capacity;
+  //! Patch size the detection buffers were allocated for.
+  int detection_buffer_patch_size;
+  //@}
   //! Matches between the detected keypoints, and the model keypoints
   image_object_point_match matches[hard_max_detected_pts];
   //! Matches lookup table
   short match_index_lookup[MATCH_LOOKUP_TABLE_SIZE];
   void construct_match_lut();
 
+  //@{
+  /** \name RANSAC sampling
+    With use_prosac_sampling (the default), the matches above
+    match_score_threshold are sorted by score once per frame, and hypothesis
+    t is drawn from the prosac_top_size[t] best of them. That set grows as in
+    PROSAC (Chum and Matas, 2005): the first hypotheses come from the best
+    matches, the last ones from all of them. Otherwise the samples are drawn
+    from match_index_lookup, see do_proportional_match_lut.
+  */
+  bool use_prosac_sampling;
+  //! Called once per frame, before sample_correspondences().
+  void prepare_ransac_sampling(void);
+  //! The 3 matches of hypothesis \a t (from 0) of the frame.
+  bool sample_correspondences(int t, int * n1, int * n2, int * n3);
+  void construct_prosac_schedule(void);
+  //! Indices of the matches above match_score_threshold, best score first.
+  vector<int> prosac_order;
+  vector<int> prosac_top_size;
+  //! Whether hypothesis t includes the worst match of its set, that it is the first to use.
+  vector<char> prosac_includes_last;
+  //@}
+
 
   int match_number;
 
   bool object_is_detected;
   affinity * affine_motion;
   homography * H;
-  ls_minimizer2 * homography_estimator;
+  homography_refiner * homography_estimator;
   float detected_u_corner1, detected_v_corner1;
   float detected_u_corner2, detected_v_corner2;
   float detected_u_corner3, detected_v_corner3;
@@ -232,8 +333,6 @@ public:
 
   object_view * object_input_view;
 
-  pair<object_keypoint, int> * search_for_existing_model_point(vector< pair<object_keypoint, int> > * tmp_model_points,
-    float cu, float cv, int scale);
   void detect_most_stable_model_points(int max_point_number_on_model,
                                        int patch_size, int view_number,
                                        double min_view_rate,
@@ -243,15 +342,100 @@ public:
   //! Image classifier
   image_classification_forest * forest;
 
+  //@{
+  /** \name Two-stage cascade
+    A small two-class forest (0 = object, 1 = background) evaluated before the
+    full forest. Keypoints whose background probability is above
+    cascade_threshold are rejected: they skip the full forest and get no match.
+  */
+  image_classification_forest * cascade;
+  //! Learn the cascade from model_points and background_points.
+  void learn_cascade(int patch_size, LEARNPROGRESSION LearnProgress=0);
+  //! Default = true. Ignored if no cascade was learnt for this model.
+  bool use_cascade;
+  //! Default = 0.8
+  float cascade_threshold;
+  float cascade_threshold_ui;
+  //! Default = 3
+  int cascade_tree_number;
+  //! Default = 8
+  int cascade_max_depth;
+  //! average rate of keypoints rejected by the cascade (set by match_points)
+  float cascade_rejection_rate;
+  //! Keypoints used as background examples by learn_cascade(). Filled by detect_most_stable_model_points().
+  vector<object_keypoint> background_points;
+  //@}
+
+  //@{
+  /** \name Early rejection of bad hypotheses
+    Wald's sequential probability ratio test, as in Chum and Matas'
+    randomized RANSAC: a hypothesis is verified 4 matches at a time and
+    dropped once the likelihood ratio of "bad model" against "good model"
+    exceeds A. epsilon, the inlier ratio of a good model, is that of the best
+    hypothesis so far but at least what best_support_thresh requires; delta,
+    the rate of matches a bad model agrees with, is learnt from the rejected
+    hypotheses. The hypothesis that wins is always fully verified, so the
+    inlier count does not change; the risk of rejecting it is about 1/A.
+    Default = true.
+  */
+  bool use_sprt;
+  class sprt_state
+  {
+  public:
+    bool active;
+    double epsilon, delta;
+    double log_A, log_consistent, log_inconsistent;
+    int best_support;
+    //! matches checked and found consistent in the rejected hypotheses, with a prior
+    double rejected_checks, rejected_consistent;
+    int rejections_since_update;
+    //! statistics for avg_match_evaluations
+    int hypotheses, evaluations;
+  };
+  //! Resets \a sprt for a new frame.
+  void start_sprt(sprt_state & sprt);
+  //! Recomputes epsilon, delta and A after the best support changed or after rejections.
+  void update_sprt(sprt_state & sprt, int best_support);
+  //! Average number of matches verified per hypothesis (set by ransac internals)
+  float avg_match_evaluations;
+  //@}
+
   // For position estimation:
   int compute_support_for_affine_transformation(affinity * A);
-  int compute_support_for_affine_transformation_readonly(affinity * A);
+  int compute_support_for_affine_transformation_readonly(affinity * A, sprt_state * sprt = 0);
+
+  //@{
+  /** \name Level 0 match coordinates
+    The model and image coordinates of the matches, at level 0, in 16 byte
+    aligned arrays padded to a multiple of 4 matches. Computed once per frame
+    by compute_match_coordinates() and shared by all the RANSAC variants.
+  */
+  void compute_match_coordinates(void);
+  //! Number of matches \a a (2x3, row major) maps closer than ransac_dist_threshold
+  //! to their image point. Sets their inlier flags if \a set_inlier_flags.
+  //! With \a sprt, returns 0 as soon as the test rejects \a a.
+  int count_affine_inliers(const float a[6], bool set_inlier_flags, sprt_state * sprt = 0);
+  float * match_coordinate_block;
+  //! Indexed by match, for the samples.
+  float * match_model_u, * match_model_v, * match_image_u, * match_image_v;
+  //! The same coordinates in the order the hypotheses are verified in:
+  //! shuffled when use_sprt is set, since the test assumes random order.
+  float * verify_model_u, * verify_model_v, * verify_image_u, * verify_image_v;
+  int * verify_match_index;
+  //@}
+
   bool three_random_correspondences(int * n1, int * n2, int * n3);
   bool valid(affinity * A);
 
   int max_detected_pts;
   int max_depth;
 
+  //! Default = true: only compute the gradients in the tiles around the
+  //! detected keypoints, instead of over the whole pyramid.
+  bool use_lazy_gradient;
+  //! Fraction of the gradient tiles computed for the last frame (lazy gradients only).
+  float computed_gradient_fraction;
+
   //! Some parameters for fine tuning:
   //! Called by the 2 constructors
   void default_settings(void);
@@ -263,11 +447,63 @@ public:
   //! number of generated views for finding stable points
   int views_number;
 
+  //! Number of threads generating training views and examples, and testing
+  //! the forest and the cascade. Default = 0: one per online cpu. 1 generates them serially, on the calling thread.
+  int training_thread_number;
+
+  /*! Seed of the random numbers of training and RANSAC, set by learn() and
+    load(). Default = 1. With the same seed, runs are reproducible whatever
+    the number of threads.
+  */
+  unsigned int random_seed;
+
+  /*! Directory of the training example caches (see cached_example_generator).
+    Default = "": no cache, the examples are generated on every learn().
+  */
+  string example_cache_directory;
+  //! Refines \a classifier with \a call_number batches of examples, from the
+  //! cache and the producer threads when they are enabled. Resumes from and
+  //! writes to the refinement checkpoint \a checkpoint_name.
+  void refine_with_training_examples(image_classification_forest * classifier, int call_number,
+                                     const string & checkpoint_name);
+
+  /*! Directory of the training checkpoints. learn() writes one after the
+    stable model points and after the forest, and every checkpoint_interval
+    refinement calls. It resumes from the last one if it was made from the
+    same image, parameters and random_seed; save() removes them. Default = "":
+    no checkpoints, except build_with_cache() that uses
+    <model>.classifier/checkpoint.
+  */
+  string checkpoint_directory;
+  //! Refinement calls between two checkpoints. Default = 25.
+  int checkpoint_interval;
+  //! Training phases completed by a checkpoint.
+  enum { NO_CHECKPOINT, MODEL_POINTS_CHECKPOINT, FOREST_CHECKPOINT };
+  string training_fingerprint(int max_point_number_on_model, int patch_size,
+                              int yape_radius, int tree_number, int nbLev);
+  void save_training_checkpoint(int phase, const string & fingerprint);
+  //! Restores the model points and the forest of a matching checkpoint.
+  //! \return the phase it completed.
+  int load_training_checkpoint(const string & fingerprint, LEARNPROGRESSION LearnProgress);
+  void remove_training_checkpoint(void);
+
+  /*! Adaptive stable point search: detect_most_stable_model_points() stops
+    before views_number views once at most stable_point_tolerance *
+    max_point_number_on_model candidates are still too close to the selection
+    threshold to be decided. Default = 0: all the views are generated.
+  */
+  double stable_point_tolerance;
+  //! Adaptive refinement of the forest and the cascade, see
+  //! image_classification_forest::set_refinement_tolerance(). Default = 0: disabled.
+  float refinement_tolerance;
+  //! Views and refinement calls used by the last learn(), written to training_log.txt by save().
+  int used_views_number, used_refinement_call_number, used_cascade_call_number;
+
   //! minimum visible rate for determining stable keypoints
   double min_view_rate;
 
   /*! interest points that are closer than this distance are merged by
-  * by search_for_existing_model_point().
+  * by detect_most_stable_model_points().
   */
   double keypoint_distance_threshold;
 
@@ -293,6 +529,19 @@ public:
   //! average actual number of iterations preformed for RANSAC (set by ransac internals)
   int avg_ransac_iterations;
 
+  /*! Adaptive RANSAC termination: stop once the best hypothesis so far makes
+    it \a ransac_confidence likely that an all inlier sample was drawn, given
+    its inlier ratio. Default = 0.99; 0 always runs max_ransac_iterations.
+    The threads of estimate_affine_transformation_mt() share the best support
+    as they go, so the number of hypotheses it evaluates, and thus its result,
+    can vary from run to run unless this is 0.
+  */
+  float ransac_confidence;
+  //! Hypotheses needed for ransac_confidence with \a support inliers, at most max_ransac_iterations.
+  int adaptive_ransac_iterations(int support);
+  //! Best support found so far by the estimate_affine_transformation_mt() threads.
+  volatile int shared_best_support;
+
   /*! RANSAC will stop if it finds a transformation that satisfies at least
    *  ransac_stop_support matches.
    */
@@ -334,7 +583,13 @@ public:
 
 private:
 
-  static void* estimate_affine_transformation_thread_func(void* data);
+  //! estimate_affine_transformation_mt() task: one interleaved share of the hypotheses.
+  static void estimate_affine_task(void* detector, int task);
+  //! preprocess_points() task: one chunk of preprocess_tasks.
+  static void preprocess_points_task(void* detector, int task);
+
+  //! Orientation estimation and patch extraction for \a count keypoints lying inside the image.
+  void preprocess_point_range(image_class_example ** points, int count);
 
   // thread-safe fetch of external UI settings to detection thread
   void get_ui_settings();
@@ -342,25 +597,49 @@ private:
   // set external UI settings to the values of our internal settings
   void put_ui_settings();
 
-  class EstimateAffineThreadData
+  class EstimateAffineTask
   {
   public:
-    EstimateAffineThreadData() : start_signal( 0 ) {};
-    pthread_t thread;
-    int thread_id;
+    EstimateAffineTask() : randoms( 0 ), transformed_points( 0 ), coefficients( 0 ), support( 0 ),
+      hypothesis_valid( 0 ), buffer_block( 0 ), capacity( 0 ) {};
+    ~EstimateAffineTask() { if ( buffer_block ) free( buffer_block ); }
+    //! Grows the hypothesis buffers to \a n hypotheses, in one block aligned on cache lines.
+    void reserve( int n );
 
-    planar_object_recognizer* detector;
+    int task_id;
     affinity A;
     int A_support;
     int num_ransac_iterations;
+    //! hypotheses actually evaluated, fewer than num_ransac_iterations after an adaptive stop
+    int num_evaluated_iterations;
+    sprt_state sprt;
+    //! stream of the global seed the RANSAC samples are drawn from
+    unsigned long long rng_stream;
+
+    // hypothesis buffers, for capacity hypotheses
+    int * randoms;
+    float * transformed_points;
+    float * coefficients;
+    int * support;
+    char * hypothesis_valid;
+
+  private:
+    char * buffer_block;
+    int capacity;
+  };
 
-    FSemaphore start_signal;
-    FBarrier* barrier;
-    bool should_stop;
+  vector<EstimateAffineTask*> affine_tasks;
+
+  class PreprocessTask
+  {
+  public:
+    image_class_example ** points;
+    int point_count;
   };
 
-  FBarrier* shared_barrier;
-  vector<EstimateAffineThreadData*> affine_thread_data;
+  vector<PreprocessTask> preprocess_tasks;
+  //! Inside the image keypoints handed to the preprocess tasks.
+  vector<image_class_example *> inside_points;
 
   FSemaphore detector_sem;
 
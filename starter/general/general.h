@@ -26,6 +26,7 @@
 #define GENERAL_H
 
 #include <stdlib.h>
+#include "rng.h"
 
 float rand_01(void);
 float rand_m1p1(void);
@@ -44,7 +45,7 @@ int gf_sqr(const int x);
 
 inline float rand_01(void)
 {
-  return (rand() % RAND_MAX) / (float)RAND_MAX;
+  return gf_thread_rng().uniform_01();
 }
 
 inline float rand_m1p1(void)
@@ -0,0 +1,77 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rng.h"
+
+GF_THREAD_LOCAL gf_rng gf_thread_rng_state;
+GF_THREAD_LOCAL bool gf_thread_rng_seeded = false;
+
+// glibc's rand() starts from seed 1 too:
+static unsigned long long global_seed = 1;
+// Streams of the threads that never seeded themselves:
+static volatile long long next_new_thread_stream = 1LL << 62;
+
+static unsigned long long splitmix64(unsigned long long & x)
+{
+  unsigned long long z = (x += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+void gf_rng::seed(unsigned long long seed, unsigned long long stream)
+{
+  unsigned long long x = seed;
+  unsigned long long mixed_stream = splitmix64(stream);
+  x ^= mixed_stream;
+
+  unsigned long long a = splitmix64(x);
+  unsigned long long b = splitmix64(x);
+  s[0] = (unsigned int)a;
+  s[1] = (unsigned int)(a >> 32);
+  s[2] = (unsigned int)b;
+  s[3] = (unsigned int)(b >> 32);
+
+  // The all zero state is the only one the generator never leaves:
+  if ((s[0] | s[1] | s[2] | s[3]) == 0)
+    s[0] = 1;
+}
+
+void gf_set_rng_seed(unsigned long long seed)
+{
+  global_seed = seed;
+  gf_seed_thread_rng(0);
+}
+
+unsigned long long gf_get_rng_seed(void)
+{
+  return global_seed;
+}
+
+void gf_seed_thread_rng(unsigned long long stream)
+{
+  gf_thread_rng_state.seed(global_seed, stream);
+  gf_thread_rng_seeded = true;
+}
+
+void gf_seed_new_thread_rng(void)
+{
+  gf_seed_thread_rng((unsigned long long)__sync_fetch_and_add(&next_new_thread_stream, 1));
+}
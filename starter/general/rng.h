@@ -0,0 +1,117 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+#ifdef WIN32
+#define GF_THREAD_LOCAL __declspec(thread)
+#else
+#define GF_THREAD_LOCAL __thread
+#endif
+
+/*! \brief A small and fast pseudo random number generator.
+
+  xoshiro128** (Blackman and Vigna): 128 bits of state, 32 bit outputs. Unlike
+  rand(), it has no hidden shared state. Each thread draws from its own
+  generator (gf_thread_rng()). All of them are seeded from one global seed
+  (gf_set_rng_seed()), so runs can be reproduced.
+
+  It has no constructor, so that it can be thread local: call seed() first.
+*/
+struct gf_rng
+{
+  unsigned int s[4];
+
+  //! Seeds stream \a stream of \a seed. Different streams of a seed are independent.
+  void seed(unsigned long long seed, unsigned long long stream);
+
+  unsigned int next(void)
+  {
+    const unsigned int result = rotl(s[1] * 5, 7) * 9;
+    const unsigned int t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 11);
+
+    return result;
+  }
+
+  unsigned long long next64(void)
+  {
+    unsigned long long high = next();
+    return (high << 32) | next();
+  }
+
+  //! In [0, n), n > 0. Multiply and shift: no division, and no bias for small n.
+  unsigned int uniform(unsigned int n)
+  {
+    return (unsigned int)(((unsigned long long)next() * n) >> 32);
+  }
+
+  //! In [0, 1).
+  float uniform_01(void)
+  {
+    return (next() >> 8) * (1.f / 16777216.f);
+  }
+
+  static unsigned int rotl(unsigned int x, int k) { return (x << k) | (x >> (32 - k)); }
+};
+
+//! Sets the global seed and reseeds the calling thread with its stream 0.
+void gf_set_rng_seed(unsigned long long seed);
+unsigned long long gf_get_rng_seed(void);
+
+/*! Reseeds the calling thread's generator with stream \a stream of the global
+  seed. Workers whose numbers must not depend on thread scheduling reseed for
+  every unit of work, from a stream index that identifies the work.
+*/
+void gf_seed_thread_rng(unsigned long long stream);
+//! Seeds a thread that was never seeded, with a stream of its own.
+void gf_seed_new_thread_rng(void);
+
+extern GF_THREAD_LOCAL gf_rng gf_thread_rng_state;
+extern GF_THREAD_LOCAL bool gf_thread_rng_seeded;
+
+//! The calling thread's generator.
+inline gf_rng & gf_thread_rng(void)
+{
+  if (!gf_thread_rng_seeded)
+    gf_seed_new_thread_rng();
+  return gf_thread_rng_state;
+}
+
+//! Replaces rand(): in [0, 2^31 - 1].
+inline int gf_rand(void)
+{
+  return int(gf_thread_rng().next() >> 1);
+}
+
+//! Replaces rand() % n: in [0, n), n > 0.
+inline int gf_rand(int n)
+{
+  return int(gf_thread_rng().uniform((unsigned int)n));
+}
+
+#endif // RNG_H
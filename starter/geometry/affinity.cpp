@@ -22,6 +22,11 @@
  along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "affinity.h"
 
 #include "../../artvertiser/FProfiler/FProfiler.h"
@@ -154,6 +159,92 @@ bool affinity::estimate_post()
   return true;
 }
 
+// Twice the area of the sample triangle under which it is degenerate, in pixels^2:
+#define AFFINITY_MIN_SAMPLE_DET 1e-3f
+
+void affinity::estimate_batch(const float * samples, int n, float * a, char * valid,
+                              float min_det, float max_det)
+{
+  // With p1 as origin, for each row (a0 a1 a2) and target x (up or vp):
+  // a0 = (dx2 dv3 - dx3 dv2) / D, a1 = (du2 dx3 - du3 dx2) / D, a2 = x1 - a0 u1 - a1 v1
+  // where D = du2 dv3 - du3 dv2 is the determinant of the 3x3 system.
+  int i = 0;
+
+#ifdef __SSE2__
+  const __m128 sign = _mm_set1_ps(-0.f), one = _mm_set1_ps(1.f);
+  const __m128 min_sample_det = _mm_set1_ps(AFFINITY_MIN_SAMPLE_DET);
+  const __m128 min_d = _mm_set1_ps(min_det), max_d = _mm_set1_ps(max_det);
+
+  for(; i + 4 <= n; i += 4)
+  {
+    const float * s = samples + 12 * i;
+    __m128 u[3], v[3], up[3], vp[3];
+    for(int j = 0; j < 3; j++)
+    {
+      __m128 r0 = _mm_loadu_ps(s + 4 * j);
+      __m128 r1 = _mm_loadu_ps(s + 12 + 4 * j);
+      __m128 r2 = _mm_loadu_ps(s + 24 + 4 * j);
+      __m128 r3 = _mm_loadu_ps(s + 36 + 4 * j);
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      u[j] = r0; v[j] = r1; up[j] = r2; vp[j] = r3;
+    }
+
+    __m128 du2 = _mm_sub_ps(u[1], u[0]), dv2 = _mm_sub_ps(v[1], v[0]);
+    __m128 du3 = _mm_sub_ps(u[2], u[0]), dv3 = _mm_sub_ps(v[2], v[0]);
+    __m128 D = _mm_sub_ps(_mm_mul_ps(du2, dv3), _mm_mul_ps(du3, dv2));
+    __m128 ok = _mm_cmpge_ps(_mm_andnot_ps(sign, D), min_sample_det);
+    __m128 inv_D = _mm_div_ps(one, D);
+
+    __m128 r[6];
+    for(int k = 0; k < 2; k++)
+    {
+      const __m128 * x = k == 0 ? up : vp;
+      __m128 dx2 = _mm_sub_ps(x[1], x[0]), dx3 = _mm_sub_ps(x[2], x[0]);
+      __m128 c0 = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(dx2, dv3), _mm_mul_ps(dx3, dv2)), inv_D);
+      __m128 c1 = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(du2, dx3), _mm_mul_ps(du3, dx2)), inv_D);
+      r[3 * k + 0] = c0;
+      r[3 * k + 1] = c1;
+      r[3 * k + 2] = _mm_sub_ps(_mm_sub_ps(x[0], _mm_mul_ps(c0, u[0])), _mm_mul_ps(c1, v[0]));
+    }
+
+    __m128 det = _mm_sub_ps(_mm_mul_ps(r[0], r[4]), _mm_mul_ps(r[3], r[1]));
+    ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(det, min_d), _mm_cmple_ps(det, max_d)));
+    int mask = _mm_movemask_ps(ok);
+
+    float out[6][4];
+    for(int c = 0; c < 6; c++)
+      _mm_storeu_ps(out[c], r[c]);
+    for(int k = 0; k < 4; k++)
+    {
+      for(int c = 0; c < 6; c++)
+        a[6 * (i + k) + c] = out[c][k];
+      valid[i + k] = (mask >> k) & 1;
+    }
+  }
+#endif
+
+  for(; i < n; i++)
+  {
+    const float * s = samples + 12 * i;
+    float du2 = s[4] - s[0], dv2 = s[5] - s[1];
+    float du3 = s[8] - s[0], dv3 = s[9] - s[1];
+    float D = du2 * dv3 - du3 * dv2;
+    float inv_D = 1.f / D;
+    float * r = a + 6 * i;
+
+    for(int k = 0; k < 2; k++)
+    {
+      float dx2 = s[6 + k] - s[2 + k], dx3 = s[10 + k] - s[2 + k];
+      r[3 * k + 0] = (dx2 * dv3 - dx3 * dv2) * inv_D;
+      r[3 * k + 1] = (du2 * dx3 - du3 * dx2) * inv_D;
+      r[3 * k + 2] = s[2 + k] - r[3 * k + 0] * s[0] - r[3 * k + 1] * s[1];
+    }
+
+    float det = r[0] * r[4] - r[3] * r[1];
+    valid[i] = fabsf(D) >= AFFINITY_MIN_SAMPLE_DET && det >= min_det && det <= max_det;
+  }
+}
+
 void affinity::transform_point(float u, float v, float * up, float * vp)
 {
   *up = float(cvmGet(0, 0) * u + cvmGet(0, 1) * v + cvmGet(0, 2));
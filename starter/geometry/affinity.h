@@ -50,6 +50,18 @@ public:
                 float u2, float v2, float up2, float vp2,
                 float u3, float v3, float up3, float vp3);
 
+  //! Sets the 2x3 upper part, row major.
+  void set_coefficients(const float a[6]);
+
+  /*! Closed-form affinities of \a n 3-point samples, packed as for
+    estimate(float*): 12 floats per sample. Solves 4 samples per step with
+    SSE. Writes the 2x3 coefficients of sample i, row major, to a + 6 * i,
+    and sets valid[i] if the sample is not degenerate and the determinant
+    of the linear part is in [min_det, max_det].
+  */
+  static void estimate_batch(const float * samples, int n, float * a, char * valid,
+                             float min_det, float max_det);
+
   void transform_point(float u, float v, float * up, float * vp);
   void transform_point(double u, double v, double * up, double * vp);
 
@@ -91,6 +103,12 @@ inline void  affinity::cvmSet(const int i, const int j, const double val)
   data.fl[3 * i + j] = (float)val;
 }
 
+inline void affinity::set_coefficients(const float a[6])
+{
+  data.fl[0] = a[0]; data.fl[1] = a[1]; data.fl[2] = a[2];
+  data.fl[3] = a[3]; data.fl[4] = a[4]; data.fl[5] = a[5];
+}
+
 inline float cvmGet(const affinity * A, const int i, const int j)
 {
   assert (A->rows == 3 && A->cols == 3);
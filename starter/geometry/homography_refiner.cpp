@@ -0,0 +1,258 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <math.h>
+#include <limits>
+
+#include "homography_refiner.h"
+
+using namespace std;
+
+homography_refiner::homography_refiner(void)
+{
+  observations = 0;
+  observation_number = capacity = 0;
+  squared_c = numeric_limits<flt_t>::max();
+
+  // ls_minimizer2 defaults:
+  max_iterations = 50;
+  max_failures_in_a_row = 10;
+  tol_cos = 1e-5;
+  residual = 0;
+
+  for(int i = 0; i < 8; i++)
+    state[i] = 0;
+}
+
+homography_refiner::~homography_refiner()
+{
+  if (observations) delete [] observations;
+}
+
+void homography_refiner::reserve(int n)
+{
+  if (n <= capacity)
+    return;
+
+  flt_t * new_observations = new flt_t[4 * n];
+  if (observations)
+  {
+    memcpy(new_observations, observations, 4 * observation_number * sizeof(flt_t));
+    delete [] observations;
+  }
+  observations = new_observations;
+  capacity = n;
+}
+
+void homography_refiner::add_observation(flt_t u, flt_t v, flt_t up, flt_t vp)
+{
+  if (observation_number == capacity)
+    reserve(capacity < 64 ? 64 : 2 * capacity);
+
+  flt_t * o = observations + 4 * observation_number;
+  o[0] = u; o[1] = v; o[2] = up; o[3] = vp;
+  observation_number++;
+}
+
+void homography_refiner::set_robust_threshold(flt_t c)
+{
+  if (c >= sqrt(numeric_limits<flt_t>::max()))
+    squared_c = numeric_limits<flt_t>::max();
+  else
+    squared_c = c * c;
+}
+
+homography_refiner::flt_t homography_refiner::build_normal_equations(const flt_t s[8], flt_t JtJ[8 * 8], flt_t Jteps[8])
+{
+  flt_t result = 0;
+
+  if (JtJ)
+  {
+    for(int i = 0; i < 8 * 8; i++) JtJ[i] = 0;
+    for(int i = 0; i < 8; i++) Jteps[i] = 0;
+  }
+
+  for(int k = 0; k < observation_number; k++)
+  {
+    const flt_t * o = observations + 4 * k;
+    flt_t den = 1. / (s[6] * o[0] + s[7] * o[1] + 1.);
+    flt_t fu = (s[0] * o[0] + s[1] * o[1] + s[2]) * den;
+    flt_t fv = (s[3] * o[0] + s[4] * o[1] + s[5]) * den;
+    flt_t eu = o[2] - fu, ev = o[3] - fv;
+    flt_t res = eu * eu + ev * ev;
+
+    if (res >= squared_c)
+    {
+      result += squared_c;
+      continue;
+    }
+    result += res;
+
+    if (JtJ == 0)
+      continue;
+
+    // The two rows of the Jacobian of H(u, v):
+    flt_t g[3] = { o[0] * den, o[1] * den, den };
+    flt_t Ju[8] = { g[0], g[1], g[2], 0, 0, 0, -fu * g[0], -fu * g[1] };
+    flt_t Jv[8] = { 0, 0, 0, g[0], g[1], g[2], -fv * g[0], -fv * g[1] };
+
+    for(int i = 0; i < 8; i++)
+    {
+      flt_t * row = JtJ + 8 * i;
+      for(int j = i; j < 8; j++)
+        row[j] += Ju[i] * Ju[j] + Jv[i] * Jv[j];
+      Jteps[i] += Ju[i] * eu + Jv[i] * ev;
+    }
+  }
+
+  if (JtJ)
+    for(int i = 1; i < 8; i++)
+      for(int j = 0; j < i; j++)
+        JtJ[8 * i + j] = JtJ[8 * j + i];
+
+  return result;
+}
+
+bool homography_refiner::solve(const flt_t A[8 * 8], const flt_t b[8], flt_t x[8])
+{
+  // Gaussian elimination with partial pivoting. ls_minimizer2 goes through
+  // ls_step_solver::qr_solve(), which is cvSolve(CV_LU) unless the
+  // Householder QR under SORRY_VINCENT_Y_A_UN_BUG is compiled in. The
+  // operations are not ordered as in either, so the steps agree up to
+  // rounding, not bit for bit:
+  flt_t M[8][9];
+  for(int i = 0; i < 8; i++)
+  {
+    for(int j = 0; j < 8; j++)
+      M[i][j] = A[8 * i + j];
+    M[i][8] = b[i];
+  }
+
+  for(int k = 0; k < 8; k++)
+  {
+    int pivot = k;
+    for(int i = k + 1; i < 8; i++)
+      if (fabs(M[i][k]) > fabs(M[pivot][k]))
+        pivot = i;
+    if (M[pivot][k] == 0)
+      return false;
+    if (pivot != k)
+      for(int j = k; j < 9; j++)
+      {
+        flt_t t = M[k][j]; M[k][j] = M[pivot][j]; M[pivot][j] = t;
+      }
+
+    flt_t inv = 1. / M[k][k];
+    for(int i = k + 1; i < 8; i++)
+    {
+      flt_t f = M[i][k] * inv;
+      if (f == 0) continue;
+      for(int j = k + 1; j < 9; j++)
+        M[i][j] -= f * M[k][j];
+    }
+  }
+
+  for(int i = 7; i >= 0; i--)
+  {
+    flt_t sum = M[i][8];
+    for(int j = i + 1; j < 8; j++)
+      sum -= M[i][j] * x[j];
+    x[i] = sum / M[i][i];
+  }
+  return true;
+}
+
+int homography_refiner::minimize_from(const flt_t initial_state[8])
+{
+  if (observation_number == 0)
+    return -5;
+
+  flt_t JtJ[8 * 8], Jteps[8], aug_JtJ[8 * 8], ds[8], previous_state[8];
+  if (initial_state != state)
+    memcpy(state, initial_state, 8 * sizeof(flt_t));
+
+  flt_t lambda = 0, rho = 0., cosinus = 0.;
+  int iter_nb = 0, failures_in_a_row = 0;
+  int reason = 0;
+  flt_t r_previous = build_normal_equations(state, JtJ, Jteps), r = 0.;
+  residual = r_previous;
+
+  while(iter_nb < max_iterations)
+  {
+    iter_nb++;
+
+    do {
+      memcpy(aug_JtJ, JtJ, sizeof(JtJ));
+      for(int i = 0; i < 8; i++)
+        aug_JtJ[9 * i] = JtJ[9 * i] + lambda * (1 + JtJ[9 * i] * JtJ[9 * i]);
+
+      if (!solve(aug_JtJ, Jteps, ds)) {
+        reason = -1;
+        goto lm_end;
+      }
+
+      for(int i = 0; i < 8; i++) {
+        previous_state[i] = state[i];
+        state[i] = state[i] + ds[i];
+      }
+
+      r = build_normal_equations(state, 0, 0);
+      rho = r_previous - r;
+      if (rho > 0) {
+        // Cosine between the residual vector and its predicted change, J ds,
+        // from the normal equations at the previous state:
+        flt_t eps_Jds = 0, Jds_Jds = 0;
+        for(int i = 0; i < 8; i++)
+        {
+          eps_Jds += Jteps[i] * ds[i];
+          for(int j = 0; j < 8; j++)
+            Jds_Jds += ds[i] * JtJ[8 * i + j] * ds[j];
+        }
+        cosinus = eps_Jds / (sqrt(r_previous) * sqrt(Jds_Jds));
+        residual = r;
+        if (cosinus < tol_cos) {
+          reason = 3;
+          goto lm_end;
+        }
+
+        build_normal_equations(state, JtJ, Jteps);
+        r_previous = r;
+        lambda = lambda / 10;
+
+        failures_in_a_row = 0;
+      }
+      else {
+        memcpy(state, previous_state, sizeof(previous_state));
+        failures_in_a_row++;
+        if (failures_in_a_row > max_failures_in_a_row) {
+          reason = 2;
+          goto lm_end;
+        }
+        if (lambda == 0) lambda = 1e-3; else lambda *= 10;
+      }
+    } while(rho < 0);
+  }
+lm_end:
+  if (iter_nb >= max_iterations)
+    reason = 4;
+
+  return reason;
+}
@@ -0,0 +1,92 @@
+/*
+ Copyright 2010 Damian Stewart <damian@frey.co.nz>
+ Distributed under the terms of the GNU General Public License v3.
+ 
+ This file is part of The Artvertiser.
+ 
+ The Artvertiser is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ The Artvertiser is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU Lesser General Public License
+ along with The Artvertiser.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOMOGRAPHY_REFINER_H
+#define HOMOGRAPHY_REFINER_H
+
+/*! Levenberg-Marquardt refinement of a homography from n correspondences.
+  \ingroup starter
+
+  Specialised version of ls_minimizer2 for the 8 parameters of a homography
+  (h11 h12 h13 h21 h22 h23 h31 h32, h33 = 1): the Jacobians are analytic and
+  the 8x8 normal equations are accumulated on the stack, so a refinement
+  allocates nothing once reserve() was called. The iterations, damping and
+  stop criteria are those of ls_minimizer2::minimize_using_levenberg_marquardt_from()
+  with its default settings. Only the step solver differs (see solve()): the
+  result is the same up to rounding, which ill-conditioned steps can amplify.
+
+\code
+homography_refiner refiner;
+refiner.reserve(n);
+refiner.reset_observations();
+for(...) refiner.add_observation(u, v, up, vp);
+refiner.minimize_from(initial_state);
+// refiner.state holds the result
+\endcode
+*/
+class homography_refiner
+{
+public:
+  typedef double flt_t;
+
+  homography_refiner(void);
+  ~homography_refiner();
+
+  //! Makes room for \a n correspondences.
+  void reserve(int n);
+  //! Call that before adding the correspondences of a new refinement. Keeps the storage.
+  void reset_observations(void) { observation_number = 0; }
+  //! (u, v) in the model maps to (up, vp) in the image.
+  void add_observation(flt_t u, flt_t v, flt_t up, flt_t vp);
+  int get_observation_number(void) const { return observation_number; }
+
+  /*! Robust estimation, as ls_minimizer2::set_default_c(): a correspondence
+    contributes min(||(up, vp) - H(u, v)||^2, c^2) to the residual, and
+    nothing to the steps when over c. Default = +inf, plain least squares.
+  */
+  void set_robust_threshold(flt_t c);
+
+  /*! Minimizes from \a initial_state. Returns the termination reason, as
+    ls_minimizer2: 2 too many failures in a row, 3 cosine criterion, 4 too
+    many iterations, -1 singular normal equations, -5 no correspondence.
+  */
+  int minimize_from(const flt_t initial_state[8]);
+
+  //! The result of the last minimize_from().
+  flt_t state[8];
+
+  int max_iterations;
+  int max_failures_in_a_row;
+  flt_t tol_cos;
+  //! residual of the last minimize_from()
+  flt_t residual;
+
+private:
+  //! Residual at \a s; with \a JtJ, also the normal equations (upper triangle) of the inliers.
+  flt_t build_normal_equations(const flt_t s[8], flt_t JtJ[8 * 8], flt_t Jteps[8]);
+  static bool solve(const flt_t A[8 * 8], const flt_t b[8], flt_t x[8]);
+
+  //! u, v, up, vp of each correspondence
+  flt_t * observations;
+  int observation_number, capacity;
+  flt_t squared_c;
+};
+
+#endif // HOMOGRAPHY_REFINER_H
@@ -28,6 +28,7 @@
 #include <cv.h>
 #include <highgui.h>
 #include <stdio.h>
+#include <general/rng.h>
 #include "mcv.h"
 
 using namespace std;
@@ -554,14 +555,14 @@ IplImage * mcvCreateRandomImage(CvSize size, int depth, int nChannels)
     {
       unsigned char * line = (unsigned char *)result->imageData + l * result->widthStep;
       for(int c = 0; c < nChannels * size.width; c++)
-        line[c] = (unsigned char)(rand() % 256);
+        line[c] = (unsigned char)gf_rand(256);
     }
   else
     for(int l = 0; l < size.height; l++)
     {
       unsigned char * line = (unsigned char *)result->imageData + l * result->widthStep;
       for(int c = 0; c < nChannels * size.width; c += 3)
-        line[c] = line[c + 1] = line[c + 2] = (unsigned char)(rand() % 256);
+        line[c] = line[c + 1] = line[c + 2] = (unsigned char)gf_rand(256);
     }
 
   return result;
@@ -587,7 +588,7 @@ void mcvReplaceByNoise(IplImage * image, int value)
 
     for(int c = 0; c < image->width; c++)
       if (int(line[c]) == value)
-        line[c] = (unsigned char)(rand() % 256);
+        line[c] = (unsigned char)gf_rand(256);
   }
 }
 
@@ -602,7 +603,7 @@ void mcvAddWhiteNoise(const IplImage * image, const int minNoise, const int maxN
     for(int x = 0; x < image->width; x++)
     {
       int p = line[x];
-      int noise = rand() % (2 * deltaNoise + 1) - deltaNoise;
+      int noise = gf_rand(2 * deltaNoise + 1) - deltaNoise;
 
       if (noise < 0) 
         noise -= minNoise;
@@ -628,7 +629,7 @@ void mcvAddWhiteNoise(const IplImage * image, const int maxNoise)
     {
       int p = line[x];
 
-      p += rand() % (2 * maxNoise + 1) - maxNoise;
+      p += gf_rand(2 * maxNoise + 1) - maxNoise;
 
       if (p > 255) 
         p = 255;
@@ -875,7 +876,7 @@ void mcvComputeAffineTransfo(float * a,
 CvScalar mcvRainbowColor(int index, float coeff)
 {
   if (index == -1)
-    index = rand() % 6;
+    index = gf_rand(6);
   else
     index = index % 6;
 
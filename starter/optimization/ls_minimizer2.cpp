@@ -28,6 +28,7 @@
 
 #include <math/mcvm.h>
 #include <math/polynom_solver.h>
+#include <general/rng.h>
 #include "ls_minimizer2.h"
 
 using namespace std;
@@ -999,7 +1000,7 @@ bool ls_minimizer2::pick_random_indices(int *idx, int n, int max_index)
   if ( n > max_index ) return false;
 
   for (int i=0; i<n; i++) {
-    idx[i] = rand()%max_index;
+    idx[i] = gf_rand(max_index);
 
     for (int j=0; j<i; j++)
       if (idx[i]==idx[j]) {
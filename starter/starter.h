@@ -101,6 +101,7 @@
 
 #include <geometry/affinity.h>
 #include <geometry/homography.h>
+#include <geometry/homography_refiner.h>
 #include <geometry/projection_matrix.h>
 
 #include <image/mcv.h>